@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include "keyscanner.h"
+
+/**
+ * Matrix level anti-ghosting, for matrices without (or with leaky) diodes.
+ *
+ * Without a diode per key, pressing three corners of a rectangle in the
+ * matrix also connects the fourth corner: we read a phantom key there. In
+ * general every key we read belongs to a block of rows and columns that are
+ * all connected, and once a block spans two rows and two columns, we can't
+ * tell the real keys in it from the phantoms.
+ *
+ * So, after debouncing, any two rows that have two or more columns in common
+ * mark those columns as ambiguous in both rows. Keys that are already
+ * reported as pressed stay pressed, releases always go through, but a new
+ * press on an ambiguous key is held back until the ambiguity goes away. A
+ * phantom key is always new when it shows up, so it never gets reported.
+ *
+ * The one thing we can't see is a reported key being released while the
+ * rest of its rectangle is held: it keeps reading as pressed. It gets
+ * released as soon as the rectangle breaks up.
+ *
+ * This works a whole row at a time: COUNT_OUTPUT * (COUNT_OUTPUT - 1) / 2
+ * ANDs for the row pairs, instead of looking at every key.
+ */
+
+/*
+ * Updates `report` from the debounced `state` of each row.
+ * Returns the rows that changed in `report`, as a bitmask.
+ */
+static inline
+uint8_t anti_ghosting_filter(const uint8_t *state, uint8_t *report) {
+    uint8_t ambiguous[COUNT_OUTPUT] = {0};
+    uint8_t changed_rows = 0;
+
+    for (uint8_t i = 0; i < COUNT_OUTPUT; i++) {
+        for (uint8_t j = i + 1; j < COUNT_OUTPUT; j++) {
+            uint8_t shared = state[i] & state[j];
+            // Two or more bits set: clearing the lowest one leaves some
+            if (shared & (shared - 1)) {
+                ambiguous[i] |= shared;
+                ambiguous[j] |= shared;
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < COUNT_OUTPUT; i++) {
+        uint8_t filtered = state[i] & ~(ambiguous[i] & ~report[i]);
+        if (filtered != report[i]) {
+            report[i] = filtered;
+            changed_rows |= _BV(i);
+        }
+    }
+
+    return changed_rows;
+}
@@ -10,6 +10,9 @@ enum lifecycle_phases {
 
 };
 
+// NOISY_SWITCH_LOCKED_ON's timer
+#define DEBOUNCE_LOCKOUT_SCANS 100
+
 lifecycle_phase_t lifecycle[] = {
     {
         // OFF -- during this phase, any 'off' value means that we should keep this key pressed
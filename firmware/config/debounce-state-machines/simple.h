@@ -9,6 +9,9 @@ enum lifecycle_phases {
 
 };
 
+// DEBOUNCING_ON's timer
+#define DEBOUNCE_LOCKOUT_SCANS 55
+
 lifecycle_phase_t lifecycle[] = {
     {
         // OFF -- during this phase, any 'off' value means that we should keep this key pressed
@@ -16,18 +16,78 @@
 // KEY_REPORT_SIZE_BYTES is the number of bytes of data in a key report we send to the host
 #define KEY_REPORT_SIZE_BYTES 4
 
+// Merge key reports the master hasn't read yet when a key changes back, so
+// it only reads net changes. See ringbuf_append_report(). Only for masters
+// that read more often than a key can really go down and up again.
+//#define KEY_REPORT_COALESCE
+
+// End each key report with the timer1 tick of the scan that made it, so the
+// master can tell how long it waited in the ring (see TWI_CMD_KEYSCAN_TICKS)
+//#define KEY_REPORT_TIMESTAMPS
+
 
 // Debouncer config
 
+#if !defined(DEBOUNCER)
 //#define DEBOUNCER "debounce-integrator.h"
 //#define DEBOUNCER "debounce-counter.h"
 //#define DEBOUNCER "debounce-none.h"
 //#define DEBOUNCER "debounce-split-counters-and-lockouts.h"
 #define DEBOUNCER "debounce-split-counters.h"
 //#define DEBOUNCER "debounce-state-machine.h"
+// Delays in us rather than scans, see debounce-timed.h
+//#define DEBOUNCER "debounce-timed.h"
+#endif
 #define DEBOUNCE_STATE_MACHINE "config/debounce-state-machines/chatter-defense.h"
 //#define DEBOUNCE_STATE_MACHINE "config/debounce-state-machines/simple.h"
 
+// Scan mode, see keyscanner.h. The Model 01 pulls rows low and reads cols.
+//#define KEYSCANNER_SCAN_MODE KEYSCANNER_ROWS_OUT_ACTIVE_LOW
+
+// Read every row 3 or 5 times per scan and take a majority vote per key, so
+// a single bad read never gets to the debouncer. See oversample.h
+//#define KEYSCANNER_OVERSAMPLE 3
+
+// Hold back new presses on keys that could be phantoms (matrix corners of a
+// rectangle of pressed keys). Only needed for matrices without diodes.
+//#define KEYSCANNER_ANTI_GHOSTING
+
+
+// LED config
+
+// Keep the LED buffers in APA102 wire format (brightness byte per LED, start
+// and end frames included), so the SPI interrupt only has to copy bytes out.
+// The two buffers take 276 bytes instead of 192, which doesn't fit in the
+// ATtiny88's 512 bytes of SRAM with the rest of the firmware: this is for
+// parts with 1KB or more, and led-spiout.c won't build it for less.
+// On the ATtiny88, the SPI interrupt for the default layout takes about 66%
+// of the CPU while a frame goes out at the default 512KHz (see
+// tools/firmware_sim/led-isr-bench). Where that's too much, turn on
+// LED_TRANSPORT_POLLED below, or slow the SPI down to 256KHz.
+//#define LED_BUFFER_WIRE_FORMAT
+
+// Keep a palette of LED_PALETTE_SIZE colors for TWI_CMD_LED_SET_PALETTE, so
+// the master can send TWI_CMD_LED_UPDATE_INDEXED and TWI_CMD_LED_SET_RUNS.
+// Takes 48 bytes of RAM, which the stack can't spare on an ATtiny88 with 32
+// LEDs (see STACK_RESERVE in the Makefile), and nor could it spare 24 for
+// half the colors. Without it, writes of those commands get NACKed after the
+// command byte, and TWI_STATUS_CAPABILITIES says so.
+//#define LED_PALETTE
+
+// Run LED effects on the ATtiny itself (TWI_CMD_LED_EFFECT), drawn from the
+// palette and the keys. Needs LED_PALETTE, and takes 26 more bytes of RAM.
+// Without it, writes of TWI_CMD_LED_EFFECT get NACKed after the command
+// byte, TWI_STATUS_CAPABILITIES says so, and the effect always reads back as
+// LED_EFFECT_NONE.
+//#define LED_EFFECTS
+
+// Feed the LED SPI from the main loop between keyscans instead of from the
+// SPI transfer complete interrupt. Worth it at the faster SPI frequencies,
+// where the interrupt would eat most of the CPU: it's the way to run the
+// default 512KHz with the default LED buffer layout and leave keyscanning
+// and TWI most of it (see tools/firmware_sim/led-transport-sim).
+//#define LED_TRANSPORT_POLLED
+
 
 // Actual hardware configuration
 
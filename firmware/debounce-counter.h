@@ -9,6 +9,10 @@ each of these 8 bit variables are storing the state for 8 keys
 so for key 0, the counter is represented by db0[0] and db1[0]
 and the state in state[0].
 */
+// The counters reset as soon as the input matches the state again (see
+// keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS 0
+
 typedef struct {
     uint8_t db0;    // counter bit 0
     uint8_t db1;    // counter bit 1
@@ -18,6 +18,10 @@ static int8_t debounce_toggle_on_threshold = 3; // ~1ms
 static int8_t debounce_integrator_floor = 0;
 static int8_t debounce_toggle_off_threshold =  0;
 
+// After a press goes through at 3, the counter goes on up to the ceiling in
+// steps of 14 with the key held: 3 more scans (see keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS 3
+
 
 /*
 each of these 8 bit variables are storing the state for 8 keys
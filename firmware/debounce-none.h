@@ -4,6 +4,10 @@
 #include "keyscanner.h"
 
 // No debouncing, for debugging purposes
+
+// Nothing to count once the input matches the state (see keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS 0
+
 typedef struct {
     uint8_t state;  // debounced state
 } debounce_t;
@@ -14,6 +14,9 @@ In other words:
 
 (both must be minimum 1)
 
+The delays count scans, so they change with the keyscan interval (see below).
+debounce-timed.h takes its delays in us instead.
+
 */
 
 #define DEBOUNCE_BEFORE_PRESS_DELAY_COUNT     3 // 3.2 ms
@@ -21,6 +24,12 @@ In other words:
 #define DEBOUNCE_BEFORE_RELEASE_DELAY_COUNT   12 // 9.6 ms
 #define DEBOUNCE_AFTER_RELEASE_DELAY_COUNT    4 // 3.2 ms
 
+// The AFTER delays count on with the input matching the new state (see
+// keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS \
+    (DEBOUNCE_AFTER_PRESS_DELAY_COUNT > DEBOUNCE_AFTER_RELEASE_DELAY_COUNT ? \
+     DEBOUNCE_AFTER_PRESS_DELAY_COUNT : DEBOUNCE_AFTER_RELEASE_DELAY_COUNT)
+
 /*
 time ~= COUNT * KEYSCAN_INTERVAL * timer_prescaler * (1 / F_CPU)
 
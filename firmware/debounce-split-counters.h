@@ -14,6 +14,9 @@
  * - RELEASE_DELAY is the minimum latency for a key release, or, in other words,
  *   it's the minimum elapsed time a key is pressed.
  *
+ * The delays count scans, so they change with the keyscan interval. For
+ * delays in us whatever the interval, see debounce-timed.h.
+ *
  * delay cheat sheet:
  *   delay ~= DELAY_COUNT * KEYSCAN_INTERVAL * timer_prescaler * (1 / F_CPU)
  *   KEYSCAN_INTERVAL=50:
@@ -124,6 +127,10 @@
                                !_IS_POWER_OF_TWO(DEBOUNCE_PRESS_DELAY_COUNT+1) || \
                                !_IS_POWER_OF_TWO(DEBOUNCE_RELEASE_DELAY_COUNT+1))
 
+// That reset is the only scan counted once the input matches the state (see
+// keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS (_DEBOUNCE_FORCE_RESET ? 1 : 0)
+
 typedef struct {
     uint8_t counter_bits[NUM_COUNTER_BITS];
     uint8_t last_changes;
@@ -28,6 +28,8 @@ typedef struct {
     uint8_t timer;
 } lifecycle_phase_t;
 
+// Each config defines DEBOUNCE_LOCKOUT_SCANS too: the longest timer of a
+// phase that expects the state it's in, like LOCKED_ON (see keyscanner.h)
 #include DEBOUNCE_STATE_MACHINE
 
 static uint8_t debounce(uint8_t sample, debounce_t *debouncer) {
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include "keyscanner.h"
+
+/**
+ * debounces by waiting for a change to last DELAY before registering it,
+ * like debounce-split-counters, but DELAY is a time, not a number of scans.
+ *
+ * The other debouncers count scans, so their delays change with the scan
+ * interval. This one gets the timer1 ticks since the last scan (see
+ * keyscanner_main()), and counts them down from the delay, so it keeps its
+ * delays whatever the interval is, or if scans don't come at regular
+ * intervals at all.
+ *
+ * So,
+ * - PRESS_DELAY_US is the minimum latency for a key press
+ * - RELEASE_DELAY_US is the minimum latency for a key release, or, in other
+ *   words, the minimum time a key is pressed.
+ *
+ * They're counted from the first scan that sees the change, and a change
+ * is registered at the first scan at least that long after it.
+ *
+ * Takes 18 bytes of RAM per output (split-counters takes 7 with its
+ * defaults), but no time at all while no key is changing.
+ */
+
+#define DEBOUNCE_TIMED
+
+// Only counts while the input differs from the state, and in ticks anyway
+// (see keyscanner.h)
+#define DEBOUNCE_LOCKOUT_SCANS 0
+
+// What debounce-split-counters' 17 scans take at the default keyscan
+// interval: 17 * 15 ticks of 32us
+#if !defined(DEBOUNCE_PRESS_DELAY_US)
+#define DEBOUNCE_PRESS_DELAY_US 8160
+#endif
+#if !defined(DEBOUNCE_RELEASE_DELAY_US)
+#define DEBOUNCE_RELEASE_DELAY_US 8160
+#endif
+
+#define DEBOUNCE_PRESS_DELAY_TICKS KEYSCAN_US_TO_TICKS(DEBOUNCE_PRESS_DELAY_US)
+#define DEBOUNCE_RELEASE_DELAY_TICKS KEYSCAN_US_TO_TICKS(DEBOUNCE_RELEASE_DELAY_US)
+
+#if DEBOUNCE_PRESS_DELAY_TICKS > 0xffff || DEBOUNCE_RELEASE_DELAY_TICKS > 0xffff
+#error debounce delays must fit in 16 bits of timer1 ticks
+#endif
+
+typedef struct {
+    uint16_t remaining[8];  // ticks left before a change gets registered
+    uint8_t counting;       // keys with a change being timed
+    uint8_t state;  // debounced state
+} debounce_t;
+
+/**
+ * debounce --
+ *
+ * args:
+ *    sample - the current state
+ *    debouncer - the state variables of the debouncer
+ *    elapsed_ticks - timer1 ticks since the last call
+ *
+ * returns: bits that have changed in the final debounced state
+ */
+static inline
+uint8_t debounce(uint8_t sample, debounce_t *debouncer, uint16_t elapsed_ticks) {
+    uint8_t changed = sample ^ debouncer->state;
+    uint8_t changes = 0;
+
+    // A key that goes back to its debounced state starts over next time
+    debouncer->counting &= changed;
+
+    // Most of the time nothing is changing
+    if (__builtin_expect(changed == 0, EXPECT_TRUE)) {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < COUNT_INPUT; i++) {
+        if (!(changed & _BV(i))) {
+            continue;
+        }
+        if (!(debouncer->counting & _BV(i))) {
+            // First scan to see this change: time it from here
+            debouncer->remaining[i] = (debouncer->state & _BV(i)) ?
+                                      DEBOUNCE_RELEASE_DELAY_TICKS : DEBOUNCE_PRESS_DELAY_TICKS;
+            debouncer->counting |= _BV(i);
+        } else if (debouncer->remaining[i] > elapsed_ticks) {
+            debouncer->remaining[i] -= elapsed_ticks;
+        } else {
+            debouncer->remaining[i] = 0;
+        }
+        if (debouncer->remaining[i] == 0) {
+            changes |= _BV(i);
+        }
+    }
+
+    debouncer->counting &= ~changes;
+    debouncer->state ^= changes;
+    return changes;
+}
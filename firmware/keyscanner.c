@@ -1,24 +1,137 @@
 #include <avr/interrupt.h>
 #include <util/atomic.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 #include <string.h>
 #include "main.h"
 #include DEBOUNCER
 #include "wire-protocol.h"
 #include "ringbuf.h"
 #include "keyscanner.h"
+#include "oversample.h"
 
 debounce_t db[COUNT_OUTPUT];
 
+#if defined(KEYSCANNER_ANTI_GHOSTING)
+#include "anti-ghosting.h"
+
+// What we last reported of each output, with the ambiguous new presses held back
+static uint8_t key_report[COUNT_OUTPUT];
+#define KEY_REPORT_OUTPUT(output_pin) key_report[output_pin]
+#else
+#define KEY_REPORT_OUTPUT(output_pin) db[output_pin].state
+#endif
+
 // do_scan gets set any time we should actually do a scan
 volatile uint8_t do_scan = 1;
 
+volatile uint16_t keyscan_ticks = 0;
+
+// The ticks the next compare match adds to keyscan_ticks: OCR1A + 1 as it
+// was when the timer matched, which keyscanner_update_timer() can change
+// before the interrupt gets to run
+static volatile uint16_t keyscan_period;
+
+#if defined(DEBOUNCE_TIMED)
+// keyscan_ticks as of the last scan
+static uint16_t last_scan_ticks = 0;
+#endif
+
+// Wait between driving an output and reading the inputs, in _delay_loop_1 units
+static uint8_t settle_delay = KEYSCANNER_SETTLE_DELAY_DEFAULT;
+
+// Set from TWI, the calibration itself runs from the main loop
+static volatile uint8_t settle_calibration_requested = 0;
+
+// A calibration the master asked for runs a pass per scan, so it doesn't
+// hold up the main loop: the delay it's trying, and the passes in a row
+// that have settled within it
+static uint8_t settle_calibrating = 0;
+static uint8_t calibration_delay;
+static uint8_t calibration_passes;
+
+void keyscanner_set_settle_delay(uint8_t delay) {
+    if (delay == TWI_KEYSCAN_SETTLE_CALIBRATE) {
+        settle_calibration_requested = 1;
+        return;
+    }
+    settle_delay = delay;
+}
+uint8_t keyscanner_get_settle_delay(void) {
+    return settle_delay;
+}
+
+
+// Dual rate scanning: we scan at keyscan_interval while any key is in flux,
+// and at keyscan_idle_interval once nothing has moved for
+// KEYSCAN_IDLE_AFTER_SCANS scans.
+//
+// The first scan that sees an input differ from its debounced state switches
+// back to the keyscan interval, and the debouncer only counts that one scan
+// at the idle rate: its delays stay what they are at the keyscan interval,
+// a press just waits up to one idle interval longer to be seen.
+static uint8_t keyscan_interval = KEYSCAN_INTERVAL_DEFAULT;
+static uint8_t keyscan_idle_interval = KEYSCAN_IDLE_INTERVAL_DEFAULT;
+static uint8_t scans_until_idle = KEYSCAN_IDLE_AFTER_SCANS;
+
+#if KEYSCAN_IDLE_AFTER_SCANS < DEBOUNCE_LOCKOUT_SCANS || KEYSCAN_IDLE_AFTER_SCANS > 255
+#error KEYSCAN_IDLE_AFTER_SCANS must cover DEBOUNCE_LOCKOUT_SCANS, in 8 bits
+#endif
+
+// Called from both TWI and the main loop, with interrupts off
+static void keyscanner_update_timer(void) {
+    uint16_t period = keyscan_period;
+
+    if (scans_until_idle == 0 && keyscan_idle_interval > keyscan_interval) {
+        OCR1A = keyscan_idle_interval;
+    } else {
+        OCR1A = keyscan_interval;
+    }
+    keyscan_period = OCR1A + 1;
+    // In CTC mode, a compare value below the count would only match after
+    // the timer wraps around, two seconds later. Start the interval over,
+    // keeping the time it's counted so far.
+    if (TCNT1 >= OCR1A) {
+        keyscan_ticks += TCNT1;
+        TCNT1 = 0;
+    }
+    // A compare match the interrupt hasn't counted yet ended an interval at
+    // the old compare value, but the interrupt will add the new one
+    if (TIFR1 & _BV(OCF1A)) {
+        keyscan_ticks += period - keyscan_period;
+    }
+}
 
 void keyscanner_set_interval(uint8_t interval) {
-    OCR1A = interval;
+    keyscan_interval = interval;
+    keyscanner_update_timer();
 }
 uint8_t keyscanner_get_interval(void) {
-    return OCR1A;
+    return keyscan_interval;
+}
+
+void keyscanner_set_idle_interval(uint8_t interval) {
+    keyscan_idle_interval = interval;
+    keyscanner_update_timer();
+}
+uint8_t keyscanner_get_idle_interval(void) {
+    return keyscan_idle_interval;
+}
+
+static void keyscanner_update_rate(uint8_t in_flux) {
+    if (in_flux) {
+        uint8_t was_idle = scans_until_idle == 0;
+        scans_until_idle = KEYSCAN_IDLE_AFTER_SCANS;
+        if (__builtin_expect(was_idle, EXPECT_FALSE)) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                keyscanner_update_timer();
+            }
+        }
+    } else if (scans_until_idle && --scans_until_idle == 0) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            keyscanner_update_timer();
+        }
+    }
 }
 
 void keyscanner_init(void) {
@@ -30,56 +143,180 @@ void keyscanner_init(void) {
     // Initialize our debouncer datastructure.
     memset(db, 0, sizeof(*db) * COUNT_OUTPUT);
 
+    // In case keys are held down at power on
+    keyscanner_calibrate_settle_delay();
+
     keyscanner_timer1_init();
 }
 
+// Returns 1 if every output reads the same after `delay` as after a long
+// wait, over one pass
+static uint8_t keyscanner_settles_within(uint8_t delay) {
+    uint8_t stable = 1;
+
+    // The same output sequence as keyscanner_main(), so the inputs see
+    // the same transitions
+    for (uint8_t output_pin = 0; output_pin < COUNT_OUTPUT; ++output_pin) {
+        if (delay) {
+            _delay_loop_1(delay);
+        }
+        uint8_t early = KEYSCANNER_CANONICALIZE_PINS(PIN_INPUT);
+        _delay_loop_1(KEYSCANNER_SETTLE_DELAY_MAX);
+        uint8_t settled = KEYSCANNER_CANONICALIZE_PINS(PIN_INPUT);
+
+        OUTPUT_DEACTIVATE(output_pin);
+        OUTPUT_ACTIVATE(((output_pin+1) % COUNT_OUTPUT));
+
+        // (Finish the pass anyway, so the scan picks up at the first output)
+        stable &= early == settled;
+    }
+    return stable;
+}
+
+// Runs one calibration pass at calibration_delay, moving on to the next
+// delay if it didn't settle. Returns 1 once calibration is done.
+static uint8_t keyscanner_settle_calibration_step(void) {
+    if (keyscanner_settles_within(calibration_delay)) {
+        if (++calibration_passes < KEYSCANNER_SETTLE_CALIBRATION_PASSES) {
+            return 0;
+        }
+    } else {
+        calibration_passes = 0;
+        if (++calibration_delay < KEYSCANNER_SETTLE_DELAY_MAX) {
+            return 0;
+        }
+    }
+
+    // Never go below the default for the scan mode: with no keys held down,
+    // every delay looks good enough
+    settle_delay = calibration_delay > KEYSCANNER_SETTLE_DELAY_DEFAULT ? calibration_delay : KEYSCANNER_SETTLE_DELAY_DEFAULT;
+    return 1;
+}
+
+void keyscanner_calibrate_settle_delay(void) {
+    settle_calibration_requested = 0;
+    settle_calibrating = 0;
 
-void keyscanner_main(void) {
+    // Give the pins time to settle after keyscanner_init(), and get the
+    // outputs into the scan sequence
+    keyscanner_settles_within(KEYSCANNER_SETTLE_DELAY_MAX);
+
+    calibration_delay = 0;
+    calibration_passes = 0;
+    while (!keyscanner_settle_calibration_step()) {
+    }
+}
+
+
+uint8_t keyscanner_main(void) {
     uint8_t debounced_changes = 0;
+    uint8_t in_flux = 0;
     uint8_t pin_data;
 
     if (__builtin_expect(do_scan == 0, EXPECT_TRUE)) {
-        return;
+        return 0;
     }
 
     do_scan = 0;
 
+#if defined(DEBOUNCE_TIMED)
+    // Timed debouncers count real time, not scans: whatever the interval is,
+    // and even if we missed a compare match or two
+    uint16_t elapsed_ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        elapsed_ticks = keyscan_ticks - last_scan_ticks;
+        last_scan_ticks = keyscan_ticks;
+    }
+#endif
+
+    if (__builtin_expect(settle_calibration_requested, EXPECT_FALSE)) {
+        settle_calibration_requested = 0;
+        settle_calibrating = 1;
+        calibration_delay = 0;
+        calibration_passes = 0;
+    }
+    if (__builtin_expect(settle_calibrating, EXPECT_FALSE)) {
+        settle_calibrating = !keyscanner_settle_calibration_step();
+    }
+
     // For each enabled row...
     for (uint8_t output_pin = 0; output_pin < COUNT_OUTPUT; ++output_pin) {
 
+        // _delay_loop_1(0) would wait 256 loops
+        if (settle_delay) {
+            _delay_loop_1(settle_delay);
+        }
+
         // Read pin data
-        pin_data = PIN_INPUT;
+        pin_data = OVERSAMPLED_READ(PIN_INPUT);
 
         // Toggle the output we just read back off
- 	HIGH(PORT_OUTPUT, output_pin);
+ 	OUTPUT_DEACTIVATE(output_pin);
         
 	// Toggle the output for the 'next' pin
 	// We do this here to give the pin time to settle
 	
-        LOW(PORT_OUTPUT, ((output_pin+1) % COUNT_OUTPUT));
+        OUTPUT_ACTIVATE(((output_pin+1) % COUNT_OUTPUT));
 
         // Debounce key state
-        debounced_changes |= debounce(KEYSCANNER_CANONICALIZE_PINS(pin_data), db + output_pin);
+        pin_data = KEYSCANNER_CANONICALIZE_PINS(pin_data);
+        in_flux |= pin_data ^ db[output_pin].state;
+#if defined(DEBOUNCE_TIMED)
+        debounced_changes |= debounce(pin_data, db + output_pin, elapsed_ticks);
+#else
+        debounced_changes |= debounce(pin_data, db + output_pin);
+#endif
 
     }
 
+    keyscanner_update_rate(in_flux | debounced_changes);
+
     // Most of the time there will be no new key events
     if (__builtin_expect(debounced_changes != 0, EXPECT_FALSE)) {
+#if defined(KEYSCANNER_ANTI_GHOSTING)
+        uint8_t state[COUNT_OUTPUT];
+        for (uint8_t output_pin = 0; output_pin < COUNT_OUTPUT; ++output_pin) {
+            state[output_pin] = db[output_pin].state;
+        }
+        // Don't report a change that only a held back key made
+        if (anti_ghosting_filter(state, key_report) == 0) {
+            return 1;
+        }
+#endif
 	keyscanner_record_state();
     }
+    return 1;
 }
 
 
 inline void keyscanner_record_state (void) {
+    uint8_t report[KEY_REPORT_BYTES];
 
-    // Snapshot the keystate to add to the ring buffer
-    // Run this with interrupts off to make sure that
-    // when we read from the ringbuffer, we always get
-    // four bytes representing a single keyboard state.
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) ({
-        for(int i =0 ; i< KEY_REPORT_SIZE_BYTES; i++) {
-            ringbuf_append(db[i].state);
+    for(int i =0 ; i< KEY_REPORT_SIZE_BYTES; i++) {
+#if KEYSCANNER_COLS_OUT
+        // Reports are always one byte per row, one bit per col.
+        // (Row i is bit i of the rows port)
+        uint8_t row = 0;
+        for (int8_t col = COUNT_OUTPUT - 1; col >= 0; col--) {
+            row = (row << 1) | ((KEY_REPORT_OUTPUT(col) >> i) & 1);
         }
+        report[i] = row;
+#else
+        report[i] = KEY_REPORT_OUTPUT(i);
+#endif
+    }
+
+    // Add the snapshot to the ring buffer with interrupts off to make sure
+    // that when we read from the ringbuffer, we always get four bytes
+    // representing a single keyboard state.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) ({
+#if defined(KEY_REPORT_TIMESTAMPS)
+        // The compare match this scan ran for, unless the scan took longer
+        // than the interval
+        report[KEY_REPORT_SIZE_BYTES] = keyscan_ticks;
+        report[KEY_REPORT_SIZE_BYTES + 1] = keyscan_ticks >> 8;
+#endif
+        ringbuf_append_report(report);
     });
 
 }
@@ -103,7 +340,27 @@ void keyscanner_timer1_init(void) {
     sei();
 }
 
+uint8_t keyscanner_get_state(uint8_t output) {
+    return db[output].state;
+}
+
+uint16_t keyscanner_get_ticks(void) {
+    uint16_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint16_t count = TCNT1;
+        // A compare match the interrupt hasn't counted yet: TCNT1 is
+        // counting from 0 again, but it might only have got there after
+        // the read above, so read it again
+        if (TIFR1 & _BV(OCF1A)) {
+            count = TCNT1 + keyscan_period;
+        }
+        ticks = keyscan_ticks + count;
+    }
+    return ticks;
+}
+
 // interrupt service routine (ISR) for timer 1 A compare match
 ISR(TIMER1_COMPA_vect) {
+    keyscan_ticks += keyscan_period;
     do_scan = 1; // Yes! Let's do a scan
 }
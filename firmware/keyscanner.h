@@ -1,6 +1,47 @@
 #pragma once
 
 
+// Scan modes: which side of the matrix we drive, and which way.
+// Pick one with KEYSCANNER_SCAN_MODE in the product config. Each mode is
+// its own set of macros below, so the scan loop costs the same in all of them.
+
+// Rows are outputs, high by default and pulled low to scan them.
+// Cols are inputs with the internal pull-ups on. (Model 01)
+#define KEYSCANNER_ROWS_OUT_ACTIVE_LOW 0
+// Rows are outputs, low by default and driven high to scan them.
+// Cols are inputs without pull-ups: the board needs pull-downs on them.
+#define KEYSCANNER_ROWS_OUT_ACTIVE_HIGH 1
+// Same as above with rows and cols swapped, for the other diode direction
+#define KEYSCANNER_COLS_OUT_ACTIVE_LOW 2
+#define KEYSCANNER_COLS_OUT_ACTIVE_HIGH 3
+
+#if !defined(KEYSCANNER_SCAN_MODE)
+#define KEYSCANNER_SCAN_MODE KEYSCANNER_ROWS_OUT_ACTIVE_LOW
+#endif
+
+#define KEYSCANNER_COLS_OUT (KEYSCANNER_SCAN_MODE == KEYSCANNER_COLS_OUT_ACTIVE_LOW || \
+                             KEYSCANNER_SCAN_MODE == KEYSCANNER_COLS_OUT_ACTIVE_HIGH)
+#define KEYSCANNER_ACTIVE_LOW (KEYSCANNER_SCAN_MODE == KEYSCANNER_ROWS_OUT_ACTIVE_LOW || \
+                               KEYSCANNER_SCAN_MODE == KEYSCANNER_COLS_OUT_ACTIVE_LOW)
+
+#if KEYSCANNER_COLS_OUT
+
+//Signal port (cols)
+#define PORT_OUTPUT PORT_COLS
+#define DDR_OUTPUT DDR_COLS
+#define PIN_OUTPUT PIN_COLS
+#define MASK_OUTPUT MASK_COLS
+#define COUNT_OUTPUT COUNT_COLS
+
+//Scanning port (rows)
+#define PORT_INPUT PORT_ROWS
+#define DDR_INPUT DDR_ROWS
+#define PIN_INPUT PIN_ROWS
+#define MASK_INPUT MASK_ROWS
+#define COUNT_INPUT COUNT_ROWS
+
+#else
+
 //Signal port (rows)
 #define PORT_OUTPUT PORT_ROWS
 #define DDR_OUTPUT DDR_ROWS
@@ -15,7 +56,9 @@
 #define MASK_INPUT MASK_COLS
 #define COUNT_INPUT COUNT_COLS
 
+#endif
 
+#if KEYSCANNER_ACTIVE_LOW
 
 // Set data direction as output on the output pins
 // Default to all output pins high
@@ -29,22 +72,123 @@
     PINS_LOW(DDR_INPUT, MASK_INPUT); \
     PINS_HIGH(PORT_INPUT, MASK_INPUT);
 
+#define OUTPUT_ACTIVATE(pin) LOW(PORT_OUTPUT, pin)
+#define OUTPUT_DEACTIVATE(pin) HIGH(PORT_OUTPUT, pin)
 
 // When a key is pressed the input pin will read LOW
 // Active pins on are low. So the debouncer inverts them before working with them
-#define KEYSCANNER_CANONICALIZE_PINS(pins) ~pins
+// (The mask folds away when the inputs take up the whole port)
+#define KEYSCANNER_CANONICALIZE_PINS(pins) (~(pins) & MASK_INPUT)
+
+// The pull-ups bring an input back high quickly enough that the pipelined
+// toggle in keyscanner_main() is all the settle time we need
+#define KEYSCANNER_SETTLE_US_DEFAULT 0
+
+#else
+
+// Set data direction as output on the output pins
+// Default to all output pins low
+#define CONFIGURE_OUTPUT_PINS \
+    PINS_HIGH(DDR_OUTPUT, MASK_OUTPUT); \
+    PINS_LOW(PORT_OUTPUT, MASK_OUTPUT);
+
+// Set the data direction for our inputs to be "input"
+// Leave the pullups off, the board pulls the inputs down
+#define CONFIGURE_INPUT_PINS \
+    PINS_LOW(DDR_INPUT, MASK_INPUT); \
+    PINS_LOW(PORT_INPUT, MASK_INPUT);
+
+#define OUTPUT_ACTIVATE(pin) HIGH(PORT_OUTPUT, pin)
+#define OUTPUT_DEACTIVATE(pin) LOW(PORT_OUTPUT, pin)
+
+// When a key is pressed the input pin will read HIGH
+#define KEYSCANNER_CANONICALIZE_PINS(pins) ((pins) & MASK_INPUT)
+
+// External pull-downs are usually a lot weaker than the internal pull-ups,
+// so an input takes longer to fall back low after its output is released
+#define KEYSCANNER_SETTLE_US_DEFAULT 2
+
+#endif
+
+// Settle time between driving an output and reading the inputs, on top of
+// the pipelined toggle. Can be overridden in the product config.
+#if !defined(KEYSCANNER_SETTLE_US)
+#define KEYSCANNER_SETTLE_US KEYSCANNER_SETTLE_US_DEFAULT
+#endif
+
+// At runtime the settle delay counts _delay_loop_1() iterations: 3 cycles,
+// 0.375us at 8MHz. The master can change it with TWI_CMD_KEYSCAN_SETTLE_DELAY.
+#define KEYSCANNER_SETTLE_DELAY_DEFAULT ((KEYSCANNER_SETTLE_US * (F_CPU / 1000000) + 2) / 3)
+
+// Settle calibration tries delays up to this (24us at 8MHz), and waits this
+// long for the reference read
+#define KEYSCANNER_SETTLE_DELAY_MAX 64
+
+// A delay only counts as enough when every output reads the same after it
+// as after KEYSCANNER_SETTLE_DELAY_MAX, this many times in a row
+#define KEYSCANNER_SETTLE_CALIBRATION_PASSES 4
+
+
+// Timer1 runs at F_CPU / 256: a tick is 32us at 8MHz. Scans come every
+// keyscan interval + 1 ticks (CTC mode counts from 0 to OCR1A).
+#define KEYSCAN_TIMER_PRESCALER 256
+#define KEYSCAN_US_TO_TICKS(us) \
+    (((us) * (F_CPU / 1000000UL) + KEYSCAN_TIMER_PRESCALER - 1) / KEYSCAN_TIMER_PRESCALER)
+
+// Scans at the keyscan interval go on this long after the last one where any
+// input differed from its debounced state, before we slow down to the idle
+// interval: 64 scans (29ms at the default interval), or longer if the
+// debouncer needs it.
+//
+// The debouncers count scans, so this has to outlast everything they count
+// with every input matching its debounced state, or a lockout would stretch
+// to idle intervals. Each one defines that as DEBOUNCE_LOCKOUT_SCANS, e.g.
+// 100 for the chatter-defense state machine's NOISY_SWITCH_LOCKED_ON.
+// Counting towards a change, like a release timer, keeps the input in flux.
+#if !defined(KEYSCAN_IDLE_AFTER_SCANS)
+#define KEYSCAN_IDLE_AFTER_SCANS (DEBOUNCE_LOCKOUT_SCANS > 64 ? DEBOUNCE_LOCKOUT_SCANS : 64)
+#endif
 
 
 // AD01: lower two bits of device address
 #define AD01() ((PINB & _BV(0)) |( PINB & _BV(1)))
 
+// Set by the timer interrupt whenever we should actually do a scan
+extern volatile uint8_t do_scan;
+
+// Timer1 ticks so far, as of the last compare match. Wraps every 2 seconds.
+extern volatile uint16_t keyscan_ticks;
+
+// Timer1 ticks so far, up to now, on the same clock as keyscan_ticks
+uint16_t keyscanner_get_ticks(void);
+
 void keyscanner_init(void);
-void keyscanner_main(void);
+// Returns 1 if it did a scan
+uint8_t keyscanner_main(void);
 void keyscanner_record_state(void);
 void keyscanner_ringbuf_update(uint8_t row1, uint8_t row2, uint8_t row3, uint8_t row4);
 void keyscanner_timer1_init(void);
 
+// The debounced state of the keys on an output, one bit per input
+uint8_t keyscanner_get_state(uint8_t output);
+
 void keyscanner_set_interval(uint8_t interval);
 uint8_t keyscanner_get_interval();
 
+void keyscanner_set_idle_interval(uint8_t interval);
+uint8_t keyscanner_get_idle_interval(void);
+
+void keyscanner_set_settle_delay(uint8_t delay);
+uint8_t keyscanner_get_settle_delay(void);
+
+// Finds the shortest settle delay that gives clean reads, and uses it if
+// it's longer than the default. Only rows with a key held down can show a
+// settle problem, so it's up to the master to ask for this
+// (TWI_KEYSCAN_SETTLE_CALIBRATE) while the user holds some keys.
+//
+// This runs the whole calibration at once, the way keyscanner_init() does
+// at power on. One the master asks for runs from keyscanner_main() instead,
+// a pass per scan, and the scans go on at the old delay until it's done.
+void keyscanner_calibrate_settle_delay(void);
+
 
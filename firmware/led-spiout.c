@@ -1,11 +1,15 @@
 #include <stdint.h>
+#include <avr/eeprom.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 
 #include <string.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include "main.h"
 #include "led-spiout.h"
 #include "wire-protocol.h"
+#include "keyscanner.h"
 
 
 /* SPI LED driver to send data to APA102 LEDs
@@ -15,10 +19,30 @@
  * continuously outputs SPI data, refilling the SPI
  * output buffer from the SPI transfer complete interrupt.
  *
- * Data is double buffered (see notes below), however an update can
- * occur during any byte in the chain (we just guarantee it won't
- * happen mid-LED). The LED refresh rate is high enough that this
- * shouldn't matter.
+ * Data is double buffered: updates are always written to the back
+ * buffer, and the SPI interrupt flips the back buffer to the front
+ * only at the start of a frame. Every frame on the wire is therefore
+ * exactly one committed state of the LEDs, and an update never has to
+ * stall the SPI output.
+ *
+ * APA102 LEDs keep their color until new data is shifted through them,
+ * so a frame only needs to go as far as the last LED that changed. After
+ * that we clock out the end frame and stop, which saves an SPI interrupt
+ * for every byte we don't send.
+ *
+ * Frames only start in the gap right after a keyscan (led_scan_slot()), and
+ * only once led_frame_interval has passed since the first update that goes
+ * in them. Updates that arrive while a frame is on the wire, or while we
+ * wait, all end up in the same frame. So a master writing four banks in a
+ * row costs one refresh, not four overlapping ones, and the LED frame rate
+ * is capped, from the master if it likes. The interval runs on timer1
+ * ticks, so it doesn't change when the keyscan interval does.
+ *
+ * With LED_TRANSPORT_POLLED, the SPI interrupt isn't used at all: the main
+ * loop calls led_pump() between keyscans to queue the next few bytes. At the
+ * fast SPI frequencies a byte goes out in about the time the interrupt
+ * prologue and epilogue take, so polling gets more bytes out for less CPU,
+ * and it never delays a keyscan by more than a byte.
  */
 
 #define BRIGHTNESS_MASK 0b11100000
@@ -26,64 +50,399 @@
 // LED SPI start frame: 32 zero bits
 #define LED_START_FRAME_BYTES 4
 
-// LED SPI end frame: 32 zero bits + (NUM_LEDS / 2) bits
+// LED SPI end frame: 32 zero bits + (leds / 2) bits
 // The pwm end frame needs to be 32 bits of 0 for SK9822 based LEDS
 // After that, we need at num_leds/2 more bits of 0
 // For up to 64 LEDs, that means 64 bits of 0
 // https://cpldcpu.wordpress.com/2016/12/13/sk9822-a-clone-of-the-apa102/
 // https://cpldcpu.wordpress.com/2014/11/30/understanding-the-apa102-superled/
-#define LED_END_FRAME_BYTES (4 + (NUM_LEDS / 2 / 8))
+#define LED_END_FRAME_BYTES_FOR(leds) (4 + ((leds) + 15) / 16)
+#define LED_END_FRAME_BYTES LED_END_FRAME_BYTES_FOR(NUM_LEDS)
+
+// Where led_set_count() keeps the chain length. An erased EEPROM reads 0xff,
+// which isn't a length, so a new board starts out with all NUM_LEDS.
+#define LED_COUNT_EEPROM_ADDRESS ((uint8_t *)0)
 
+#if defined(LED_TRANSPORT_POLLED)
+// The main loop feeds SPI from led_pump(), so the SPI interrupt stays off
+static volatile uint8_t led_writes_enabled = 0;
+#define ENABLE_LED_WRITES led_writes_enabled = 1;
+#define DISABLE_LED_WRITES led_writes_enabled = 0;
+#define LED_WRITES_ENABLED (led_writes_enabled)
+#else
 #define ENABLE_LED_WRITES SPCR |= _BV(SPIE);
 #define DISABLE_LED_WRITES SPCR &= ~_BV(SPIE);
+#define LED_WRITES_ENABLED (SPCR & _BV(SPIE))
+#endif
 
-// Using DISABLE_INTERRUPTS could cause interrupt recursion because led_update
-// functions are called from TWI callbacks which run within TWI interrupt. So
-// disable only LED SPI transfer interrupt.
+// led_update functions are usually called from TWI callbacks, which run within
+// the TWI interrupt, so the ATOMIC_BLOCK is free there. It only matters when an
+// update comes from the main loop: then it keeps the SPI interrupt from
+// flipping buffers halfway through the update.
 //
-// And to avoid redundancy, leave re-ENABLE_LED_WRITES to led_data_ready().
-#define PROTECT_LED_WRITES(...)  do { DISABLE_LED_WRITES; __VA_ARGS__ /*ENABLE_LED_WRITES;*/ } while (0)
+// Every staged write is committed with led_data_ready() before the block ends.
+#define STAGE_LED_WRITES(...)  do { ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { __VA_ARGS__ led_data_ready(); } } while (0)
 
 static uint8_t led_spi_frequency = LED_SPI_FREQUENCY_DEFAULT;
 
+/* How long a frame waits after the first update that goes in it, in
+ * LED_FRAME_INTERVAL_TICKS() steps */
+static uint8_t led_frame_interval = LED_FRAME_INTERVAL_DEFAULT;
+
+/* When the first update since the last frame started was committed */
+static uint16_t led_frame_since;
+
+#if defined(LED_BUFFER_WIRE_FORMAT)
+
+/* The buffer is exactly what goes out on the wire: the brightness byte is
+ * stored in front of every LED, and the start and end frames are part of the
+ * buffer. The SPI interrupt just copies bytes out of it. */
+#define LED_WIRE_DATA_SIZE (LED_DATA_SIZE + 1)
+
+typedef struct {
+    uint8_t start_frame[LED_START_FRAME_BYTES];
+    uint8_t each[NUM_LEDS][LED_WIRE_DATA_SIZE];
+    uint8_t end_frame[LED_END_FRAME_BYTES];
+} led_buffer_t;
+
+#define LED_BUFFER_INIT {.each={[0 ... NUM_LEDS-1] = {BRIGHTNESS_MASK | LED_BRIGHTNESS_MAX}}}
+
+#else
+
 typedef union {
     uint8_t each[NUM_LEDS][LED_DATA_SIZE];
     uint8_t whole[LED_BUFSZ];
     uint8_t bank[NUM_LED_BANKS][LED_BANK_SIZE];
 } led_buffer_t;
 
-/* (No volatile because all writes are outside the interrupt and in PROTECT_LED_WRITES) */
-static led_buffer_t led_buffer = {.whole={0}};
+#define LED_BUFFER_INIT {.whole={0}}
 
+#endif
 
 #define LED_BRIGHTNESS_MAX 31
 static uint8_t global_brightness = BRIGHTNESS_MASK | LED_BRIGHTNESS_MAX;
 
-/* (No volatile because no data race and we do only atomic operations (assignment should be atomic)) */
-static uint8_t leds_dirty = 1;
+/* There's enough RAM on ATTiny88 to double buffer 32 LEDs. The SPI interrupt
+ * only ever reads from led_front, updates only ever write to led_back.
+ *
+ * (No volatile because led_front and led_back only change in the SPI
+ * interrupt, and are only read outside of it within an ATOMIC_BLOCK) */
+static led_buffer_t led_buffers[2] = {LED_BUFFER_INIT, LED_BUFFER_INIT};
+static led_buffer_t *led_front = &led_buffers[0];
+static led_buffer_t *led_back = &led_buffers[1];
+
+/* The rest of the firmware and the stack need about as much SRAM again as
+ * the two buffers take. Wire format buffers (2 * 138 bytes for 32 LEDs) don't
+ * leave that on an ATtiny88's 512 bytes, only on parts with 1KB or more.
+ * (The host simulator has no RAMSTART, and builds both layouts.) */
+#if defined(RAMSTART)
+STATIC_ASSERT(sizeof(led_buffers) <= (RAMEND - RAMSTART + 1) / 2, led_buffers_fit_in_half_the_sram);
+#endif
+
+/* Number of LEDs at the start of led_back which changed since the last flip.
+ * Only those need to go out in the next frame. */
+static uint8_t led_back_dirty_leds = NUM_LEDS;
+
+/* Number of LEDs in the frame on the wire, latched along with led_front */
+static uint8_t frame_leds = NUM_LEDS;
+
+/* How many LEDs this board's chain really has, from 1 to NUM_LEDS, and the
+ * end frame that clocks their data through. The buffers stay NUM_LEDS long,
+ * but frames stop at the end of the chain. */
+static uint8_t led_count = NUM_LEDS;
+static uint8_t led_end_frame_bytes = LED_END_FRAME_BYTES;
+
+/* Set when the count changes, until led_save_count() has it in EEPROM */
+static volatile uint8_t led_count_unsaved = 0;
+
+#define MARK_LEDS_DIRTY_UNTIL(end_led) \
+    do { if (led_back_dirty_leds < (end_led)) led_back_dirty_leds = (end_led); } while (0)
+
+/* Set when led_back holds a committed frame that hasn't been flipped to the front yet.
+ * (No volatile because no data race and we do only atomic operations (assignment should be atomic)) */
+static uint8_t led_frame_pending = 1;
+
+/* Set by a flip: led_back now holds the previous frame and must be caught up
+ * with led_front before any partial update is written to it. */
+static uint8_t led_back_stale = 0;
+
+/* One bit per LED in led_back that was staged as it came off the wire, and
+ * still has to go through the brightness scale and the gamma table. Only
+ * set while either is on, see led_transform_raw(). */
+static uint8_t led_back_raw[(NUM_LEDS + 7) / 8];
+
+static inline uint8_t led_back_has_raw(void) {
+    uint8_t raw = 0;
+    for (uint8_t i = 0; i < sizeof(led_back_raw); i++) {
+        raw |= led_back_raw[i];
+    }
+    return raw;
+}
+
+/* The committed frame in led_back can go to the front: none of its LEDs
+ * are waiting to be transformed */
+static inline uint8_t led_frame_ready(void) {
+    return led_frame_pending && !led_back_has_raw();
+}
+
+static void led_transform_raw(uint8_t until_scan);
 
-/* This function triggers a led update. */
+/* This function commits the back buffer. The frame goes out from the next
+ * free scan slot, see led_scan_slot(). */
 void led_data_ready() {
-    leds_dirty = 1;
-    ENABLE_LED_WRITES;
+    if (!led_frame_pending) {
+        led_frame_since = keyscanner_get_ticks();
+    }
+    led_frame_pending = 1;
+}
+
+/* Lets the committed frame start in the next scan slot, rather than wait out
+ * the frame interval */
+static void led_frame_now(void) {
+    led_frame_since = keyscanner_get_ticks() - LED_FRAME_INTERVAL_TICKS(led_frame_interval);
+}
+
+void led_scan_slot(void) {
+    led_transform_raw(1);
+
+    // SPCR is shared with led_set_spi_frequency(), which runs from the TWI
+    // interrupt, so don't let it in between reading and writing SPCR
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (led_frame_ready() && !LED_WRITES_ENABLED &&
+                (uint16_t)(keyscanner_get_ticks() - led_frame_since) >= LED_FRAME_INTERVAL_TICKS(led_frame_interval)) {
+            ENABLE_LED_WRITES;
+        }
+    }
+}
+
+uint8_t led_get_frame_interval(void) {
+    return led_frame_interval;
+}
+
+void led_set_frame_interval(uint8_t interval) {
+    // 0 starts a frame in the first scan slot after any update
+    led_frame_interval = interval;
+}
+
+/* Returns the back buffer, up to date with the last committed frame.
+ * Only call this with interrupts off: from within STAGE_LED_WRITES, or see
+ * led_effect_step(). */
+static inline led_buffer_t *led_back_buffer(void) {
+    if (__builtin_expect(led_back_stale, EXPECT_TRUE)) {
+        memcpy(led_back, led_front, sizeof(*led_back));
+        led_back_stale = 0;
+    }
+    return led_back;
 }
 
-/* Update the transmit buffer with LED_BUFSZ bytes of new data */
+/* Gamma 2.8, round(255 * (i / 255)^2.8): evenly spaced levels from the
+ * master come out looking evenly spaced, rather than all bright */
+static const uint8_t led_gamma_table[256] PROGMEM = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      2,   3,   3,   3,   3,   3,   3,   3,   4,   4,   4,   4,   4,   5,   5,   5,
+      5,   6,   6,   6,   6,   7,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,
+     10,  10,  11,  11,  11,  12,  12,  13,  13,  13,  14,  14,  15,  15,  16,  16,
+     17,  17,  18,  18,  19,  19,  20,  20,  21,  21,  22,  22,  23,  24,  24,  25,
+     25,  26,  27,  27,  28,  29,  29,  30,  31,  32,  32,  33,  34,  35,  35,  36,
+     37,  38,  39,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  50,
+     51,  52,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  66,  67,  68,
+     69,  70,  72,  73,  74,  75,  77,  78,  79,  81,  82,  83,  85,  86,  87,  89,
+     90,  92,  93,  95,  96,  98,  99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+    115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+    144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+    177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+    215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255,
+};
+
+/* Set by led_set_gamma(): LED data goes through led_gamma_table on its way
+ * into the buffer */
+static uint8_t led_gamma = 0;
+
+/* Set by led_set_brightness_scale(): LED data gets scaled by (scale + 1)/256
+ * on its way to the wire, before gamma. Unlike the APA102 global
+ * brightness field, which dims with a slow current PWM that flickers on
+ * camera and only has 32 steps, this dims in the color PWM itself, at full
+ * resolution. It costs nothing in the SPI interrupt: frames go out the same
+ * as ever. */
+static uint8_t led_scale = LED_BRIGHTNESS_SCALE_MAX;
+
+/* led_gamma or led_scale: LED data has more done to it than a copy */
+static uint8_t led_stage_transform = 0;
+
+#if defined(LED_PALETTE)
+/* Colors for led_update_indexed() and led_set_runs(), in the same byte order
+ * as all the other LED data. They're looked up as an update comes in, so
+ * changing one doesn't change the LEDs already set from it. */
+static uint8_t led_palette[LED_PALETTE_SIZE][LED_DATA_SIZE];
+#endif
+
+#if defined(LED_EFFECTS)
+
+#if !defined(LED_PALETTE)
+#error LED_EFFECTS draws from the palette, it needs LED_PALETTE
+#endif
+
+/* The effect engine
+ *
+ * With an effect on, the ATtiny works out the LED frames itself, from the
+ * palette and the keys, and the master has nothing to send. It runs from
+ * the main loop right after a keyscan (led_effect_step()), and renders a
+ * frame only once the last one has gone out and something changed. Effects
+ * run on timer1 ticks, so their speed doesn't depend on the keyscan or LED
+ * frame intervals: every tick moves the phase on by led_effect_speed, and a
+ * cycle is 2^18: 8.4s at speed 1, 0.5s at 16.
+ *
+ * LED updates from the master still go to the back buffer, and the next
+ * effect frame draws over them. LED_EFFECT_NONE hands the LEDs back.
+ *
+ * Its state takes 26 bytes of RAM with 32 LEDs. */
+static uint8_t led_effect = LED_EFFECT_NONE;
+static uint8_t led_effect_speed = LED_EFFECT_SPEED_DEFAULT;
+static uint32_t led_effect_phase;
+static uint16_t led_effect_ticks;
+
+/* What the last frame showed: the blend for the effects that light every
+ * LED the same, or 0x100 to draw the next frame whatever it is */
+static uint16_t led_effect_drawn;
+#define LED_EFFECT_REDRAW() (led_effect_drawn = 0x100)
+
+/* LED_EFFECT_REACTIVE: how lit up each key still is, 0 to 15, two to a byte */
+static uint8_t led_key_levels[(NUM_LEDS + 1) / 2];
+
+// Which LED is under a key. Products with another layout can set their own.
+#if !defined(LED_FOR_KEY)
+#define LED_FOR_KEY(output, input) ((output) * COUNT_INPUT + (input))
+#endif
+
+#else
+
+#define LED_EFFECT_REDRAW()
+
+#endif
+
+/* value * (scale + 1) / 256: value at 255, and up to 255/256 of it below
+ * that, so a blend of two never overflows.
+ *
+ * The ATtiny has no MUL, and avr-gcc would call its 16x16 bit multiply for
+ * this. Shifting and adding one byte into a 16 bit sum, once per bit of
+ * scale, takes at most about 60 cycles. */
+static uint8_t scale8(uint8_t value, uint8_t scale) {
+    uint16_t product = value;
+    uint16_t addend = value;
+
+    for (; scale != 0; scale >>= 1, addend <<= 1) {
+        if (scale & 1) {
+            product += addend;
+        }
+    }
+    return product >> 8;
+}
+
+#if defined(LED_BUFFER_WIRE_FORMAT)
+#define LED_COLOR(buffer, led) (&(buffer)->each[led][1])
+#else
+#define LED_COLOR(buffer, led) ((buffer)->each[led])
+#endif
+
+/* Marks `count` LEDs of led_back from `led` on to be transformed */
+static void led_mark_raw(uint8_t led, uint8_t count) {
+    uint8_t *bits = &led_back_raw[led / 8];
+    uint8_t bit = _BV(led % 8);
+
+    // Effects stage from the main loop, with the TWI interrupt on
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (; count > 0; count--) {
+            *bits |= bit;
+            bit <<= 1;
+            if (bit == 0) {
+                bit = 1;
+                bits++;
+            }
+        }
+    }
+}
+
+/* Puts the raw LEDs in led_back through the brightness scale and the gamma
+ * table.
+ *
+ * Scaling a full update takes about 5760 cycles, far too long for the TWI
+ * interrupt that stages it, so this runs from the main loop in the scan
+ * slot. Each LED is done with interrupts off, so an update can't land
+ * halfway through it, and with `until_scan` we stop once a keyscan is due,
+ * after at least one LED, and go on from the next slot. The buffers don't
+ * flip until every LED is done.
+ *
+ * led_set_all_to() and palette updates stage the same color over and over:
+ * that only gets worked out once. */
+static void led_transform_raw(uint8_t until_scan) {
+    uint8_t raw[LED_DATA_SIZE], transformed[LED_DATA_SIZE];
+    uint8_t worked_out = 0;
+
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        uint8_t *bits = &led_back_raw[led / 8];
+        uint8_t bit = _BV(led % 8);
+
+        if (!(*bits & bit)) {
+            continue;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            uint8_t *color = LED_COLOR(led_back, led);
+            if (!worked_out || memcmp(color, raw, LED_DATA_SIZE) != 0) {
+                for (uint8_t i = 0; i < LED_DATA_SIZE; i++) {
+                    uint8_t value = raw[i] = color[i];
+                    if (led_scale != LED_BRIGHTNESS_SCALE_MAX) {
+                        value = scale8(value, led_scale);
+                    }
+                    if (led_gamma) {
+                        value = pgm_read_byte(&led_gamma_table[value]);
+                    }
+                    transformed[i] = value;
+                }
+                worked_out = 1;
+            }
+            memcpy(color, transformed, LED_DATA_SIZE);
+            *bits &= ~bit;
+        }
+        if (until_scan && do_scan) {
+            return;
+        }
+    }
+}
+
+/* Writes `count` LEDs of preformatted data into `buffer`, starting at `led`,
+ * without marking them dirty. With a transform on, they go in raw, and
+ * led_transform_raw() gets to them. */
+static inline void led_stage_data(led_buffer_t *buffer, uint8_t led, const uint8_t *data, uint8_t count) {
+#if defined(LED_BUFFER_WIRE_FORMAT)
+    for (uint8_t *out = buffer->each[led], n = count; n > 0; n--) {
+        *out++ = global_brightness;
+        *out++ = *data++;
+        *out++ = *data++;
+        *out++ = *data++;
+    }
+#else
+    memcpy(buffer->each[led], data, count * LED_DATA_SIZE);
+#endif
+    if (__builtin_expect(led_stage_transform, EXPECT_FALSE)) {
+        led_mark_raw(led, count);
+    }
+}
+
+/* Writes `count` LEDs of preformatted data into `buffer`, starting at `led` */
+static inline void led_stage(led_buffer_t *buffer, uint8_t led, const uint8_t *data, uint8_t count) {
+    MARK_LEDS_DIRTY_UNTIL(led + count);
+    led_stage_data(buffer, led, data, count);
+}
+
+/* Update the transmit buffer with LED_BANK_SIZE bytes of new data */
 void led_update_bank(uint8_t *buf, const uint8_t bank) {
-    /* Double-buffering here is wasteful, but there isn't enough RAM on
-       ATTiny48 to single buffer 32 LEDs and have everything else work
-       unmodified. However there's enough RAM on ATTiny88 to double
-       buffer 32 LEDs! And double buffering is simpler, less likely to
-       flicker. */
-
-    PROTECT_LED_WRITES({
-        memcpy((uint8_t *)led_buffer.bank[bank], buf, LED_BANK_SIZE);
+    // Each bank update is committed on its own. If the master sends all
+    // four banks quickly enough, they'll still end up in the same frame.
+    STAGE_LED_WRITES({
+        led_stage(led_back_buffer(), bank * NUM_LEDS_PER_BANK, buf, NUM_LEDS_PER_BANK);
     });
-    // Only do our update if we're updating bank 4
-    // this way we avoid 3 wasted LED updates
-    //if (bank == NUM_LED_BANKS-1) {
-        led_data_ready();
-    // }
 }
 
 /* Update the transmit buffer with LED_BUFSZ bytes of new data
@@ -93,18 +452,18 @@ void led_update_bank(uint8_t *buf, const uint8_t bank) {
  * */
 
 void led_update_all(uint8_t *buf) {
-    PROTECT_LED_WRITES({
-        memcpy((uint8_t *)led_buffer.whole, buf, LED_BUFSZ);
+    STAGE_LED_WRITES({
+        // The whole buffer gets replaced, so there's no need to catch up first
+        led_stage(led_back, 0, buf, NUM_LEDS);
+        led_back_stale = 0;
     });
-    led_data_ready();
 }
 
 
 void led_set_one_to(uint8_t led, uint8_t *buf) {
-    PROTECT_LED_WRITES({
-        memcpy((uint8_t *)led_buffer.each[led], buf, LED_DATA_SIZE);
+    STAGE_LED_WRITES({
+        led_stage(led_back_buffer(), led, buf, 1);
     });
-    led_data_ready();
 
 }
 
@@ -114,20 +473,246 @@ void led_set_global_brightness(uint8_t brightness) {
     // So ORing our input with the brightness mask limits
     // the input to 31.
 
-    global_brightness = BRIGHTNESS_MASK | brightness;
-    led_data_ready();
+    STAGE_LED_WRITES({
+        global_brightness = BRIGHTNESS_MASK | brightness;
+#if defined(LED_BUFFER_WIRE_FORMAT)
+        led_buffer_t *buffer = led_back_buffer();
+        for (uint8_t led = 0; led < NUM_LEDS; led++) {
+            buffer->each[led][0] = global_brightness;
+        }
+#endif
+        // Brightness is part of every LED's data
+        MARK_LEDS_DIRTY_UNTIL(NUM_LEDS);
+    });
 }
 
 void led_set_all_to( uint8_t *buf) {
-    PROTECT_LED_WRITES({
-        for(int8_t led=31; led>=0; led--) {
-            memcpy((uint8_t *)led_buffer.each[led], buf, LED_DATA_SIZE);
+    STAGE_LED_WRITES({
+        for(int8_t led=NUM_LEDS-1; led>=0; led--) {
+            led_stage(led_back, led, buf, 1);
         }
+        led_back_stale = 0;
     });
-    led_data_ready();
 
 }
 
+#if defined(LED_PALETTE)
+
+void led_set_palette(uint8_t first, const uint8_t *colors, uint8_t count) {
+    // Nothing to commit: no LED changes until an update uses it, or the
+    // next effect frame
+    memcpy(led_palette[first], colors, count * LED_DATA_SIZE);
+    LED_EFFECT_REDRAW();
+}
+
+void led_update_indexed(uint8_t first, const uint8_t *indices, uint8_t count) {
+    STAGE_LED_WRITES({
+        led_buffer_t *buffer = led_back_buffer();
+        for (uint8_t i = 0; i < count; i++) {
+            // Two LEDs to a byte, the first one in the low nibble
+            uint8_t index = indices[i / 2];
+            if (i & 1) {
+                index >>= 4;
+            }
+            led_stage(buffer, first + i, led_palette[index & 0x0f], 1);
+        }
+    });
+}
+
+void led_set_runs(const uint8_t *runs, uint8_t count) {
+    STAGE_LED_WRITES({
+        led_buffer_t *buffer = led_back_buffer();
+        for (; count > 0; count--, runs += 3) {
+            uint8_t led = runs[0];
+            uint8_t leds = runs[1];
+            const uint8_t *color = led_palette[runs[2] & 0x0f];
+
+            // Runs come off the wire as they are: cut them at the last LED
+            if (led >= NUM_LEDS) {
+                continue;
+            }
+            if (leds > NUM_LEDS - led) {
+                leds = NUM_LEDS - led;
+            }
+            for (; leds > 0; leds--) {
+                led_stage(buffer, led++, color, 1);
+            }
+        }
+    });
+}
+
+#endif
+
+uint8_t led_get_gamma(void) {
+    return led_gamma;
+}
+
+void led_set_gamma(uint8_t on) {
+    // Only for data that comes in from now on: what's in the buffer stays.
+    // LEDs still waiting for the old setting get it first, which is the one
+    // time a transform runs in the TWI interrupt.
+    led_transform_raw(0);
+    led_gamma = on != 0;
+    led_stage_transform = led_gamma || led_scale != LED_BRIGHTNESS_SCALE_MAX;
+    LED_EFFECT_REDRAW();
+}
+
+uint8_t led_get_brightness_scale(void) {
+    return led_scale;
+}
+
+void led_set_brightness_scale(uint8_t scale) {
+    // Like gamma, only for data that comes in from now on. There's no room
+    // for an unscaled copy of the LEDs to scale again, so the master sends
+    // its next frame, and an effect draws its next one whatever it is.
+    led_transform_raw(0);
+    led_scale = scale;
+    led_stage_transform = led_gamma || led_scale != LED_BRIGHTNESS_SCALE_MAX;
+    LED_EFFECT_REDRAW();
+}
+
+#if defined(LED_EFFECTS)
+
+/* `amount` of the way from a (0) to b (255) */
+static void led_blend(uint8_t *out, const uint8_t *a, const uint8_t *b, uint8_t amount) {
+    for (uint8_t i = 0; i < LED_DATA_SIZE; i++) {
+        out[i] = scale8(a[i], 255 - amount) + scale8(b[i], amount);
+    }
+}
+
+/* Up and back down again over a cycle */
+static uint8_t triangle(uint8_t phase) {
+    return phase < 128 ? phase * 2 : (255 - phase) * 2 + 1;
+}
+
+static uint8_t led_key_level(uint8_t led) {
+    uint8_t levels = led_key_levels[led / 2];
+    return led & 1 ? levels >> 4 : levels & 0x0f;
+}
+
+static void led_set_key_level(uint8_t led, uint8_t level) {
+    uint8_t *levels = &led_key_levels[led / 2];
+    *levels = led & 1 ? (*levels & 0x0f) | (level << 4) : (*levels & 0xf0) | level;
+}
+
+/* LED_EFFECT_REACTIVE: lights keys that are down, and fades the others by
+ * `fade` steps. Only draws the LEDs that change, or all of them with
+ * `redraw`. Returns the number of LEDs up to the last one it drew. */
+static uint8_t led_draw_keys(led_buffer_t *buffer, uint8_t fade, uint8_t redraw) {
+    uint8_t drawn = 0;
+
+    for (uint8_t output = 0; output < COUNT_OUTPUT; output++) {
+        uint8_t state = keyscanner_get_state(output);
+        for (uint8_t input = 0; input < COUNT_INPUT; input++, state >>= 1) {
+            uint8_t led = LED_FOR_KEY(output, input);
+            uint8_t level, next;
+
+            if (led >= NUM_LEDS) {
+                continue;
+            }
+            level = led_key_level(led);
+            next = (state & 1) ? 15 : level > fade ? level - fade : 0;
+            if (next != level || redraw) {
+                uint8_t color[LED_DATA_SIZE];
+                led_set_key_level(led, next);
+                led_blend(color, led_palette[0], led_palette[1], next * 17);
+                led_stage_data(buffer, led, color, 1);
+                if (drawn <= led) {
+                    drawn = led + 1;
+                }
+            }
+        }
+    }
+    return drawn;
+}
+
+/* The effects that light every LED the same */
+static uint8_t led_draw_all(led_buffer_t *buffer, const uint8_t *from, const uint8_t *to, uint8_t amount) {
+    uint8_t color[LED_DATA_SIZE];
+
+    led_blend(color, from, to, amount);
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        led_stage_data(buffer, led, color, 1);
+    }
+    return NUM_LEDS;
+}
+
+/* Draws a whole effect frame into the back buffer, and commits it once.
+ *
+ * The buffers only flip when led_scan_slot() starts a frame, and that runs
+ * from the main loop after this, so no frame can show one half drawn. The
+ * drawing itself leaves interrupts on: a master update that comes in
+ * meanwhile goes to the same back buffer, and gets drawn over. */
+void led_effect_step(void) {
+    const uint8_t off[LED_DATA_SIZE] = { 0 };
+    led_buffer_t *buffer;
+    uint32_t last_phase;
+    uint16_t now;
+    uint8_t amount, drawn = 0;
+
+    // One frame at a time: no point drawing one nobody will see
+    if (led_effect == LED_EFFECT_NONE || led_frame_pending) {
+        return;
+    }
+
+    now = keyscanner_get_ticks();
+    last_phase = led_effect_phase;
+    led_effect_phase += (uint32_t)(uint16_t)(now - led_effect_ticks) * led_effect_speed;
+    led_effect_ticks = now;
+    amount = triangle(led_effect_phase >> 10);
+
+    // The effects that light every LED the same only draw a new blend
+    if (led_effect != LED_EFFECT_REACTIVE && amount == led_effect_drawn) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        buffer = led_back_buffer();
+    }
+
+    switch (led_effect) {
+    case LED_EFFECT_BREATHE:
+        // Palette color 0, from off to full and back
+        drawn = led_draw_all(buffer, off, led_palette[0], amount);
+        break;
+    case LED_EFFECT_FADE:
+        // From palette color 0 to 1 and back
+        drawn = led_draw_all(buffer, led_palette[0], led_palette[1], amount);
+        break;
+    case LED_EFFECT_REACTIVE:
+        // Pressed keys light up in color 1 at once, and fade back to color
+        // 0 over a cycle once they're let go, in sixteen steps
+        drawn = led_draw_keys(buffer, (led_effect_phase >> 14) - (last_phase >> 14), led_effect_drawn > 0xff);
+        break;
+    }
+    if (drawn == 0) {
+        return;
+    }
+    led_effect_drawn = amount;
+    STAGE_LED_WRITES({
+        MARK_LEDS_DIRTY_UNTIL(drawn);
+    });
+    // The frame interval waits for the rest of a master's update, but this
+    // one is whole
+    led_frame_now();
+}
+
+uint8_t led_get_effect(void) {
+    return led_effect;
+}
+
+void led_set_effect(uint8_t effect, uint8_t speed) {
+    led_effect_speed = speed;
+    if (effect != led_effect) {
+        led_effect = effect;
+        led_effect_phase = 0;
+        led_effect_ticks = keyscanner_get_ticks();
+        led_effect_drawn = 0x100;
+        memset(led_key_levels, 0, sizeof(led_key_levels));
+    }
+}
+
+#endif
+
 uint8_t led_get_spi_frequency() {
     return led_spi_frequency;
 }
@@ -216,7 +801,50 @@ static void led_turn_all_off_synchronous() {
 #undef WAIT_SPI_TRANSMIT
 }
 
+uint8_t led_get_count(void) {
+    return led_count;
+}
+
+static void led_use_count(uint8_t count) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        led_count = count;
+        led_end_frame_bytes = LED_END_FRAME_BYTES_FOR(count);
+    }
+}
+
+void led_set_count(uint8_t count) {
+    // LEDs that come onto the end of the chain never got what the master
+    // wrote to them while they were past it: send them the next frame
+    if (count > led_count) {
+        STAGE_LED_WRITES({
+            MARK_LEDS_DIRTY_UNTIL(count);
+            led_use_count(count);
+        });
+    } else {
+        led_use_count(count);
+    }
+    // This comes from the TWI interrupt, and an EEPROM write takes 3.4ms
+    // that the next one waits for: the main loop writes it instead
+    led_count_unsaved = 1;
+}
+
+void led_save_count(void) {
+    uint8_t count;
+
+    if (!led_count_unsaved || !eeprom_is_ready()) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = led_count;
+        led_count_unsaved = 0;
+    }
+    // Only writes when the count changed
+    eeprom_update_byte(LED_COUNT_EEPROM_ADDRESS, count);
+}
+
 void led_init() {
+    uint8_t count = eeprom_read_byte(LED_COUNT_EEPROM_ADDRESS);
+    led_use_count(count >= 1 && count <= NUM_LEDS ? count : NUM_LEDS);
 
     /* Set MOSI, SCK, SS all to outputs */
     DDRB = _BV(5)|_BV(3)|_BV(2);
@@ -227,6 +855,9 @@ void led_init() {
      * We don't use the SPI transfer interrupt here so we can synchronously turn
      * off all leds now, then synchronously change SPI frequency without
      * interference.
+     *
+     * This one frame goes to all NUM_LEDS, whatever the chain length, so
+     * LEDs left past the end by led_set_count() go dark on the next reset.
      */
     led_set_spi_frequency(LED_SPI_FREQUENCY_FOR_INIT);
     led_turn_all_off_synchronous();
@@ -235,9 +866,9 @@ void led_init() {
     if (led_spi_frequency != LED_SPI_FREQUENCY_DEFAULT)
         led_set_spi_frequency(LED_SPI_FREQUENCY_DEFAULT);
 
-    /* Trigger a first transmission */
-    leds_dirty = 1;
-    ENABLE_LED_WRITES;
+    /* Queue a first transmission, for the first scan slot */
+    led_data_ready();
+    led_frame_now();
 }
 
 typedef enum {
@@ -252,30 +883,99 @@ typedef enum {
 // which results in heavier code 
 static uint8_t led_phase = START_FRAME;
 
+/* Frame boundary: this is the only place the buffers get flipped, so nothing
+ * can tear the frame we're about to send. Called from the SPI interrupt. */
+static inline void led_flip_buffers(void) {
+    // (A stale back buffer means only the brightness was committed)
+    if (!led_back_stale) {
+        led_buffer_t *next = led_back;
+        led_back = led_front;
+        led_front = next;
+        led_back_stale = 1;
+    }
+    // Nothing past the end of the chain goes out
+    frame_leds = led_back_dirty_leds < led_count ? led_back_dirty_leds : led_count;
+    led_back_dirty_leds = 0;
+    led_frame_pending = 0;
+}
+
+#if defined(LED_BUFFER_WIRE_FORMAT)
+
+/* The frame goes out as three runs of bytes: the first byte of the start
+ * frame (after which we may flip buffers), the rest of the start frame
+ * followed by the dirty LEDs, and the end frame. */
+static const uint8_t *frame_next = led_buffers[0].start_frame; /* next byte to transmit */
+static const uint8_t *frame_run_end = led_buffers[0].start_frame + 1;
+
+static void led_next_run(void) {
+    switch(led_phase) {
+    case START_FRAME:
+        if (led_frame_ready()) {
+            led_flip_buffers();
+        }
+        frame_next = led_front->start_frame + 1;
+        frame_run_end = led_front->each[frame_leds];
+        led_phase = DATA;
+        break;
+    case DATA:
+        // Stop after the last dirty LED
+        frame_next = led_front->end_frame;
+        frame_run_end = led_front->end_frame + led_end_frame_bytes;
+        led_phase = END_FRAME;
+        break;
+    case END_FRAME:
+        frame_next = led_front->start_frame;
+        frame_run_end = led_front->start_frame + 1;
+        led_phase = START_FRAME;
+        // The next frame waits for a scan slot
+        DISABLE_LED_WRITES;
+        break;
+    }
+}
+
+/* Queues the next byte. Only call this once the last one has gone out. */
+static inline void led_send_next_byte(void) {
+    SPDR = *frame_next++;
+    if (__builtin_expect(frame_next == frame_run_end, EXPECT_FALSE)) {
+        led_next_run();
+    }
+}
+
+#else
+
 static uint8_t index = 0; /* next byte to transmit */
 static uint8_t subpixel = 0;
+static uint8_t frame_brightness = BRIGHTNESS_MASK | LED_BRIGHTNESS_MAX;
+static uint8_t frame_data_bytes = LED_BUFSZ;
 
-/* Each time a byte finishes transmitting, queue the next one */
-ISR(SPI_STC_vect) {
+/* Queues the next byte. Only call this once the last one has gone out. */
+static inline void led_send_next_byte(void) {
 
     switch(led_phase) {
     case START_FRAME:
         SPDR = 0;
+        if (index == 0 && led_frame_ready()) {
+            led_flip_buffers();
+            frame_brightness = global_brightness;
+            frame_data_bytes = frame_leds * LED_DATA_SIZE;
+        }
         if(++index == LED_START_FRAME_BYTES) {
-            led_phase = DATA;
+            // A commit can leave no LEDs dirty (say, runs that were all
+            // past the last LED): straight on to the end frame then
+            led_phase = frame_data_bytes ? DATA : END_FRAME;
             index = 0;
-            leds_dirty = 0;
         }
         break;
     case DATA:
         if (++subpixel == 1) {
-            SPDR = global_brightness;
+            SPDR = frame_brightness;
         } else {
-            SPDR = led_buffer.whole[index++];
+            SPDR = led_front->whole[index++];
             subpixel %= 4; // reset the subpixel once it goes past brightness,r,g,b
         }
 
-        if (index == LED_BUFSZ) {
+        // Stop after the last dirty LED
+        if (index == frame_data_bytes) {
             led_phase = END_FRAME;
             index = 0;
             subpixel = 0;
@@ -284,18 +984,52 @@ ISR(SPI_STC_vect) {
 
     case END_FRAME:
         SPDR = 0x00;
-        if(++index == LED_END_FRAME_BYTES) {
+        if(++index == led_end_frame_bytes) {
             led_phase = START_FRAME;
             index = 0;
-            if (leds_dirty == 0) {
-                // There should be no `leds_dirty` race condition here because
-                // we are not multi-threaded: `led_data_ready` should never be
-                // able to run here, ISR() (not naked) disables the global
-                // interrupt flag for the time of the call, and we are using
-                // PROTECT_LED_WRITES and not DISABLE_INTERRUPTS.
-                DISABLE_LED_WRITES;
-            }
+            // The next frame waits for a scan slot, even if one is
+            // already pending: led_scan_slot() turns writes back on.
+            DISABLE_LED_WRITES;
         }
         break;
     }
 }
+
+#endif
+
+#if defined(LED_TRANSPORT_POLLED)
+
+uint8_t led_pump(void) {
+    uint8_t sent = 0;
+
+    // With LED_SPI_OFF, SPIF would never get set
+    if (!led_writes_enabled || !(SPCR & _BV(SPE))) {
+        return 0;
+    }
+
+    while (sent < LED_PUMP_BURST_BYTES) {
+        // Wait for the byte on the wire, but a keyscan always goes first
+        while (!(SPSR & _BV(SPIF))) {
+            if (do_scan) {
+                return sent;
+            }
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            led_send_next_byte();
+        }
+        sent++;
+        if (!led_writes_enabled) {
+            break;
+        }
+    }
+    return sent;
+}
+
+#else
+
+/* Each time a byte finishes transmitting, queue the next one */
+ISR(SPI_STC_vect) {
+    led_send_next_byte();
+}
+
+#endif
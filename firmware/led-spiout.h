@@ -9,6 +9,8 @@
 #define LED_DATA_SIZE 3
 #define LED_BUFSZ (LED_DATA_SIZE *NUM_LEDS)
 #define LED_BANK_SIZE (LED_DATA_SIZE*NUM_LEDS_PER_BANK)
+#define LED_PALETTE_SIZE 16
+#define LED_BRIGHTNESS_SCALE_MAX 0xff
 
 
 /* Call to begin transmitting LED data */
@@ -32,9 +34,117 @@ void led_set_one_to(uint8_t led, uint8_t * led_data);
 /* Call this when you want to set every LED to the same value */
 void led_set_all_to(uint8_t * led_data);
 
+#if defined(LED_PALETTE)
+
+/* Call this to set `count` palette entries of LED_DATA_SIZE bytes each,
+   starting at entry `first` */
+void led_set_palette(uint8_t first, const uint8_t *colors, uint8_t count);
+
+/* Call this to set `count` LEDs from `first` to palette colors, from 4-bit
+   indices packed two to a byte, low nibble first */
+void led_update_indexed(uint8_t first, const uint8_t *indices, uint8_t count);
+
+/* Call this with `count` runs of 3 bytes each: the first LED, the number of
+   LEDs, and the palette index to set them to. Runs that go past the last
+   LED get cut short there. */
+void led_set_runs(const uint8_t *runs, uint8_t count);
+
+#endif
+
+/* Call this with 1 to gamma correct LED data from now on, 0 to send it as is */
+void led_set_gamma(uint8_t on);
+
+uint8_t led_get_gamma(void);
+
+/* Call this to dim LED data from now on by scaling its color values by
+   (scale + 1)/256, instead of with the APA102 global brightness.
+   LED_BRIGHTNESS_SCALE_MAX leaves them as they are. */
+void led_set_brightness_scale(uint8_t scale);
+
+uint8_t led_get_brightness_scale(void);
+
+#if defined(LED_EFFECTS)
+
+/* Call this to run an effect (LED_EFFECT_*) on the ATtiny at the given
+   speed, instead of taking LED frames from the master */
+void led_set_effect(uint8_t effect, uint8_t speed);
+
+uint8_t led_get_effect(void);
+
+/* Call this right after every keyscan, before led_scan_slot(). Draws the
+   next frame of the effect, if there is one. */
+void led_effect_step(void);
+
+#else
+
+/* No effect engine: the LEDs only show what the master sends, and the
+   effect always reads back as LED_EFFECT_NONE */
+static inline void led_set_effect(uint8_t effect, uint8_t speed) {
+    (void)effect;
+    (void)speed;
+}
+
+static inline uint8_t led_get_effect(void) {
+    return 0; // LED_EFFECT_NONE
+}
+
+static inline void led_effect_step(void) {
+}
+
+#endif
+
+/* Call this with the number of LEDs on the board's chain, 1 to NUM_LEDS.
+   Frames stop there from now on, and led_save_count() keeps the count in
+   EEPROM for the next reset. LEDs past the new end keep showing what they
+   did until then, so turn them off first. A longer chain gets all its LEDs
+   in the next frame. */
+void led_set_count(uint8_t count);
+
+/* Call this from the main loop. Writes the count from led_set_count() to
+   EEPROM, once the EEPROM is done with any write before. */
+void led_save_count(void);
+
+uint8_t led_get_count(void);
+
 /* Call this when you want to set every LED to off */
 void led_set_all_off(void);
 
 
 /* Call this with a value between 0 and 31 to set the LED's global brightness */
 void led_set_global_brightness(uint8_t global_brightness);
+
+/* Call this right after every keyscan. Starts sending the last committed
+ * LED data, if there's any and the frame interval has passed. With gamma or
+ * brightness scaling on, it puts the new LED data through them first. */
+void led_scan_slot(void);
+
+/* Call to set how long a frame waits after the first update that goes in
+   it, in LED_FRAME_INTERVAL_TICKS() steps. Updates that come in meanwhile
+   go out in the same frame, and frames start at most that often. */
+void led_set_frame_interval(uint8_t interval);
+
+/* Steps of 16 timer1 ticks, 512us: a keyscan at the default interval */
+#define LED_FRAME_INTERVAL_TICKS(interval) ((uint16_t)(interval) << 4)
+
+uint8_t led_get_frame_interval(void);
+
+
+#if defined(LED_TRANSPORT_POLLED)
+
+/* Bytes led_pump() queues at most before going back to the main loop */
+#ifndef LED_PUMP_BURST_BYTES
+#define LED_PUMP_BURST_BYTES 16
+#endif
+
+/* Call this from the main loop to feed the next few bytes of LED data to SPI.
+ * Returns the number of bytes queued. */
+uint8_t led_pump(void);
+
+#else
+
+/* The SPI interrupt feeds the LEDs, there's nothing to pump */
+static inline uint8_t led_pump(void) {
+    return 0;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#include <avr/sleep.h>
 #include "wire-protocol.h"
 #include "keyscanner.h"
 #include "led-spiout.h"
@@ -6,12 +7,43 @@ static inline void setup(void) {
     led_init();
     keyscanner_init();
     twi_init();
+    // Idle sleep stops the CPU only: timer1, SPI and TWI keep running, and
+    // any of their interrupts wakes us up
+    set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+/* Sleeps until the next interrupt, unless there's a scan to do already.
+ *
+ * Interrupts stay off from the do_scan check up to the sleep instruction:
+ * a compare match in between would set do_scan, and we'd sleep through that
+ * scan. The instruction after sei() always runs before any interrupt, so one
+ * that came in meanwhile wakes us right back up instead. */
+static inline void idle(void) {
+    cli();
+    if (!do_scan) {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
 }
 
 int main(void) {
     setup();
     while(1) {
-        keyscanner_main();
+        if (keyscanner_main()) {
+            // LED frames start in the gap after a keyscan, with the next
+            // frame of the LED effect if there is one
+            led_effect_step();
+            led_scan_slot();
+            twi_watchdog();
+            led_save_count();
+        }
+        // The polled LED transport needs us awake until the frame is out
+        if (led_pump() == 0) {
+            idle();
+        }
     }
     __builtin_unreachable();
 }
@@ -17,8 +17,8 @@
 #define HIGH(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 #define LOW(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
 
-#define PINS_HIGH(sfr, bitmask) ( _SFR_BYTE(sfr) |= bitmask)
-#define PINS_LOW(sfr, bitmask) ( _SFR_BYTE(sfr) &= ~bitmask)
+#define PINS_HIGH(sfr, bitmask) ( _SFR_BYTE(sfr) |= (uint8_t)(bitmask))
+#define PINS_LOW(sfr, bitmask) ( _SFR_BYTE(sfr) &= (uint8_t)~(bitmask))
 
 #define EXPECT_FALSE 0
 #define EXPECT_TRUE 1
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Oversampled reads: read the inputs KEYSCANNER_OVERSAMPLE times in a row and
+ * keep, for each pin, what most of the reads say.
+ *
+ * The reads are only a couple of cycles apart, so this does nothing about
+ * contact bounce, which lasts milliseconds. It catches single bad reads
+ * (crosstalk, EMI spikes) before they get to the debouncer, which otherwise
+ * has to spend part of its delay waiting them out.
+ *
+ * Both votes work 8 pins at a time, like the debouncers:
+ *
+ * majority3: 4 instructions.
+ * majority5: a bit-sliced adder. a+b+c is s1 + 2*c1 (a full adder), d+e is
+ * s2 + 2*c2 (a half adder). The total is at least 3 when both carries are
+ * set, or one of them is and one of the sums is.
+ */
+
+static inline uint8_t majority3(uint8_t a, uint8_t b, uint8_t c) {
+    return (a & (b | c)) | (b & c);
+}
+
+static inline uint8_t majority5(uint8_t a, uint8_t b, uint8_t c, uint8_t d, uint8_t e) {
+    uint8_t s1 = a ^ b ^ c;
+    uint8_t c1 = majority3(a, b, c);
+    uint8_t s2 = d ^ e;
+    uint8_t c2 = d & e;
+    return (c1 & c2) | ((c1 | c2) & (s1 | s2));
+}
+
+#if !defined(KEYSCANNER_OVERSAMPLE) || KEYSCANNER_OVERSAMPLE == 1
+#define OVERSAMPLED_READ(pins) (pins)
+#elif KEYSCANNER_OVERSAMPLE == 3
+#define OVERSAMPLED_READ(pins) majority3((pins), (pins), (pins))
+#elif KEYSCANNER_OVERSAMPLE == 5
+#define OVERSAMPLED_READ(pins) majority5((pins), (pins), (pins), (pins), (pins))
+#else
+#error KEYSCANNER_OVERSAMPLE must be 1, 3 or 5
+#endif
@@ -1,10 +1,22 @@
+#include <string.h>
 #include "ringbuf.h"
 
 static struct {
     uint8_t start;
     uint8_t count;
-    uint8_t buf[KEY_REPORT_SIZE_BYTES * 16];
-} _ring = { 0, 0, { 0 }};
+    uint8_t dropped;  // reports that didn't fit, up to 255
+    uint8_t buf[KEY_REPORT_BYTES * 16];
+} _ring = { 0, 0, 0, { 0 }};
+
+#if defined(KEY_REPORT_COALESCE)
+// The last report the master read. The first report in the ring is a change
+// from this one. Nothing read yet is the same thing as all keys released.
+static uint8_t _last_read[KEY_REPORT_BYTES];
+
+#define REMEMBER_READ(value) (_last_read[_ring.start % KEY_REPORT_BYTES] = (value))
+#else
+#define REMEMBER_READ(value)
+#endif
 
 void ringbuf_append(uint8_t value) {
     if (_ring.count < sizeof(_ring.buf)) {
@@ -12,6 +24,71 @@ void ringbuf_append(uint8_t value) {
     }
 }
 
+#if defined(KEY_REPORT_COALESCE)
+// Reports always go in whole, and the buffer holds a whole number of them, so
+// none of them wraps around the end
+static uint8_t *ringbuf_report(uint8_t n) {
+    return _ring.buf + (_ring.start + n * KEY_REPORT_BYTES) % sizeof(_ring.buf);
+}
+#endif
+
+/* Queues a whole key report.
+ *
+ * With KEY_REPORT_COALESCE, the master only ever reads net changes. If
+ * the new report changes a key back that the last queued one changed,
+ * the two get merged: the new report takes the place of the last one,
+ * which the master never reads. If that takes every key back to where the
+ * report before it had them, both are dropped. Reports that change
+ * different keys stay apart, so the master still sees them in the order
+ * they happened.
+ *
+ * A key that chatters between two reads of the master then takes one
+ * report, or none, instead of filling up the ring. Only the key state is
+ * compared: a merged report keeps the timestamp of the newer one.
+ */
+void ringbuf_append_report(const uint8_t *report) {
+#if defined(KEY_REPORT_COALESCE)
+    uint8_t queued = _ring.count / KEY_REPORT_BYTES;
+
+    // Only whole reports can be merged (ringbuf_pop() takes single bytes)
+    if (queued && _ring.count % KEY_REPORT_BYTES == 0) {
+        uint8_t *last = ringbuf_report(queued - 1);
+        const uint8_t *before = queued > 1 ? ringbuf_report(queued - 2) : _last_read;
+        uint8_t changed = 0, back_again = 0, changed_back = 0;
+
+        for (uint8_t i = 0; i < KEY_REPORT_SIZE_BYTES; i++) {
+            changed |= report[i] ^ last[i];
+            back_again |= report[i] ^ before[i];
+            changed_back |= (last[i] ^ before[i]) & (report[i] ^ last[i]);
+        }
+        if (changed == 0) {
+            return;
+        }
+        if (back_again == 0) {
+            _ring.count -= KEY_REPORT_BYTES;
+            return;
+        }
+        if (changed_back) {
+            memcpy(last, report, KEY_REPORT_BYTES);
+            return;
+        }
+    }
+#endif
+    if (_ring.count > sizeof(_ring.buf) - KEY_REPORT_BYTES) {
+        if (_ring.dropped < 0xff) {
+            _ring.dropped++;
+        }
+        return;
+    }
+    for (uint8_t i = 0; i < KEY_REPORT_BYTES; i++) {
+        ringbuf_append(report[i]);
+    }
+}
+
+uint8_t ringbuf_dropped(void) {
+    return _ring.dropped;
+}
+
 uint8_t ringbuf_size(void) {
     return _ring.count;
 }
@@ -26,6 +103,7 @@ uint8_t ringbuf_pop(void) {
     }
 
     uint8_t result = _ring.buf[_ring.start];
+    REMEMBER_READ(result);
     _ring.count--;
     _ring.start++;
     _ring.start %= sizeof(_ring.buf);
@@ -38,6 +116,7 @@ void ringbuf_pop_to(uint8_t *bufptr) {
     }
 
     *bufptr = _ring.buf[_ring.start];
+    REMEMBER_READ(*bufptr);
     _ring.count--;
     _ring.start++;
     _ring.start %= sizeof(_ring.buf);
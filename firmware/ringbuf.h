@@ -4,8 +4,21 @@
 #include <stdbool.h>
 #include "main.h"
 
+// With KEY_REPORT_TIMESTAMPS, each report ends with the keyscan_ticks of the
+// scan that made it, low byte first
+#if defined(KEY_REPORT_TIMESTAMPS)
+#define KEY_REPORT_TIMESTAMP_BYTES 2
+#else
+#define KEY_REPORT_TIMESTAMP_BYTES 0
+#endif
+
+// Bytes in a whole report: in the ring, and after TWI_REPLY_KEYDATA
+#define KEY_REPORT_BYTES (KEY_REPORT_SIZE_BYTES + KEY_REPORT_TIMESTAMP_BYTES)
+
 void ringbuf_append(uint8_t value);
+void ringbuf_append_report(const uint8_t *report);
 bool ringbuf_empty(void);
 uint8_t ringbuf_pop(void);
 void ringbuf_pop_to(uint8_t *bufptr);
 uint8_t ringbuf_size(void);
+uint8_t ringbuf_dropped(void);
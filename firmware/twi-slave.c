@@ -11,14 +11,24 @@
  */
 #include <avr/interrupt.h>
 #include <util/twi.h>
+#include <util/atomic.h>
 #include "twi-slave.h"
 #include "main.h"
 
 static unsigned char TWI_buf[TWI_BUFFER_SIZE]; // Transceiver buffer. Set the size in the header file
 static unsigned char TWI_msgSize  = 0;         // Number of bytes to be transmitted.
 
+// Set while a master has us addressed, from its SLA+R/W to the end of the
+// transaction. Every interrupt counts as progress, for the watchdog.
+static volatile unsigned char TWI_addressed = 0;
+static volatile unsigned char TWI_progress = 0;
+
+static unsigned char TWI_bus_errors = 0;
+static unsigned char TWI_watchdog_resets = 0;
+
 void (*TWI_Tx_Data_Callback)( unsigned char *, unsigned char * );
 void (*TWI_Rx_Data_Callback)( unsigned char *, unsigned char );
+unsigned char (*TWI_Rx_Command_Callback)( unsigned char );
 
 /**
  * TWI flags explained:
@@ -48,14 +58,19 @@ static void TWI_Start_Transceiver( unsigned char ack ) {
 }
 
 /**
- * Call this function to send (and wait for) a bus stop condition.
+ * Call this function to get back to unaddressed slave mode, whatever state the TWI is in.
+ * In slave mode, TWSTO doesn't put a STOP on the bus: it makes the TWI let go of SCL and SDA,
+ * and the hardware clears it again right away, so there's nothing to wait for.
  * ---------------------------------------------------------------------------------------------- */
-static void TWI_Stop( void ) {
+static void TWI_Release( void ) {
     TWCR = _BV(TWEN)|            // Enable TWI-interface and release TWI pins
            _BV(TWIE)|_BV(TWINT)| // Enable TWI Interupt
-           _BV(TWEA)|_BV(TWSTO); // Send ACK after next reception, stop bus
+           _BV(TWEA)|_BV(TWSTO); // Send ACK after next reception, back to unaddressed
+    TWI_addressed = 0;
+}
 
-    while(TWCR&_BV(TWSTO));
+static unsigned char saturating_increment( unsigned char count ) {
+    return count < 0xff ? count + 1 : count;
 }
 
 /**
@@ -79,9 +94,12 @@ void TWI_Slave_Initialise( unsigned char TWI_ownAddress ) {
 ISR(TWI_vect) {
     static unsigned char TWI_bufPtr;
 
+    TWI_progress++;
+
     switch (TWSR) {
     case TW_ST_SLA_ACK:          // Own SLA+R has been received; ACK has been returned
     case TW_ST_ARB_LOST_SLA_ACK: // Arbitration lost; ACK has been returned
+        TWI_addressed = 1;
         TWI_bufPtr = 0;
         if (TWI_Tx_Data_Callback) {
             // Solicit data for reply via callback
@@ -105,6 +123,7 @@ ISR(TWI_vect) {
 
     case TW_ST_DATA_NACK:       // Data byte in TWDR has been transmitted; NOT ACK has been returned
     case TW_ST_LAST_DATA:       // Last data byte in TWDR has been transmitted (TWEA = �0�); ACK has been returned
+        TWI_addressed = 0;
         TWI_Start_Transceiver(1);
         break;
 
@@ -112,6 +131,7 @@ ISR(TWI_vect) {
     case TW_SR_SLA_ACK:            // Own SLA+W has been received; ACK has been returned
     case TW_SR_ARB_LOST_SLA_ACK:   // Arbitration lost; ACK has been returned
     case TW_SR_ARB_LOST_GCALL_ACK: // Arbitration lost; ACK has been returned
+        TWI_addressed = 1;
         TWI_bufPtr = 0;
         TWI_Start_Transceiver(1);
         break;
@@ -120,14 +140,20 @@ ISR(TWI_vect) {
     case TW_SR_GCALL_DATA_ACK: // Previously addressed with general call; data has been received; ACK has been returned
         if (TWI_bufPtr < TWI_BUFFER_SIZE) {
             TWI_buf[TWI_bufPtr++] = TWDR;
-            TWI_Start_Transceiver(1);
+            // The command itself got its ACK already: a master sending one
+            // we don't take sees its first argument NACKed
+            TWI_Start_Transceiver(TWI_bufPtr > 1 || !TWI_Rx_Command_Callback ||
+                                  TWI_Rx_Command_Callback(TWI_buf[0]));
         } else {
             TWI_Start_Transceiver(0);
         }
         break;
 
     case TW_SR_STOP: // A STOP condition or repeated START condition has been received while still addressed as Slave
-        TWI_Stop();
+        // No TWI_Stop() here: TWSTO resets the TWI, which then misses the
+        // SLA+R of a repeated START. Handing over the data before clearing
+        // TWINT means the command is in place for that read.
+        TWI_addressed = 0;
         if (TWI_Rx_Data_Callback) {
             TWI_Rx_Data_Callback(TWI_buf, TWI_bufPtr);
         }
@@ -136,7 +162,10 @@ ISR(TWI_vect) {
 
     case TW_SR_DATA_NACK:       // Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
     case TW_SR_GCALL_DATA_NACK: // Previously addressed with general call; data has been received; NOT ACK has been returned
-        TWI_Start_Transceiver(0);
+        // That was the last byte we take: back to unaddressed, and to
+        // ACKing our own address (TWEA) next time
+        TWI_addressed = 0;
+        TWI_Start_Transceiver(1);
         break;
 
     case TW_NO_INFO:
@@ -144,7 +173,33 @@ ISR(TWI_vect) {
 
     case TW_BUS_ERROR: // Bus error due to an illegal START or STOP condition
     default:
-        TWI_Stop();
+        TWI_bus_errors = saturating_increment(TWI_bus_errors);
+        TWI_Release();
         break;
     }
 }
+
+void TWI_Slave_Watchdog( uint16_t now, uint16_t timeout ) {
+    static unsigned char last_progress;
+    static uint16_t stalled_since;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!TWI_addressed || TWI_progress != last_progress) {
+            last_progress = TWI_progress;
+            stalled_since = now;
+        } else if ((uint16_t)(now - stalled_since) >= timeout) {
+            // The master went away in the middle of a transaction. If it
+            // was reading, we may be holding SDA low, and the bus with it.
+            TWI_watchdog_resets = saturating_increment(TWI_watchdog_resets);
+            TWI_Release();
+        }
+    }
+}
+
+uint8_t TWI_Slave_Bus_Errors( void ) {
+    return TWI_bus_errors;
+}
+
+uint8_t TWI_Slave_Watchdog_Resets( void ) {
+    return TWI_watchdog_resets;
+}
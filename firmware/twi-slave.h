@@ -9,6 +9,7 @@
  *
  * -------------------------------------------------------------------------------------------------
  */
+#include <stdint.h>
 #include "led-spiout.h"
 
 #pragma once
@@ -17,10 +18,11 @@
   TWI Status/Control register definitions
 ****************************************************************************/
 
-#define TWI_BUFFER_SIZE 128      // Reserves memory for the drivers transceiver buffer
-// 32 is the same as arduino's TX buffer for
-//
-// TWI
+// Reserves memory for the drivers transceiver buffer: enough for the longest
+// command, TWI_CMD_LED_UPDATE_ALL with data for every LED. Anything past
+// that gets NACKed.
+// (32 is the same as arduino's TX buffer for TWI)
+#define TWI_BUFFER_SIZE (1 + LED_BUFSZ)
 
 /****************************************************************************
   Callback definitions
@@ -32,8 +34,21 @@ extern void (*TWI_Tx_Data_Callback)( unsigned char *, unsigned char * );
 // Called to provide received data
 extern void (*TWI_Rx_Data_Callback)( unsigned char *, unsigned char );
 
+// Called with the first byte of a write, the command. Returning 0 NACKs the
+// byte after it, and that write never gets to TWI_Rx_Data_Callback.
+extern unsigned char (*TWI_Rx_Command_Callback)( unsigned char );
+
 /****************************************************************************
   Function definitions
 ****************************************************************************/
 
 void TWI_Slave_Initialise( unsigned char );
+
+// Call this regularly from the main loop, with a clock that counts up (and
+// wraps) at any rate. When a transaction has been stuck for timeout of its
+// ticks, it resets the TWI, which lets go of the bus.
+void TWI_Slave_Watchdog( uint16_t now, uint16_t timeout );
+
+// Error counters, up to 255 each
+uint8_t TWI_Slave_Bus_Errors( void );
+uint8_t TWI_Slave_Watchdog_Resets( void );
@@ -9,7 +9,19 @@
 #define TWI_CMD_LED_SPI_FREQUENCY 0x06
 #define TWI_CMD_LED_GLOBAL_BRIGHTNESS 0x07
 #define TWI_CMD_LED_UPDATE_ALL 0x08
+#define TWI_CMD_LED_FRAME_INTERVAL 0x09
+#define TWI_CMD_KEYSCAN_SETTLE_DELAY 0x0a
+#define TWI_CMD_KEYSCAN_IDLE_INTERVAL 0x0b
+#define TWI_CMD_KEYSCAN_TICKS 0x0c
+#define TWI_CMD_STATUS 0x0d
 #define TWI_CMD_KEYDATA_SIZE 0x0f
+#define TWI_CMD_LED_SET_PALETTE 0x10
+#define TWI_CMD_LED_UPDATE_INDEXED 0x11
+#define TWI_CMD_LED_SET_RUNS 0x12
+#define TWI_CMD_LED_GAMMA 0x13
+#define TWI_CMD_LED_EFFECT 0x14
+#define TWI_CMD_LED_BRIGHTNESS_SCALE 0x15
+#define TWI_CMD_LED_COUNT 0x16
 #define TWI_CMD_LED_BASE 0x80
 
 #define LED_SPI_FREQUENCY_4MHZ      0x07
@@ -21,6 +33,13 @@
 #define LED_SPI_FREQUENCY_64KHZ     0x01
 #define LED_SPI_OFF                 0x00
 
+// Effects for TWI_CMD_LED_EFFECT, drawn from the palette
+#define LED_EFFECT_NONE     0x00 // LEDs only change when the master says so
+#define LED_EFFECT_BREATHE  0x01 // color 0, fading in and out
+#define LED_EFFECT_FADE     0x02 // from color 0 to color 1 and back
+#define LED_EFFECT_REACTIVE 0x03 // color 0, with keys lighting up in color 1 as they're pressed
+#define LED_EFFECT_COUNT    0x04
+
 
 // 512KHZ seems to be the sweet spot in early testing
 // so make it the default
@@ -31,5 +50,32 @@
 
 
 
+// Write this as the keyscan settle delay to recalibrate it
+#define TWI_KEYSCAN_SETTLE_CALIBRATE 0xff
+
+
+// What TWI_CMD_STATUS reads, by offset. One byte each unless noted, multi
+// byte fields low byte first. New fields only ever go at the end.
+#define TWI_STATUS_VERSION 0
+#define TWI_STATUS_KEYSCAN_INTERVAL 1
+#define TWI_STATUS_KEYSCAN_IDLE_INTERVAL 2
+#define TWI_STATUS_KEYSCAN_SETTLE_DELAY 3
+#define TWI_STATUS_LED_SPI_FREQUENCY 4
+#define TWI_STATUS_LED_FRAME_INTERVAL 5
+#define TWI_STATUS_KEYDATA_SIZE 6
+#define TWI_STATUS_KEY_REPORTS_QUEUED 7
+#define TWI_STATUS_KEY_REPORTS_DROPPED 8 // reports the ring had no room for, up to 255
+#define TWI_STATUS_KEYSCAN_TICKS 9 // 2 bytes, as TWI_CMD_KEYSCAN_TICKS
+#define TWI_STATUS_TWI_BUS_ERRORS 11 // illegal STARTs and STOPs, up to 255
+#define TWI_STATUS_TWI_WATCHDOG_RESETS 12 // transactions the master never finished, up to 255
+#define TWI_STATUS_CAPABILITIES 13 // TWI_CAPABILITY_* bits
+#define TWI_STATUS_SIZE 14
+
+// Commands only some builds take, in TWI_STATUS_CAPABILITIES. A build
+// without them NACKs their writes after the command byte.
+#define TWI_CAPABILITY_LED_PALETTE 0x01 // TWI_CMD_LED_SET_PALETTE, _UPDATE_INDEXED and _SET_RUNS
+#define TWI_CAPABILITY_LED_EFFECTS 0x02 // TWI_CMD_LED_EFFECT
+
+
 #define TWI_REPLY_NONE 0x00
 #define TWI_REPLY_KEYDATA 0x01
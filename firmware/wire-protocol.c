@@ -18,20 +18,68 @@ void twi_init(void) {
 
     TWI_Rx_Data_Callback = twi_data_received;
     TWI_Tx_Data_Callback = twi_data_requested;
+    TWI_Rx_Command_Callback = twi_command_supported;
 
     // TODO: set TWI_Tx_Data_Callback and TWI_Rx_Data_Callback
     TWI_Slave_Initialise(TWI_BASE_ADDRESS | AD01());
     sei();
 }
 
+void twi_watchdog(void) {
+    TWI_Slave_Watchdog(keyscanner_get_ticks(), KEYSCAN_US_TO_TICKS(TWI_WATCHDOG_TIMEOUT_US));
+}
+
 static uint8_t twi_command = TWI_CMD_NONE;
 
+// What this build takes, for TWI_STATUS_CAPABILITIES
+#if defined(LED_PALETTE)
+#define TWI_CAPABILITIES_PALETTE TWI_CAPABILITY_LED_PALETTE
+#else
+#define TWI_CAPABILITIES_PALETTE 0
+#endif
+#if defined(LED_EFFECTS)
+#define TWI_CAPABILITIES_EFFECTS TWI_CAPABILITY_LED_EFFECTS
+#else
+#define TWI_CAPABILITIES_EFFECTS 0
+#endif
+#define TWI_CAPABILITIES (TWI_CAPABILITIES_PALETTE | TWI_CAPABILITIES_EFFECTS)
+
+/* Commands this build leaves out get their writes NACKed, so the master
+ * knows, rather than dropped without a word. Reading one back still works. */
+uint8_t twi_command_supported(uint8_t command) {
+    switch (command) {
+#if !defined(LED_PALETTE)
+    case TWI_CMD_LED_SET_PALETTE:
+    case TWI_CMD_LED_UPDATE_INDEXED:
+    case TWI_CMD_LED_SET_RUNS:
+        return 0;
+#endif
+#if !defined(LED_EFFECTS)
+    case TWI_CMD_LED_EFFECT:
+        return 0;
+#endif
+    default:
+        return 1;
+    }
+}
+
+/* Everything here comes off the wire: a short transfer, or a corrupt one,
+ * must not read past what the master sent, or write an LED or a bank that
+ * isn't there. Those get dropped. */
 void twi_data_received(uint8_t *buf, uint8_t bufsiz) {
+    // A master that addressed us and stopped, with nothing written
+    if (__builtin_expect(bufsiz == 0, EXPECT_FALSE)) {
+        return;
+    }
+
     // if the upper four bits of the byte say this is an LED cmd
     // this is the most common case. It's also the only case where
     // we can't just compare buf[0] to a static value
     if (__builtin_expect( ((buf[0] & 0xf0) == TWI_CMD_LED_BASE),EXPECT_TRUE))  {
-        led_update_bank(&buf[1], buf[0] & 0x0f); // the lowest four bits are the bank #
+        uint8_t bank = buf[0] & 0x0f; // the lowest four bits are the bank #
+        if (__builtin_expect(bank < NUM_LED_BANKS && bufsiz > LED_BANK_SIZE, EXPECT_TRUE)) {
+            led_update_bank(&buf[1], bank);
+        }
         return;
     }
 
@@ -41,7 +89,8 @@ void twi_data_received(uint8_t *buf, uint8_t bufsiz) {
 
     switch (buf[0]) {
     case TWI_CMD_LED_UPDATE_ALL:
-        led_update_all(&buf[1]);
+        if (bufsiz > LED_BUFSZ)
+            led_update_all(&buf[1]);
         break;
 
     case TWI_CMD_KEYSCAN_INTERVAL:
@@ -49,11 +98,26 @@ void twi_data_received(uint8_t *buf, uint8_t bufsiz) {
             keyscanner_set_interval(buf[1]);
         break;
 
+    case TWI_CMD_KEYSCAN_IDLE_INTERVAL:
+        if (bufsiz == 2 )
+            keyscanner_set_idle_interval(buf[1]);
+        break;
+
+    case TWI_CMD_KEYSCAN_SETTLE_DELAY:
+        if (bufsiz == 2 )
+            keyscanner_set_settle_delay(buf[1]);
+        break;
+
     case TWI_CMD_LED_SPI_FREQUENCY:
         if (bufsiz == 2 )
             led_set_spi_frequency(buf[1]);
         break;
 
+    case TWI_CMD_LED_FRAME_INTERVAL:
+        if (bufsiz == 2 )
+            led_set_frame_interval(buf[1]);
+        break;
+
 
     case TWI_CMD_LED_SET_ALL_TO:
         if (bufsiz == 4 )
@@ -62,16 +126,74 @@ void twi_data_received(uint8_t *buf, uint8_t bufsiz) {
         break;
 
     case TWI_CMD_LED_SET_ONE_TO:
-        if (bufsiz == 5 )
+        if (bufsiz == 5 && buf[1] < NUM_LEDS)
             led_set_one_to(buf[1],&buf[2]);
         break;
 
     case TWI_CMD_LED_GLOBAL_BRIGHTNESS:
-        led_set_global_brightness(buf[1]);
+        if (bufsiz == 2 )
+            led_set_global_brightness(buf[1]);
+        break;
+
+#if defined(LED_PALETTE)
+    // The first entry, then LED_DATA_SIZE bytes for it and each one after
+    case TWI_CMD_LED_SET_PALETTE:
+        if (bufsiz >= 2 + LED_DATA_SIZE && buf[1] < LED_PALETTE_SIZE) {
+            uint8_t count = (bufsiz - 2) / LED_DATA_SIZE;
+            if (count > LED_PALETTE_SIZE - buf[1])
+                count = LED_PALETTE_SIZE - buf[1];
+            led_set_palette(buf[1], &buf[2], count);
+        }
+        break;
+
+    // The first LED, then a 4-bit palette index for it and each one after,
+    // two to a byte: 18 bytes for all 32 LEDs, where TWI_CMD_LED_UPDATE_ALL
+    // takes 97
+    case TWI_CMD_LED_UPDATE_INDEXED:
+        if (bufsiz > 2 && buf[1] < NUM_LEDS) {
+            uint8_t count = (bufsiz - 2) * 2;
+            if (count > NUM_LEDS - buf[1])
+                count = NUM_LEDS - buf[1];
+            led_update_indexed(buf[1], &buf[2], count);
+        }
+        break;
+
+    // Only the LEDs that change: the first LED, the number of LEDs and a
+    // palette index for each run
+    case TWI_CMD_LED_SET_RUNS:
+        if (bufsiz >= 4 )
+            led_set_runs(&buf[1], (bufsiz - 1) / 3);
+        break;
+#endif
+
+    case TWI_CMD_LED_GAMMA:
+        if (bufsiz == 2 )
+            led_set_gamma(buf[1]);
+        break;
+
+    // The effect, then its speed
+    case TWI_CMD_LED_EFFECT:
+        if (bufsiz == 3 && buf[1] < LED_EFFECT_COUNT)
+            led_set_effect(buf[1], buf[2]);
+        break;
+
+    // Brightness by scaling the color values, rather than with the APA102
+    // global brightness
+    case TWI_CMD_LED_BRIGHTNESS_SCALE:
+        if (bufsiz == 2 )
+            led_set_brightness_scale(buf[1]);
+        break;
+
+    // The length of the board's LED chain, kept in EEPROM
+    case TWI_CMD_LED_COUNT:
+        if (bufsiz == 2 && buf[1] >= 1 && buf[1] <= NUM_LEDS)
+            led_set_count(buf[1]);
         break;
 
     case TWI_CMD_VERSION:
     case TWI_CMD_KEYDATA_SIZE:
+    case TWI_CMD_KEYSCAN_TICKS:
+    case TWI_CMD_STATUS:
         break;
 
     }
@@ -96,24 +218,75 @@ void twi_data_requested(uint8_t *buf, uint8_t *bufsiz) {
                 buf[0]=TWI_REPLY_NONE;
             } else {
                 buf[0]=TWI_REPLY_KEYDATA;
-                for(int i = 1; i<= KEY_REPORT_SIZE_BYTES; i++) {
+                for(int i = 1; i<= KEY_REPORT_BYTES; i++) {
                     ringbuf_pop_to(buf+i);
                 }
-                *bufsiz=(KEY_REPORT_SIZE_BYTES+1);
+                *bufsiz=(KEY_REPORT_BYTES+1);
             }
             break;
         case TWI_CMD_VERSION:
             buf[0] = DEVICE_VERSION;
             break;
         case TWI_CMD_KEYDATA_SIZE:
-            buf[0] = KEY_REPORT_SIZE_BYTES;
+            // Including the timestamp, if reports have one
+            buf[0] = KEY_REPORT_BYTES;
             break;
         case TWI_CMD_KEYSCAN_INTERVAL:
             buf[0] = keyscanner_get_interval();
             break;
+        case TWI_CMD_KEYSCAN_IDLE_INTERVAL:
+            buf[0] = keyscanner_get_idle_interval();
+            break;
+        case TWI_CMD_KEYSCAN_TICKS: {
+            // Now, on the clock of KEY_REPORT_TIMESTAMPS, low byte first
+            uint16_t ticks = keyscanner_get_ticks();
+            buf[0] = ticks;
+            buf[1] = ticks >> 8;
+            *bufsiz = 2;
+            break;
+        }
+        case TWI_CMD_STATUS: {
+            // Everything a master asks about at boot or in a health check,
+            // in one read
+            uint16_t ticks = keyscanner_get_ticks();
+            buf[TWI_STATUS_VERSION] = DEVICE_VERSION;
+            buf[TWI_STATUS_KEYSCAN_INTERVAL] = keyscanner_get_interval();
+            buf[TWI_STATUS_KEYSCAN_IDLE_INTERVAL] = keyscanner_get_idle_interval();
+            buf[TWI_STATUS_KEYSCAN_SETTLE_DELAY] = keyscanner_get_settle_delay();
+            buf[TWI_STATUS_LED_SPI_FREQUENCY] = led_get_spi_frequency();
+            buf[TWI_STATUS_LED_FRAME_INTERVAL] = led_get_frame_interval();
+            buf[TWI_STATUS_KEYDATA_SIZE] = KEY_REPORT_BYTES;
+            buf[TWI_STATUS_KEY_REPORTS_QUEUED] = ringbuf_size() / KEY_REPORT_BYTES;
+            buf[TWI_STATUS_KEY_REPORTS_DROPPED] = ringbuf_dropped();
+            buf[TWI_STATUS_KEYSCAN_TICKS] = ticks;
+            buf[TWI_STATUS_KEYSCAN_TICKS + 1] = ticks >> 8;
+            buf[TWI_STATUS_TWI_BUS_ERRORS] = TWI_Slave_Bus_Errors();
+            buf[TWI_STATUS_TWI_WATCHDOG_RESETS] = TWI_Slave_Watchdog_Resets();
+            buf[TWI_STATUS_CAPABILITIES] = TWI_CAPABILITIES;
+            *bufsiz = TWI_STATUS_SIZE;
+            break;
+        }
+        case TWI_CMD_KEYSCAN_SETTLE_DELAY:
+            buf[0] = keyscanner_get_settle_delay();
+            break;
         case TWI_CMD_LED_SPI_FREQUENCY:
             buf[0] = led_get_spi_frequency();
             break;
+        case TWI_CMD_LED_FRAME_INTERVAL:
+            buf[0] = led_get_frame_interval();
+            break;
+        case TWI_CMD_LED_GAMMA:
+            buf[0] = led_get_gamma();
+            break;
+        case TWI_CMD_LED_EFFECT:
+            buf[0] = led_get_effect();
+            break;
+        case TWI_CMD_LED_BRIGHTNESS_SCALE:
+            buf[0] = led_get_brightness_scale();
+            break;
+        case TWI_CMD_LED_COUNT:
+            buf[0] = led_get_count();
+            break;
         default:
             buf[0] = 0x01;
             break;
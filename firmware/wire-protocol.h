@@ -5,15 +5,45 @@
 #define TWI_BASE_ADDRESS     0x58
 
 
-#define DEVICE_VERSION 4
+// What TWI_CMD_VERSION and TWI_CMD_STATUS report. Version 5 adds the commands
+// from TWI_CMD_LED_FRAME_INTERVAL (0x09) to TWI_CMD_LED_COUNT (0x16), and
+// TWI_CMD_STATUS: a master should only send those to version 5 or later.
+#define DEVICE_VERSION 5
 
 
 // Default about 0.47ms between reads.
 // This lets us do two scans per ms, which -might- let us send updates every ms.
 #define KEYSCAN_INTERVAL_DEFAULT 14
 
+// Once the keys have been still for a while, scan about every 1.3ms instead.
+// The master can change it with TWI_CMD_KEYSCAN_IDLE_INTERVAL, 0 (or anything
+// up to the keyscan interval) always scans at the keyscan interval.
+// LED frames start in scan slots, so an idle keyboard also caps them at
+// about 750 per second.
+#define KEYSCAN_IDLE_INTERVAL_DEFAULT 42
+
+// An LED frame starts in the first scan slot 2.56ms (5 steps of 512us) or
+// more after the first update that goes in it. A master's four bank writes
+// take about 2.3ms at 400KHz, so a full update goes out as one frame, and
+// frames are capped at about 390 per second. The master can change it with
+// TWI_CMD_LED_FRAME_INTERVAL: 0 starts a frame in the first scan slot after
+// any update.
+#define LED_FRAME_INTERVAL_DEFAULT 5
+
+// An LED effect goes round about every 4.2s, unless TWI_CMD_LED_EFFECT asks
+// for another speed
+#define LED_EFFECT_SPEED_DEFAULT 2
+
+// A master that stops in the middle of a transaction for this long is gone,
+// and we reset the TWI rather than hold on to the bus. SMBus masters give up
+// after 25-35ms.
+#define TWI_WATCHDOG_TIMEOUT_US 25000
+
 // I²C driver functions
+uint8_t twi_command_supported(uint8_t command);
 void twi_data_received( uint8_t *buf, uint8_t bufsiz);
 void twi_data_requested( uint8_t *buf, uint8_t *bufsiz);
 
 void twi_init(void);
+// Call from the main loop, at least every few ms
+void twi_watchdog(void);
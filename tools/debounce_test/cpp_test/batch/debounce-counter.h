@@ -0,0 +1,27 @@
+#pragma once
+
+// Batch version of firmware/debounce-counter.h, see lanes.h
+
+#include "lanes.h"
+
+#define DEBOUNCE_BATCH
+
+template <typename lanes_t>
+struct debounce_batch_t {
+    lanes_t db0;    // counter bit 0
+    lanes_t db1;    // counter bit 1
+    lanes_t state;  // debounced state
+};
+
+template <typename lanes_t>
+static inline lanes_t debounce_batch(lanes_t sample, debounce_batch_t<lanes_t> *debouncer) {
+    lanes_t delta, changes;
+
+    delta = sample ^ debouncer->state;
+    debouncer->db1 = ((debouncer->db1) ^ (debouncer->db0)) & delta;
+    debouncer->db0 = ~(debouncer->db0) & delta;
+    changes = ~(~delta | (debouncer->db0) | (debouncer->db1));
+    debouncer->state ^= changes;
+
+    return changes;
+}
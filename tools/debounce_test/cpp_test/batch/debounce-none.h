@@ -0,0 +1,19 @@
+#pragma once
+
+// Batch version of firmware/debounce-none.h, see lanes.h
+
+#include "lanes.h"
+
+#define DEBOUNCE_BATCH
+
+template <typename lanes_t>
+struct debounce_batch_t {
+    lanes_t state;  // debounced state
+};
+
+template <typename lanes_t>
+static inline lanes_t debounce_batch(lanes_t sample, debounce_batch_t<lanes_t> *debouncer) {
+    lanes_t changes = sample ^ debouncer->state;
+    debouncer->state = sample;
+    return changes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+// Batch version of firmware/debounce-split-counters.h, see lanes.h. Takes
+// its delays and counter size from there.
+
+#include "lanes.h"
+
+#define DEBOUNCE_BATCH
+
+template <typename lanes_t>
+struct debounce_batch_t {
+    lanes_t counter_bits[NUM_COUNTER_BITS];
+    lanes_t last_changes;
+    lanes_t state;  // debounced state
+};
+
+template <typename lanes_t>
+__attribute__((optimize("unroll-loops")))
+static inline lanes_t debounce_batch(lanes_t sample, debounce_batch_t<lanes_t> *debouncer) {
+    lanes_t state_changed = sample ^ debouncer->state;
+    lanes_t carry_inc = ~lanes_t{};
+    lanes_t waited_for_press_delay = ~lanes_t{};
+    lanes_t waited_for_release_delay = ~lanes_t{};
+
+    if (_DEBOUNCE_FORCE_RESET != 0)
+        state_changed &= ~debouncer->last_changes;
+
+    for(uint8_t i=0; i<NUM_COUNTER_BITS; i++) {
+        debouncer->counter_bits[i] = (debouncer->counter_bits[i] ^ carry_inc) & state_changed;
+        carry_inc &= ~debouncer->counter_bits[i];
+
+        if (i < _NUM_BITS(DEBOUNCE_PRESS_DELAY_COUNT))
+            waited_for_press_delay &= (
+                                          ((DEBOUNCE_PRESS_DELAY_COUNT + 1) & _BV(i)) ?
+                                          debouncer->counter_bits[i] :
+                                          ~debouncer->counter_bits[i]);
+
+        if (i < _NUM_BITS(DEBOUNCE_RELEASE_DELAY_COUNT))
+            waited_for_release_delay &= (
+                                            ((DEBOUNCE_RELEASE_DELAY_COUNT + 1) & _BV(i)) ?
+                                            debouncer->counter_bits[i] :
+                                            ~debouncer->counter_bits[i]);
+    }
+
+    lanes_t changes = state_changed & ((~debouncer->state & waited_for_press_delay) |
+                                       ( debouncer->state & waited_for_release_delay));
+    if (_DEBOUNCE_FORCE_RESET != 0)
+        debouncer->last_changes = changes;
+    debouncer->state ^= changes;
+    return changes;
+}
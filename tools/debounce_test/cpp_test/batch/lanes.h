@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Lanes for the host-only batch debouncers (-B, see debounce_test.cpp).
+ *
+ * The bit-sliced debouncers keep one key per bit of a uint8_t, and only use
+ * bitwise operations on them. Their batch versions (batch/debounce-*.h)
+ * are the same code over a wider type, with one independent trace per bit
+ * of it instead of one key:
+ * - lanes64_t: 64 traces in a uint64_t
+ * - lanes256_t: 256 traces in a GCC vector of 4 uint64_t. That's a single
+ *   AVX2 register when built with -mavx2 or -march=native, and a couple of
+ *   SSE2 ones, or plain uint64_t, otherwise: there are no intrinsics, so it
+ *   builds and gives the same results anywhere.
+ */
+
+#include <stdint.h>
+
+typedef uint64_t    lanes64_t;
+typedef uint64_t    lanes256_t __attribute__((vector_size(32)));
+
+// Number of traces in lanes_t
+template <typename lanes_t>
+constexpr int       LANES = sizeof(lanes_t) * 8;
+
+// Bit `lane` of `lanes`
+template <typename lanes_t>
+static inline bool  lane_get(const lanes_t &lanes, int lane) {
+    const uint64_t  *words = reinterpret_cast<const uint64_t *>(&lanes);
+    return (words[lane / 64] >> (lane % 64)) & 1;
+}
+
+// Sets bit `lane` of `lanes`, which should be 0 before
+template <typename lanes_t>
+static inline void  lane_set(lanes_t &lanes, int lane) {
+    uint64_t        *words = reinterpret_cast<uint64_t *>(&lanes);
+    words[lane / 64] |= uint64_t(1) << (lane % 64);
+}
@@ -0,0 +1,182 @@
+#!/usr/bin/perl
+#
+# Benchmarks every debouncer over the pinned corpus in bench_corpus.txt, and
+# checks the results against a JSON baseline.
+#
+# Each debouncer runs with -b (see debounce_test.cpp), which reports:
+#   - samples_per_second: debounce() calls per second, replaying the
+#     corpus with nothing else in the loop. Best of --runs runs.
+#   - bytes_per_key: sizeof(debounce_t) / 8, each debounce_t being a byte
+#     of keys.
+#   - failures: corpus files the debouncer got wrong.
+#   - latency_ms: p50, p90, p99 and max press latency, from the first contact
+#     to the debounced press, in simulated time.
+#
+# It fails when a debouncer has more failures or bytes per key than in the
+# baseline, a latency more than --latency-rise percent higher, or throughput
+# more than --throughput-drop percent lower. Everything but throughput is
+# deterministic; throughput only compares on the machine the baseline was
+# taken on, so take a new one (make bench-baseline) after moving.
+#
+# usage: perl bench.pl [--update] [--runs N] [--throughput-drop PERCENT]
+#                      [--latency-rise PERCENT] [--results FILE] baseline.json
+#
+#   --update    : write the results to baseline.json instead of checking them
+
+use warnings;
+use strict;
+use Getopt::Long;
+use JSON::PP;
+
+my $update          = 0;
+my $runs            = 2;
+my $throughput_drop = 25;
+my $latency_rise    = 5;
+my $results_file    = 'bench_results.json';
+
+GetOptions(
+    'update'            => \$update,
+    'runs=i'            => \$runs,
+    'throughput-drop=f' => \$throughput_drop,
+    'latency-rise=f'    => \$latency_rise,
+    'results=s'         => \$results_file,
+) or die "bad options\n";
+my $baseline_file = shift @ARGV or die "no baseline file given\n";
+
+my @corpus;
+open( my $corpus_fh, '<', 'bench_corpus.txt' ) or die "bench_corpus.txt: $!\n";
+while ( my $line = <$corpus_fh> ) {
+    chomp $line;
+    next if $line =~ /^\s*(#|$)/;
+    push @corpus, $line;
+}
+close $corpus_fh;
+
+my @debouncers;
+for my $debouncer (`find . -path './debounce-*' -type f -executable`) {
+    chomp $debouncer;
+    $debouncer =~ s/^\.\///;
+    push @debouncers, $debouncer;
+}
+@debouncers = sort @debouncers;
+die "no debouncers built\n" unless @debouncers;
+
+my %results;
+for my $debouncer (@debouncers) {
+    print STDERR "Benchmarking ", $debouncer, "...\n";
+
+    for my $run ( 1 .. $runs ) {
+        my $bench;
+        open( my $out, '-|', "./$debouncer", '-b', @corpus )
+          or die "$debouncer: $!\n";
+        while ( my $line = <$out> ) {
+            chomp $line;
+            my @column = split( ';', $line );
+            $bench = \@column if @column > 1 && $column[1] eq 'bench';
+        }
+        close $out;
+        die "$debouncer: no bench line\n" unless $bench;
+
+        my ( undef, undef, $files, $failures, $samples, $rate, $bytes_per_key, @latency ) =
+          @$bench;
+        my $result = $results{$debouncer};
+        if ( !$result || $rate > $result->{samples_per_second} ) {
+            $results{$debouncer} = {
+                files              => $files + 0,
+                failures           => $failures + 0,
+                samples            => $samples + 0,
+                samples_per_second => $rate + 0,
+                bytes_per_key      => $bytes_per_key + 0,
+                latency_ms         => {
+                    p50 => $latency[0] + 0,
+                    p90 => $latency[1] + 0,
+                    p99 => $latency[2] + 0,
+                    max => $latency[3] + 0,
+                },
+            };
+        }
+    }
+}
+
+my $json    = JSON::PP->new->pretty->canonical;
+my $current = { corpus => \@corpus, debouncers => \%results };
+
+open( my $results_fh, '>', $results_file ) or die "$results_file: $!\n";
+print $results_fh $json->encode($current);
+close $results_fh;
+
+if ($update) {
+    open( my $baseline_fh, '>', $baseline_file ) or die "$baseline_file: $!\n";
+    print $baseline_fh $json->encode($current);
+    close $baseline_fh;
+    print "wrote ", $baseline_file, "\n";
+}
+
+my $baseline = {};
+if ( open( my $baseline_fh, '<', $baseline_file ) ) {
+    local $/;
+    $baseline = $json->decode(<$baseline_fh>);
+    close $baseline_fh;
+}
+else {
+    warn "no baseline in $baseline_file: make bench-baseline to take one\n";
+}
+if ( $baseline->{corpus}
+    && join( "\n", @{ $baseline->{corpus} } ) ne join( "\n", @corpus ) )
+{
+    die "$baseline_file was taken over another corpus: make bench-baseline\n";
+}
+
+# Percent change from the baseline, or '' without one
+sub change {
+    my ( $now, $was ) = @_;
+    return '' unless defined $was;
+    return $was ? sprintf( '%+.1f%%', 100 * ( $now - $was ) / $was ) : '';
+}
+
+my @regressions;
+printf "%-40s %12s %8s %6s %6s %7s %7s %7s %7s\n", 'debouncer', 'samples/s',
+  'change', 'B/key', 'fails', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms';
+for my $debouncer (@debouncers) {
+    my $now = $results{$debouncer};
+    my $was = $baseline->{debouncers}{$debouncer};
+
+    printf "%-40s %12.0f %8s %6.3f %6d %7.3f %7.3f %7.3f %7.3f\n", $debouncer,
+      $now->{samples_per_second},
+      change( $now->{samples_per_second}, $was && $was->{samples_per_second} ),
+      $now->{bytes_per_key}, $now->{failures},
+      @{ $now->{latency_ms} }{qw(p50 p90 p99 max)};
+
+    next unless $was;
+    if ( $now->{samples_per_second} <
+        $was->{samples_per_second} * ( 1 - $throughput_drop / 100 ) )
+    {
+        push @regressions,
+          sprintf( '%s: %.0f samples/s, down from %.0f',
+            $debouncer, $now->{samples_per_second},
+            $was->{samples_per_second} );
+    }
+    for my $metric (qw(failures bytes_per_key)) {
+        if ( $now->{$metric} > $was->{$metric} ) {
+            push @regressions,
+              sprintf( '%s: %s %s, up from %s',
+                $debouncer, $now->{$metric}, $metric, $was->{$metric} );
+        }
+    }
+    for my $p (qw(p50 p90 p99 max)) {
+        my ( $latency, $was_latency ) =
+          ( $now->{latency_ms}{$p}, $was->{latency_ms}{$p} );
+        if ( $latency > $was_latency * ( 1 + $latency_rise / 100 ) ) {
+            push @regressions,
+              sprintf( '%s: %s latency %.3fms, up from %.3fms',
+                $debouncer, $p, $latency, $was_latency );
+        }
+    }
+}
+
+if (@regressions) {
+    print "\nregressed against $baseline_file:\n";
+    print "    $_\n" for @regressions;
+    exit 1;
+}
+print "\nno regressions against $baseline_file\n" if %{$baseline};
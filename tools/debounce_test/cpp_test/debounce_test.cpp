@@ -1,318 +1,144 @@
 
+#include <algorithm>
+#include <chrono>
 #include <vector>
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <cassert>
 #include <getopt.h>
-#include <ctype.h>
 
-// regexp are cool, but takes too much time to compile !
-//#define USE_STD_REGEX
-
-#ifdef USE_STD_REGEX
-#   include <regex>
-#endif
-
-#define SEPARATOR   "########################################"
-
-// stdout goes to run_tests.pl
-#define log(__fmt, ...)     do { printf(__fmt "\n", ##__VA_ARGS__); deb("# LOG: " __fmt, ##__VA_ARGS__); } while (0)
-
-// stderr for error and debugging (not catched by run_tests.pl)
-#define err(__fmt, ...)     do { fprintf(stderr, "ERROR %s: " __fmt "\n", g_debouncer_name, ##__VA_ARGS__); } while (0)
-#define deb(__fmt, ...)     do { if (g_debug) fprintf(stderr, __fmt "\n", ##__VA_ARGS__); } while (0)
-
-const char      *g_debouncer_name = nullptr;
-bool            g_debug = false;
-
-// Parses and test one input test data file
-class Tester {
-  public:
-    int         _target_sampling_rate = 625;
-    bool        _success = false;
-
-    // Parses filepath data file, then runs the debouncer test
-    // Test result in `_success`.
-    // Returns false only if test could not be run.
-    bool        run_file(const char *filepath) {
-        deb("# Running %s %s", g_debouncer_name, filepath);
-
-        _test_name = filepath;
-
-        if (!_parse_file(filepath))
-            return false;
-
-        if (_raw_data.size() == 0) {
-            err("no data");
-            return false;
-        }
-        if (_data_presses < 0) {
-            err("could not find presses number");
-            return false;
-        }
-        if (_data_sampling_rate <= 0) {
-            err("invalid sampling rate");
-            return false;
-        }
-
-        deb(SEPARATOR SEPARATOR);
-        deb("# test file sampling rate: %d, simulating sampling rate: %d", _data_sampling_rate, _target_sampling_rate);
-        deb("# here, 10 sample = %.2f ms, 10ms = %.2f samples", 1000.0 / double(_target_sampling_rate), double(_target_sampling_rate) / 100.0);
-
-        _success = _run_test();
-
-        deb(SEPARATOR);
-        deb("# Final test result: %s", _success ? "SUCCESS" : "FAILURE");
-
-        return true;
-    }
-
-  private:
-    //
-    // Parsing
-    //
-
-    const char              *_test_name = nullptr;
-    int                     _data_sampling_rate = 625;
-    int                     _data_presses = -1;
-    std::vector<bool>       _raw_data;
-
-    // Parses filepath input data file
-    bool        _parse_file(const char *filepath) {
-        FILE    *f = fopen(filepath, "r");
-        if (f == nullptr) {
-            perror("open data file");
-            return false;
-        }
-        char    *line = nullptr;
-        size_t  alloclen = 0;
-        ssize_t nread = 0;
-        int     linenum = 1;
-        for (; (nread = getline(&line, &alloclen, f)) > 0; ++linenum) {
-            _parse_line(line, nread, linenum);
-        }
-        free(line);
-        fclose(f);
-        return true;
-    }
-
-    // Parses a single line of input data file
-    void    _parse_line(const char *line, size_t len, int linenum) {
-        for (size_t i = 0; i < len; ++i) {
-            switch (line[i]) {
-            case '0':
-                _raw_data.push_back(0);
-                break;
-            case '1':
-                _raw_data.push_back(1);
-                break;
-            case '\r': // fallthrough
-            case '\n':
-            case '\t':
-            case ' ':
-                // ignore
-                break;
-            case '#':
-                _parse_comment(line, i, len, linenum);
-                return;
-            default:
-                deb("# Unkown char %c at line %d", line[i], linenum);
-                break;
-            }
-        }
+#include "tester.h"
+
+bool            g_bench = false;
+bool            g_batch = false;
+
+// -b times each file's samples replayed BENCH_REPEATS times, and keeps the
+// fastest of BENCH_TRIALS timings, which leaves out whatever else the
+// machine was doing
+#define BENCH_REPEATS   20
+#define BENCH_TRIALS    10
+
+// Seconds `run` takes, the fastest of BENCH_TRIALS runs
+template <typename F>
+static double   bench_fastest(F run) {
+    double      fastest = 0;
+    for (int trial = 0; trial < BENCH_TRIALS; ++trial) {
+        auto    start = std::chrono::steady_clock::now();
+        run();
+        double  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (trial == 0 || seconds < fastest)
+            fastest = seconds;
     }
+    return fastest;
+}
 
-#if !defined(USE_STD_REGEX)
-    // Parses a comment starting at `line + start`
-    void    _parse_comment(const char *line, size_t start, size_t end [[maybe_unused]], int linenum [[maybe_unused]]) {
-        //deb("# Comment at line %d: %s", linenum, line + start);
-
-        // skip '#'
-        while (line[start] == '#')
-            ++start;
-        // skip spaces
-        while (isspace(line[start]))
-            ++start;
-
-        static const char   s_sampling_rate[] = "SAMPLES-PER-SECOND:";
-        static const char   s_presses[] = "PRESSES:";
-        if (strncmp(line + start, s_sampling_rate, sizeof(s_sampling_rate) - 1) == 0) {
-            // atoi ignores leading spaces and trailing non-numerical
-            _data_sampling_rate = atoi(line + start + sizeof(s_sampling_rate) - 1);
-            deb("# found sampling rate %d (target=%d)", _data_sampling_rate, _target_sampling_rate);
-        } else if (strncmp(line + start, s_presses, sizeof(s_presses) - 1) == 0) {
-            // atoi ignores leading spaces and trailing non-numerical
-            _data_presses = atoi(line + start + sizeof(s_presses) - 1);
-            deb("# found presses %d", _data_presses);
-        }
-    }
-#else
-    // Parses a comment starting at `line + start`
-    std::match_results<const char*>     _match; // cache
-    void    _parse_comment(const char *line, size_t start, size_t end, int linenum [[maybe_unused]]) {
-        //deb("comment at line %d: %s", linenum, line + start);
-        static std::regex   s_reg_sampling_rate{"#\\s*SAMPLES-PER-SECOND:\\s*(\\d*)"};
-        static std::regex   s_reg_presses{"#\\s*PRESSES:\\s*(\\d*)"};
-        if (std::regex_search(line + start, line + end, _match, s_reg_sampling_rate)) {
-            _data_sampling_rate = atoi(_match[1].first()); // atoi ignores leading spaces and trailing non-numerical
-            deb("# found sampling rate %d (target=%d)", _data_sampling_rate, _target_sampling_rate);
-        } else if (std::regex_search(line + start, line + end, _match, s_reg_presses)) {
-            _data_presses = atoi(_match[1].first()); // atoi ignores leading spaces and trailing non-numerical
-            deb("# found presses %d", _data_presses);
-        }
+#if defined(DEBOUNCE_BATCH)
+// For -B: the batch version of the debouncer (batch/debounce-*.h) over
+// LANES<lanes_t> traces at once, one per lane. Traces shorter than the
+// longest are padded with releases.
+template <typename lanes_t>
+class Batch {
+  public:
+    Batch(const std::vector<const std::vector<bool> *> &traces) : _traces(traces) {
+        size_t  length = 0;
+        for (const std::vector<bool> *trace : traces)
+            length = std::max(length, trace->size());
+        _samples.assign(length, lanes_t{});
+        for (size_t lane = 0; lane < traces.size(); ++lane)
+            for (size_t i = 0; i < traces[lane]->size(); ++i)
+                if ((*traces[lane])[i])
+                    lane_set(_samples[i], lane);
     }
-#endif
-
-  private:
-    //
-    // Testing
-    //
-
-    debounce_t  _db;
-    int         _presses = 0;
-    int         _releases = 0;
-    bool        _test_failed = false;
-
-    // Tests the debouncer with parsed data
-    bool        _run_test() {
-        bzero(&_db, sizeof(_db));
-
-        const int   target_count = _target_sampling_rate * _raw_data.size() / _data_sampling_rate;
-
-        int         total_run_count = 0;
-
-        // Run 'nearest' sample test with 'jitter': give to the debouncer the
-        // nearest test sample. re-run with a sampling offset for all possible sampling offsets (jitter).
-        {
-            int     jitter = 0;
-            if (_data_sampling_rate > _target_sampling_rate)
-                jitter = 1 + (_data_sampling_rate - 1) / _target_sampling_rate;
-
-            for (int offset = 0; offset <= jitter; ++offset) {
-                deb(SEPARATOR);
-                deb("# Running test jitter, offset = %d", offset);
-
-                _run_debounce_sample_times(0, 100);
-                for (int i = 0; i < target_count - 1; ++i) {
-                    int         di = i * _data_sampling_rate / _target_sampling_rate;
-                    di += offset;
-                    assert(di < int(_raw_data.size()));
-                    uint8_t     sample = _raw_data[di];
-                    _run_debouce(sample);
-                }
-                _run_debounce_sample_times(0, 200);
 
-                ++total_run_count;
-                if (!_test_failed && _presses != _releases) {
-                    log("%s;%s;press_rel_mismatched", g_debouncer_name, _test_name);
-                    _test_failed = true;
+    // Checks every change the batch reports against debounce() over each
+    // trace on its own. Returns the number of samples where they differ.
+    uint64_t    check() const {
+        debounce_batch_t<lanes_t>   batch_db;
+        std::vector<lanes_t>        changes(_samples.size());
+
+        bzero(&batch_db, sizeof(batch_db));
+        for (size_t i = 0; i < _samples.size(); ++i)
+            changes[i] = debounce_batch(_samples[i], &batch_db);
+
+        uint64_t    mismatches = 0;
+        for (size_t lane = 0; lane < _traces.size(); ++lane) {
+            debounce_t  db;
+            bzero(&db, sizeof(db));
+            for (size_t i = 0; i < _traces[lane]->size(); ++i) {
+                uint8_t     expected = debounce((*_traces[lane])[i], &db);
+                if (lane_get(changes[i], lane) != bool(expected)) {
+                    deb("# lane %zu of %d, sample %zu: batch says %d, debounce() %d", lane, LANES<lanes_t>, i,
+                        lane_get(changes[i], lane), expected);
+                    ++mismatches;
                 }
-
-                deb("# End test: %d presss, %d releases, (%d target)", _presses, _releases, _data_presses * total_run_count);
-            }
-        }
-
-        // Run test averaging test's samples (if worth at least 2 times more data)
-        if (_data_sampling_rate / _target_sampling_rate > 1) {
-            // percent
-            const int   sample_avg_thresholds[] = { 33, 50, 66 };
-
-            for (int thi = 0; thi < int(sizeof(sample_avg_thresholds) / sizeof(*sample_avg_thresholds)); ++thi) {
-                const int   sample_avg_threshold = sample_avg_thresholds[thi];
-
-                deb(SEPARATOR);
-                deb("# Running test average > %d%%", sample_avg_threshold);
-
-                int         last_di = 0;
-                _run_debounce_sample_times(0, 100);
-                for (int i = 0; i < target_count; ++i) {
-                    int         di = i * _data_sampling_rate / _target_sampling_rate;
-                    assert(di < int(_raw_data.size()));
-                    int         samples_sum = _raw_data[di];
-                    int         samples_count = 1;
-                    for (int j = last_di + 1; j < di; ++j) {
-                        samples_sum += _raw_data[j];
-                        ++samples_count;
-                    }
-                    last_di = di;
-                    bool        sample_past_threshold = samples_sum * 100 >= sample_avg_threshold * samples_count;
-
-                    uint8_t     sample = sample_past_threshold ? 1 : 0;
-                    _run_debouce(sample);
-                }
-                _run_debounce_sample_times(0, 200);
-
-                ++total_run_count;
-                if (!_test_failed && _presses != _releases) {
-                    log("%s;%s;press_rel_mismatched", g_debouncer_name, _test_name);
-                    _test_failed = true;
-                }
-
-                deb("# End test: %d presss, %d releases, (%d target)", _presses, _releases, _data_presses * total_run_count);
             }
         }
-
-        int target_presses = _data_presses * total_run_count;
-
-        if (_presses != target_presses) {
-            log("%s;%s;%+.2f", g_debouncer_name, _test_name, double(_presses - target_presses) / double(total_run_count));
-            _test_failed = true;
-        } else
-            log("%s;%s;0", g_debouncer_name, _test_name);
-
-        return !_test_failed;
+        return mismatches;
     }
 
-    int         _last_state = 0;
-    int         _out_sample_i = 0;
-
-    // Runs a single call to debounce()
-    void        _run_debouce(uint8_t sample) {
-        uint8_t     debounced_changes;
-        debounced_changes = debounce(sample, &_db);
-        bool        overlflow = ((debounced_changes | _db.state) & ~1) != 0;
-        if (overlflow) {
-            log("%s;%s;overflow", g_debouncer_name, _test_name);
-            _test_failed = true;
-        }
-        bool        said_changed = debounced_changes != 0;
-        bool        state_changed = _db.state != _last_state;
-        _last_state = _db.state;
-        if (said_changed != state_changed) {
-            log("%s;%s;changes_miss", g_debouncer_name, _test_name);
-            _test_failed = true;
-        }
-        if (said_changed) {
-            if (_db.state)
-                ++_presses;
-            else
-                ++_releases;
+    // Replays the batch `repeats` times, like Tester::replay(). Returns the
+    // number of samples of the traces it went through, padding left out.
+    uint64_t    replay(int repeats) const {
+        debounce_batch_t<lanes_t>   db;
+        lanes_t     changes = lanes_t{};
+        for (int r = 0; r < repeats; ++r) {
+            bzero(&db, sizeof(db));
+            for (size_t i = 0; i < _samples.size(); ++i)
+                changes ^= debounce_batch(_samples[i], &db);
         }
+        g_bench_sink = g_bench_sink ^ lane_get(changes, 0);
 
-        deb("%d %d", sample, _db.state);
-        ++_out_sample_i;
-        if (_out_sample_i % 10 == 0)
-            deb("");
+        uint64_t    samples = 0;
+        for (const std::vector<bool> *trace : _traces)
+            samples += trace->size();
+        return repeats * samples;
     }
 
-    // Runs `sample` sample `count` times
-    void    _run_debounce_sample_times(uint8_t sample, int count) {
-        deb("# begin '%d' x %d", sample, count);
-        for (int i = 0; i < count; ++i)
-            _run_debouce(sample);
-        deb("# end '%d' x %d", sample, count);
-    };
+  private:
+    std::vector<const std::vector<bool> *>  _traces;
+    std::vector<lanes_t>                    _samples;
 };
 
+// Runs `traces` through Batch<lanes_t>, LANES<lanes_t> at a time, longest
+// first so they go with traces of about their length. Adds up the
+// mismatches with debounce(), and returns the samples per second.
+template <typename lanes_t>
+static double   batch_run(std::vector<const std::vector<bool> *> traces, uint64_t *mismatches) {
+    std::sort(traces.begin(), traces.end(), [](const std::vector<bool> *a, const std::vector<bool> *b) {
+        return a->size() > b->size();
+    });
+
+    uint64_t    samples = 0;
+    double      seconds = 0;
+    for (size_t first = 0; first < traces.size(); first += LANES<lanes_t>) {
+        size_t          last = std::min(traces.size(), first + LANES<lanes_t>);
+        Batch<lanes_t>  batch({ traces.begin() + first, traces.begin() + last });
+
+        uint64_t        batch_samples = 0;
+        *mismatches += batch.check();
+        seconds += bench_fastest([&] { batch_samples = batch.replay(BENCH_REPEATS); });
+        samples += batch_samples;
+    }
+    return seconds > 0 ? samples / seconds : 0.0;
+}
+#endif
+
 int main(int argc, char *argv[]) {
 
     g_debouncer_name = argv[0];
 
     const char      usage[] =
-        "usage: %s [-d] [-i interval] data/file/path...\n\
+        "usage: %s [-d] [-l] [-b] [-B] [-i interval] [-o reads] data/file/path...\n\
+    Data files are either samples at SAMPLES-PER-SECOND, or one timestamped\n\
+    scan per line: \"@<us> <sample>\".\n\
+\n\
     -i interval     : force a KEYSCAN_INTERVAL\n\
+    -o reads        : model KEYSCANNER_OVERSAMPLE reads (1, 3 or 5) per sample\n\
+    -l              : also log the mean and max press latency, in ms\n\
+    -b              : also log a benchmark line for all the files, see bench.pl\n\
+    -B              : also check the batch version of the debouncer against\n\
+                      debounce() over every file, and log its throughput\n\
     -d              : enable debug output on stderr\n\
 ";
 
@@ -320,11 +146,32 @@ int main(int argc, char *argv[]) {
     int         interval = 14;
 
     int         opt;
-    while ((opt = getopt(argc, argv, "di:")) != -1) {
+    while ((opt = getopt(argc, argv, "dlbBi:o:")) != -1) {
         switch (opt) {
         case 'i':
             interval = atoi(optarg);
             break;
+        case 'o':
+            g_oversample = atoi(optarg);
+            if (g_oversample != 1 && g_oversample != 3 && g_oversample != 5) {
+                fprintf(stderr, usage, argv[0]);
+                exit(1);
+            }
+            break;
+        case 'l':
+            g_latency = true;
+            break;
+        case 'b':
+            g_bench = true;
+            break;
+        case 'B':
+#if defined(DEBOUNCE_BATCH)
+            g_batch = true;
+            break;
+#else
+            fprintf(stderr, "%s has no batch version\n", argv[0]);
+            exit(1);
+#endif
         case 'd':
             g_debug = true;
             break;
@@ -349,6 +196,16 @@ int main(int argc, char *argv[]) {
     int         test_sucess = 0;
     int         total_tests = 0;
 
+    // For -b: debounce() calls and the time they took, and every latency
+    uint64_t                bench_samples = 0;
+    double                  bench_seconds = 0;
+    std::vector<double>     latencies_us;
+
+    // For -B: every file's samples, and how long debounce() took over them
+    std::vector<std::vector<bool>>  batch_traces;
+    uint64_t                batch_samples = 0;
+    double                  batch_seconds = 0;
+
     for (int i = optind; i < argc; ++i) {
         const char      *f = argv[i];
 
@@ -357,11 +214,61 @@ int main(int argc, char *argv[]) {
         t._target_sampling_rate = target_sampling_rate;
         if (!t.run_file(f)) {
             err("!!! Failed to run the test %s !!!", f);
-        } else
+        } else {
             test_sucess += t._success;
+            if (g_bench) {
+                uint64_t    samples = 0;
+                bench_seconds += bench_fastest([&] { samples = t.replay(BENCH_REPEATS); });
+                bench_samples += samples;
+                latencies_us.insert(latencies_us.end(), t._latencies_us.begin(), t._latencies_us.end());
+            }
+            if (g_batch) {
+                uint64_t    samples = 0;
+                batch_seconds += bench_fastest([&] { samples = t.replay(BENCH_REPEATS); });
+                batch_samples += samples;
+                batch_traces.push_back(t.samples());
+            }
+        }
         ++total_tests;
     }
 
     deb("Result %d/%d", test_sucess, total_tests);
 
+    // name;bench;files;failures;samples;samples/s;bytes per key;latency
+    // p50;p90;p99;max in ms (nearest rank)
+    if (g_bench) {
+        std::sort(latencies_us.begin(), latencies_us.end());
+        auto    percentile = [&](int p) {
+            if (latencies_us.empty())
+                return 0.0;
+            size_t  rank = (p * latencies_us.size() + 99) / 100;
+            return latencies_us[rank ? rank - 1 : 0] / 1000.0;
+        };
+        log("%s;bench;%d;%d;%llu;%.0f;%.3f;%.3f;%.3f;%.3f;%.3f", g_debouncer_name, total_tests,
+            total_tests - test_sucess, (unsigned long long)bench_samples,
+            bench_seconds > 0 ? bench_samples / bench_seconds : 0.0, sizeof(debounce_t) / 8.0,
+            percentile(50), percentile(90), percentile(99), percentile(100));
+    }
+
+    // name;batch;traces;samples;mismatches;samples/s of debounce(), and of
+    // the batch with 64 and 256 lanes
+#if defined(DEBOUNCE_BATCH)
+    if (g_batch) {
+        std::vector<const std::vector<bool> *>  traces;
+        for (const std::vector<bool> &trace : batch_traces)
+            traces.push_back(&trace);
+
+        uint64_t    mismatches = 0;
+        double      rate64 = batch_run<lanes64_t>(traces, &mismatches);
+        double      rate256 = batch_run<lanes256_t>(traces, &mismatches);
+        log("%s;batch;%zu;%llu;%llu;%.0f;%.0f;%.0f", g_debouncer_name, traces.size(),
+            (unsigned long long)batch_samples / BENCH_REPEATS, (unsigned long long)mismatches,
+            batch_seconds > 0 ? batch_samples / batch_seconds : 0.0, rate64, rate256);
+        if (mismatches != 0) {
+            err("the batch version differs from debounce() on %llu samples", (unsigned long long)mismatches);
+            return 1;
+        }
+    }
+#endif
+
 }
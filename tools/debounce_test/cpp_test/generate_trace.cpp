@@ -0,0 +1,287 @@
+
+#include <random>
+#include <string>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+// Writes a synthetic .data trace of a single key, from a model of a switch:
+//
+// - each press is held for a while, then released for a while (-H and -G),
+//   so -f presses about as fast as the fastest capture we have
+//   (dygma-raise-fast-presses/luis-as-fast-as-possible)
+// - contacts bounce for up to -b ms when they close and when they open: the
+//   read is closed more and more often as the bounce goes on, on a press,
+//   and less and less often on a release
+// - a held key can chatter (-c): open once for up to a given time, somewhere
+//   in the middle of the press
+// - contact resistance noise (-e) flips single reads, pressed or not
+//
+// The trace says it has as many PRESSES as it was asked for: none of the
+// bounce, chatter or noise counts as one. Whether a debouncer sees them that
+// way depends on the model being fair to it, see check_model().
+//
+// Every random number comes from one seeded std::mt19937_64, so a seed
+// gives the same trace anywhere. The trace goes to stdout as it's made, a
+// million presses is a few hundred MB.
+
+#define usage_fmt \
+    "usage: %s [-n presses] [-s seed] [-r rate] [-f] [-H min,max] [-G min,max]\n\
+                 [-b press,release] [-c chance[,max]] [-e chance] [-t title]\n\
+\n\
+    -n presses      : number of presses (10)\n\
+    -s seed         : random seed (1)\n\
+    -r rate         : SAMPLES-PER-SECOND (2000)\n\
+    -H min,max      : how long a key is held, bounces included, in ms (60,150)\n\
+    -G min,max      : how long it's let go between presses, in ms (100,400)\n\
+    -f              : as fast as possible: -H 35,65 -G 20,65\n\
+    -b press,release: longest contact bounce, in ms (2,1)\n\
+    -c chance,max   : chance a press chatters (0), and for how long at most,\n\
+                      in ms (1)\n\
+    -e chance       : chance each read is flipped by contact noise (0)\n\
+    -t title        : TITLE of the trace\n\
+"
+
+struct model_t {
+    int         presses = 10;
+    int         rate = 2000;
+    double      hold_ms[2] = { 60, 150 };
+    double      gap_ms[2] = { 100, 400 };
+    double      press_bounce_ms = 2;
+    double      release_bounce_ms = 1;
+    double      chatter_chance = 0;
+    double      chatter_ms = 1;
+    double      noise_chance = 0;
+};
+
+// Writes samples as the other .data files have them: groups of 5, 8 groups
+// to a line, with comments in between
+class TraceWriter {
+  public:
+    ~TraceWriter() {
+        _flush_line();
+        fwrite(_buf, 1, _len, stdout);
+    }
+
+    void    sample(bool closed) {
+        _reserve(2);
+        _buf[_len++] = closed ? '1' : '0';
+        if (++_samples_on_line % 5 == 0)
+            _buf[_len++] = _samples_on_line == 40 ? '\n' : ' ';
+        if (_samples_on_line == 40)
+            _samples_on_line = 0;
+    }
+
+    void    comment(const char *comment) {
+        _flush_line();
+        _reserve(strlen(comment) + 3);
+        _len += sprintf(_buf + _len, "# %s\n", comment);
+    }
+
+  private:
+    char        _buf[1 << 16];
+    size_t      _len = 0;
+    int         _samples_on_line = 0;
+
+    void    _reserve(size_t len) {
+        if (_len + len > sizeof(_buf)) {
+            fwrite(_buf, 1, _len, stdout);
+            _len = 0;
+        }
+    }
+
+    void    _flush_line() {
+        if (_samples_on_line != 0) {
+            _reserve(1);
+            _buf[_len++] = '\n';
+            _samples_on_line = 0;
+        }
+    }
+};
+
+class Generator {
+  public:
+    Generator(const model_t &model, uint64_t seed) : _model(model), _rng(seed) {
+    }
+
+    void    press(int n) {
+        int     press_bounce = _samples(_uniform(0, _model.press_bounce_ms));
+        int     release_bounce = _samples(_uniform(0, _model.release_bounce_ms));
+        int     hold = _samples(_uniform(_model.hold_ms[0], _model.hold_ms[1]));
+        int     gap = _samples(_uniform(_model.gap_ms[0], _model.gap_ms[1]));
+        int     stable = hold - press_bounce - release_bounce;
+
+        // Chatter: open for up to chatter_ms, with at least a read closed
+        // on each side
+        int     chatter = 0, chatter_at = 0;
+        if (_uniform(0, 1) < _model.chatter_chance) {
+            chatter = 1 + int(_uniform(0, 1) * _samples(_model.chatter_ms));
+            chatter_at = 1 + int(_uniform(0, 1) * (stable - chatter - 1));
+            if (stable < chatter + 2)
+                chatter = 0;
+        }
+
+        char    comment[160];
+        snprintf(comment, sizeof(comment), "Press %d: bounces %.1fms, held %.1fms%s, bounces %.1fms, let go %.1fms",
+                 n, _ms(press_bounce), _ms(hold), chatter ? " with chatter" : "", _ms(release_bounce), _ms(gap));
+        _out.comment(comment);
+
+        _bounce(press_bounce, true);
+        for (int i = 0; i < stable; ++i)
+            _read(i < chatter_at || i >= chatter_at + chatter);
+        _bounce(release_bounce, false);
+        for (int i = 0; i < gap - release_bounce; ++i)
+            _read(false);
+    }
+
+    // Released, before the first press
+    void    lead_in(int ms) {
+        _out.comment("Let go");
+        for (int i = 0; i < _samples(ms); ++i)
+            _read(false);
+    }
+
+  private:
+    const model_t       &_model;
+    std::mt19937_64     _rng;
+    TraceWriter         _out;
+
+    // In [min, max), the same for a seed whatever the standard library
+    double  _uniform(double min, double max) {
+        return min + (max - min) * ((_rng() >> 11) * 0x1.0p-53);
+    }
+
+    int     _samples(double ms) const {
+        return int(ms * _model.rate / 1000 + 0.5);
+    }
+
+    double  _ms(int samples) const {
+        return samples * 1000.0 / _model.rate;
+    }
+
+    void    _read(bool closed) {
+        if (_model.noise_chance > 0 && _uniform(0, 1) < _model.noise_chance)
+            closed = !closed;
+        _out.sample(closed);
+    }
+
+    // Contacts closing (or opening) over `samples` reads
+    void    _bounce(int samples, bool closing) {
+        for (int i = 0; i < samples; ++i) {
+            bool    closed = _uniform(0, 1) < double(i + 1) / (samples + 1);
+            _out.sample(closing ? closed : !closed);
+        }
+    }
+};
+
+// Parses "a,b" (or "a", for "a,a") into `pair`
+static bool parse_pair(const char *arg, double pair[2]) {
+    char    *end;
+    pair[0] = strtod(arg, &end);
+    pair[1] = *end == ',' ? strtod(end + 1, &end) : pair[0];
+    return end != arg && *end == '\0' && pair[0] >= 0 && pair[1] >= 0;
+}
+
+// Bounces, chatter and the gaps around it can't look like presses of their
+// own, as long as the press is longer than the bounces and the chatter
+// together, and the key's let go for longer than its release bounce.
+static bool check_model(const model_t &model) {
+    if (model.presses < 0 || model.rate <= 0)
+        return false;
+    if (model.hold_ms[0] <= model.press_bounce_ms + model.release_bounce_ms + model.chatter_ms + 2000.0 / model.rate) {
+        fprintf(stderr, "presses held for %.1fms can't fit %.1fms and %.1fms bounces and %.1fms of chatter\n",
+                model.hold_ms[0], model.press_bounce_ms, model.release_bounce_ms, model.chatter_ms);
+        return false;
+    }
+    if (model.gap_ms[0] <= model.release_bounce_ms) {
+        fprintf(stderr, "presses let go for %.1fms can't fit a %.1fms release bounce\n",
+                model.gap_ms[0], model.release_bounce_ms);
+        return false;
+    }
+    return model.chatter_chance >= 0 && model.chatter_chance <= 1 && model.noise_chance >= 0 && model.noise_chance < 1;
+}
+
+int main(int argc, char *argv[]) {
+    model_t         model;
+    uint64_t        seed = 1;
+    std::string     title;
+    double          pair[2];
+
+    int         opt;
+    while ((opt = getopt(argc, argv, "n:s:r:fH:G:b:c:e:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            model.presses = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'r':
+            model.rate = atoi(optarg);
+            break;
+        case 'f':
+            model.hold_ms[0] = 35;
+            model.hold_ms[1] = 65;
+            model.gap_ms[0] = 20;
+            model.gap_ms[1] = 65;
+            break;
+        case 'H':
+        case 'G':
+            if (!parse_pair(optarg, pair) || pair[1] < pair[0]) {
+                fprintf(stderr, usage_fmt, argv[0]);
+                exit(1);
+            }
+            memcpy(opt == 'H' ? model.hold_ms : model.gap_ms, pair, sizeof(pair));
+            break;
+        case 'b':
+            if (!parse_pair(optarg, pair)) {
+                fprintf(stderr, usage_fmt, argv[0]);
+                exit(1);
+            }
+            model.press_bounce_ms = pair[0];
+            model.release_bounce_ms = pair[1];
+            break;
+        case 'c':
+            if (!parse_pair(optarg, pair)) {
+                fprintf(stderr, usage_fmt, argv[0]);
+                exit(1);
+            }
+            model.chatter_chance = pair[0];
+            if (strchr(optarg, ','))
+                model.chatter_ms = pair[1];
+            break;
+        case 'e':
+            model.noise_chance = strtod(optarg, nullptr);
+            break;
+        case 't':
+            title = optarg;
+            break;
+        default: /* '?' */
+            fprintf(stderr, usage_fmt, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc || !check_model(model)) {
+        fprintf(stderr, usage_fmt, argv[0]);
+        exit(1);
+    }
+
+    if (title.empty())
+        title = "Synthetic, " + std::to_string(model.presses) + " presses, seed " + std::to_string(seed);
+    printf("#TITLE: %s\n", title.c_str());
+    printf("#PRESSES: %d\n", model.presses);
+    printf("#SAMPLES-PER-SECOND: %d\n", model.rate);
+    printf("# generate_trace -n %d -s %llu -r %d -H %g,%g -G %g,%g -b %g,%g -c %g,%g -e %g\n", model.presses,
+           (unsigned long long)seed, model.rate, model.hold_ms[0], model.hold_ms[1], model.gap_ms[0],
+           model.gap_ms[1], model.press_bounce_ms, model.release_bounce_ms, model.chatter_chance,
+           model.chatter_ms, model.noise_chance);
+
+    Generator   generator(model, seed);
+    generator.lead_in(50);
+    for (int n = 1; n <= model.presses; ++n)
+        generator.press(n);
+
+    return 0;
+}
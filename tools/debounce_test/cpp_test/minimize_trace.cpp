@@ -0,0 +1,375 @@
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+#include "tester.h"
+
+// Shrinks a data file the debouncer fails on to a small one it still fails
+// on the same way, and writes it next to the original.
+//
+// The file is cut into segments of one press each: a run closed for at
+// least -m ms, and whatever is around it half way to the next, with presses
+// less than -q ms apart taken as one press that chatters. Segments put back
+// to back keep their presses apart, so the presses a shorter trace should
+// make are the segments it kept. That needs as many segments as the file
+// says it has PRESSES.
+//
+// Delta debugging (ddmin) then looks for the fewest segments that still
+// fail, and every run of the same sample longer than -k ms is halved for as
+// long as that still fails. Each step tries all its candidates at once, on
+// -j threads, and goes with the first that fails, so the result doesn't
+// depend on the number of threads.
+
+#define usage_fmt \
+    "usage: %s [-f failure] [-q ms] [-m ms] [-k ms] [-j threads] [-i interval] [-o reads]\n\
+                [-w output] [-d] data/file/path\n\
+\n\
+    -f failure      : the failure to keep: count, press_rel_mismatched,\n\
+                      changes_miss or overflow (the first of those the file\n\
+                      fails with, in that order)\n\
+    -q ms           : closed runs less than that apart are one press (10)\n\
+    -m ms           : shortest closed run that's a press (2)\n\
+    -k ms           : shortest runs get when they're halved (20)\n\
+    -j threads      : threads the candidates run on (one per CPU)\n\
+    -i interval     : force a KEYSCAN_INTERVAL\n\
+    -o reads        : model KEYSCANNER_OVERSAMPLE reads (1, 3 or 5) per sample\n\
+    -w output       : where to write the result, - for stdout (next to the\n\
+                      data file, with the debouncer and failure in its name)\n\
+    -d              : enable debug output on stderr\n\
+"
+
+static const char   *s_failures[] = { "count", "press_rel_mismatched", "changes_miss", "overflow" };
+
+// A trace to try, and the presses it should make
+struct candidate_t {
+    std::vector<bool>   samples;
+    int                 presses;
+};
+
+// Part of the data file, and whether it's a press
+struct segment_t {
+    size_t      begin;
+    size_t      end;
+    bool        press;
+};
+
+class Minimizer {
+  public:
+    int             _target_sampling_rate = 625;
+    int             _sampling_rate = 2000;
+    const char      *_failure = nullptr;
+    unsigned        _threads = 1;
+    // Candidates tried so far
+    std::atomic<int>    _tries{0};
+
+    // Whether `candidate` fails with _failure
+    bool    fails(const candidate_t &candidate) {
+        Tester      t;
+        t._target_sampling_rate = _target_sampling_rate;
+        t._log_results = false;
+        ++_tries;
+        return t.run_samples("candidate", candidate.samples, _sampling_rate, candidate.presses) &&
+               t._failures.count(_failure) != 0;
+    }
+
+    // Index of the first of `candidates` that fails, or -1. Tries them all,
+    // _threads at a time.
+    int     first_failing(const std::vector<candidate_t> &candidates) {
+        std::vector<char>           failed(candidates.size(), 0);
+        std::atomic<size_t>         next{0};
+        std::vector<std::thread>    threads;
+
+        for (unsigned i = 0; i < std::min<size_t>(_threads, candidates.size()); ++i) {
+            threads.emplace_back([&] {
+                for (size_t c; (c = next++) < candidates.size();)
+                    failed[c] = fails(candidates[c]);
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+
+        for (size_t c = 0; c < candidates.size(); ++c)
+            if (failed[c])
+                return c;
+        return -1;
+    }
+
+    // The fewest of `segments` of `samples` that still fail (ddmin)
+    std::vector<size_t>     minimize_segments(const std::vector<bool> &samples, const std::vector<segment_t> &segments) {
+        std::vector<size_t>     kept(segments.size());
+        for (size_t i = 0; i < kept.size(); ++i)
+            kept[i] = i;
+
+        size_t      n = 2;
+        while (kept.size() >= 2) {
+            n = std::min(n, kept.size());
+
+            // Each of the n parts on its own, then everything but each
+            std::vector<std::vector<size_t>>    subsets;
+            for (size_t part = 0; part < n; ++part)
+                subsets.emplace_back(kept.begin() + kept.size() * part / n, kept.begin() + kept.size() * (part + 1) / n);
+            for (size_t part = 0; part < n && n > 2; ++part) {
+                std::vector<size_t>     complement(kept.begin(), kept.begin() + kept.size() * part / n);
+                complement.insert(complement.end(), kept.begin() + kept.size() * (part + 1) / n, kept.end());
+                subsets.push_back(complement);
+            }
+
+            std::vector<candidate_t>    candidates;
+            for (const std::vector<size_t> &subset : subsets)
+                candidates.push_back(join(samples, segments, subset));
+
+            int         failing = first_failing(candidates);
+            deb("# %zu segments in %zu parts: %s", kept.size(), n,
+                failing < 0 ? "all pass" : failing < int(n) ? "a part fails" : "a complement fails");
+            if (failing >= 0 && failing < int(n)) {
+                kept = subsets[failing];
+                n = 2;
+            } else if (failing >= 0) {
+                kept = subsets[failing];
+                n = std::max<size_t>(n - 1, 2);
+            } else if (n < kept.size()) {
+                n = std::min(n * 2, kept.size());
+            } else {
+                break;
+            }
+        }
+        return kept;
+    }
+
+    // Halves runs longer than `min_run` samples in `candidate` for as long
+    // as it still fails
+    void    shrink_runs(candidate_t &candidate, size_t min_run) {
+        for (;;) {
+            std::vector<candidate_t>    candidates;
+            size_t      begin = 0;
+            for (size_t i = 1; i <= candidate.samples.size(); ++i) {
+                if (i < candidate.samples.size() && candidate.samples[i] == candidate.samples[begin])
+                    continue;
+                size_t      length = i - begin;
+                if (length > min_run) {
+                    candidate_t     shorter = candidate;
+                    size_t          cut = std::min(length - min_run, length / 2);
+                    shorter.samples.erase(shorter.samples.begin() + begin, shorter.samples.begin() + begin + cut);
+                    candidates.push_back(shorter);
+                }
+                begin = i;
+            }
+
+            int         failing = first_failing(candidates);
+            deb("# %zu runs to halve: %s", candidates.size(), failing < 0 ? "all pass" : "one fails");
+            if (failing < 0)
+                return;
+            candidate = candidates[failing];
+        }
+    }
+
+    // `subset` of `segments` of `samples`, back to back
+    static candidate_t  join(const std::vector<bool> &samples, const std::vector<segment_t> &segments,
+                             const std::vector<size_t> &subset) {
+        candidate_t     candidate = { {}, 0 };
+        for (size_t i : subset) {
+            candidate.samples.insert(candidate.samples.end(), samples.begin() + segments[i].begin,
+                                     samples.begin() + segments[i].end);
+            candidate.presses += segments[i].press;
+        }
+        return candidate;
+    }
+};
+
+// Cuts `samples` into presses: runs of `press` closed samples or more, with
+// whatever is around them up to half way to the next. Presses less than
+// `quiet` samples apart are one press that chatters.
+static std::vector<segment_t>   cut_segments(const std::vector<bool> &samples, size_t quiet, size_t press) {
+    std::vector<segment_t>  segments;
+    segment_t       segment = { 0, 0, false };
+    size_t          pressed_until = 0;
+    size_t          begin = 0;
+
+    for (size_t i = 1; i <= samples.size(); ++i) {
+        if (i < samples.size() && samples[i] == samples[begin])
+            continue;
+        if (samples[begin] && i - begin >= press) {
+            if (segment.press && begin - pressed_until >= quiet) {
+                segment.end = pressed_until + (begin - pressed_until) / 2;
+                segments.push_back(segment);
+                segment = { segment.end, 0, false };
+            }
+            segment.press = true;
+            pressed_until = i;
+        }
+        begin = i;
+    }
+    segment.end = samples.size();
+    segments.push_back(segment);
+    return segments;
+}
+
+// Writes `samples` as reformat_keypress_data does
+static void     write_samples(FILE *f, const std::vector<bool> &samples) {
+    size_t      begin = 0;
+    for (size_t i = 1; i <= samples.size(); ++i) {
+        if (i < samples.size() && samples[i] == samples[begin])
+            continue;
+        fprintf(f, "\n# %s for %zu cycles\n", samples[begin] ? "On" : "Off", i - begin);
+        for (size_t j = begin; j < i; ++j) {
+            fputc(samples[j] ? '1' : '0', f);
+            if ((j - begin) % 5 == 4 || j == i - 1)
+                fputc((j - begin) % 40 == 39 ? '\n' : ' ', f);
+        }
+        begin = i;
+    }
+    fputc('\n', f);
+}
+
+int main(int argc, char *argv[]) {
+
+    g_debouncer_name = argv[0];
+
+    const char  *failure = nullptr;
+    const char  *output = nullptr;
+    double      quiet_ms = 10;
+    double      press_ms = 2;
+    double      min_run_ms = 20;
+    unsigned    threads = std::max(1u, std::thread::hardware_concurrency());
+    int         interval = 14;
+
+    int         opt;
+    while ((opt = getopt(argc, argv, "f:q:m:k:j:i:o:w:d")) != -1) {
+        switch (opt) {
+        case 'f':
+            failure = optarg;
+            break;
+        case 'q':
+            quiet_ms = atof(optarg);
+            break;
+        case 'm':
+            press_ms = atof(optarg);
+            break;
+        case 'k':
+            min_run_ms = atof(optarg);
+            break;
+        case 'j':
+            threads = std::max(1, atoi(optarg));
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'o':
+            g_oversample = atoi(optarg);
+            if (g_oversample != 1 && g_oversample != 3 && g_oversample != 5) {
+                fprintf(stderr, usage_fmt, argv[0]);
+                exit(1);
+            }
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        case 'd':
+            g_debug = true;
+            break;
+        default: /* '?' */
+            fprintf(stderr, usage_fmt, argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, usage_fmt, argv[0]);
+        exit(1);
+    }
+    const char  *filepath = argv[optind];
+
+    uint64_t    target_sampling_rate = 2000;
+    if (interval != 14)
+        target_sampling_rate = uint64_t(F_CPU) / (256 * uint64_t(interval));
+
+    Tester      original;
+    original._target_sampling_rate = target_sampling_rate;
+    original._log_results = false;
+    if (!original.run_file(filepath)) {
+        err("!!! Failed to run the test %s !!!", filepath);
+        exit(1);
+    }
+    if (original.timestamped()) {
+        err("%s: timestamped scans can't be cut up", filepath);
+        exit(1);
+    }
+    if (failure == nullptr) {
+        for (const char *f : s_failures)
+            if (original._failures.count(f) && failure == nullptr)
+                failure = f;
+        if (failure == nullptr) {
+            err("%s doesn't fail", filepath);
+            exit(1);
+        }
+    } else if (original._failures.count(failure) == 0) {
+        err("%s doesn't fail with %s", filepath, failure);
+        exit(1);
+    }
+
+    const std::vector<bool>     &samples = original.samples();
+    const int   rate = original.sampling_rate();
+    auto        ms_samples = [&](double ms) { return std::max<size_t>(1, ms * rate / 1000 + 0.5); };
+
+    std::vector<segment_t>  segments = cut_segments(samples, ms_samples(quiet_ms), ms_samples(press_ms));
+    int         presses = 0;
+    for (const segment_t &segment : segments)
+        presses += segment.press;
+    if (presses != original.presses()) {
+        err("%s has %d PRESSES, but %d segments: try another -q or -m", filepath, original.presses(), presses);
+        exit(1);
+    }
+
+    Minimizer   minimizer;
+    minimizer._target_sampling_rate = target_sampling_rate;
+    minimizer._sampling_rate = rate;
+    minimizer._failure = failure;
+    minimizer._threads = threads;
+
+    std::vector<size_t>     kept = minimizer.minimize_segments(samples, segments);
+    candidate_t     minimal = Minimizer::join(samples, segments, kept);
+    minimizer.shrink_runs(minimal, std::max(ms_samples(min_run_ms), ms_samples(quiet_ms)));
+    if (!minimizer.fails(minimal)) {
+        err("lost the failure on the way");
+        exit(1);
+    }
+
+    // Where it goes: next to the data file, with the debouncer and failure
+    std::string     debouncer = g_debouncer_name;
+    debouncer = debouncer.substr(debouncer.find_last_of('/') + 1);
+    if (debouncer.compare(0, 9, "minimize-") == 0)
+        debouncer = debouncer.substr(9);
+    std::string     path = output ? output : "";
+    if (path.empty()) {
+        path = filepath;
+        if (path.size() > 5 && path.compare(path.size() - 5, 5, ".data") == 0)
+            path.resize(path.size() - 5);
+        path += "--" + debouncer + "-" + failure + ".data";
+    }
+
+    FILE        *f = path == "-" ? stdout : fopen(path.c_str(), "w");
+    if (f == nullptr) {
+        perror(path.c_str());
+        exit(1);
+    }
+    fprintf(f, "#TITLE: %s, shrunk to where %s fails with %s\n", filepath, debouncer.c_str(), failure);
+    fprintf(f, "#PRESSES: %d\n", minimal.presses);
+    fprintf(f, "#SAMPLES-PER-SECOND: %d\n", rate);
+    fprintf(f, "# %zu of %zu samples, %zu of %zu segments\n", minimal.samples.size(), samples.size(),
+            kept.size(), segments.size());
+    write_samples(f, minimal.samples);
+    if (f != stdout)
+        fclose(f);
+
+    fprintf(stderr, "%s: %s with %s, %zu of %zu samples and %zu of %zu segments, %d tries on %u threads\n",
+            path.c_str(), debouncer.c_str(), failure, minimal.samples.size(), samples.size(), kept.size(),
+            segments.size(), minimizer._tries.load(), threads);
+    return 0;
+}
@@ -0,0 +1,502 @@
+#pragma once
+
+// The test harness shared by the cpp_test tools: Tester parses a data file,
+// or takes samples, and runs the debouncer they're built with over them.
+// Each tool is a single translation unit built for one debouncer, see the
+// Makefile.
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctype.h>
+
+// regexp are cool, but takes too much time to compile !
+//#define USE_STD_REGEX
+
+#ifdef USE_STD_REGEX
+#   include <regex>
+#endif
+
+#define SEPARATOR   "########################################"
+
+// stdout goes to run_tests.pl
+#define log(__fmt, ...)     do { printf(__fmt "\n", ##__VA_ARGS__); deb("# LOG: " __fmt, ##__VA_ARGS__); } while (0)
+
+// stderr for error and debugging (not catched by run_tests.pl)
+#define err(__fmt, ...)     do { fprintf(stderr, "ERROR %s: " __fmt "\n", g_debouncer_name, ##__VA_ARGS__); } while (0)
+#define deb(__fmt, ...)     do { if (g_debug) fprintf(stderr, __fmt "\n", ##__VA_ARGS__); } while (0)
+
+const char      *g_debouncer_name = nullptr;
+bool            g_debug = false;
+int             g_oversample = 1;
+bool            g_latency = false;
+
+// Keeps the benchmark replay from being optimized away
+volatile uint8_t    g_bench_sink;
+
+// Bitwise majority of `count` reads, as the firmware's oversample.h does it
+static uint8_t  majority(const uint8_t *reads, int count) {
+    int     ones = 0;
+    for (int i = 0; i < count; ++i)
+        ones += reads[i];
+    return ones * 2 > count;
+}
+
+// Parses and test one input test data file
+class Tester {
+  public:
+    int         _target_sampling_rate = 625;
+    bool        _success = false;
+    // Log the test result, and each failure, on stdout
+    bool        _log_results = true;
+    // How the test failed: "overflow", "changes_miss",
+    // "press_rel_mismatched" and/or "count", for the number of presses
+    std::set<std::string>   _failures;
+
+    // Parses filepath data file, then runs the debouncer test
+    // Test result in `_success`.
+    // Returns false only if test could not be run.
+    bool        run_file(const char *filepath) {
+        deb("# Running %s %s", g_debouncer_name, filepath);
+
+        _test_name = filepath;
+
+        if (!_parse_file(filepath))
+            return false;
+
+        return _run();
+    }
+
+    // Same as run_file(), with samples at `sampling_rate` that make
+    // `presses` presses
+    bool        run_samples(const char *name, const std::vector<bool> &samples, int sampling_rate, int presses) {
+        deb("# Running %s %s", g_debouncer_name, name);
+
+        _test_name = name;
+        _raw_data = samples;
+        _data_sampling_rate = sampling_rate;
+        _data_presses = presses;
+
+        return _run();
+    }
+
+    // Every press latency seen, in us
+    std::vector<double>     _latencies_us;
+
+    // The parsed samples, at their own rate
+    const std::vector<bool>     &samples() const {
+        return _raw_data;
+    }
+
+    int         sampling_rate() const {
+        return _data_sampling_rate;
+    }
+
+    int         presses() const {
+        return _data_presses;
+    }
+
+    bool        timestamped() const {
+        return _timestamps_us.size() != 0;
+    }
+
+    // Replays the parsed samples through a fresh debouncer `repeats` times,
+    // at their own rate and with nothing else in the loop, for -b to time.
+    // Returns the number of debounce() calls.
+    uint64_t    replay(int repeats) {
+        debounce_t  db;
+        uint8_t     changes = 0;
+#if defined(DEBOUNCE_TIMED)
+        const uint16_t  elapsed_ticks = uint16_t(1000000.0 / _data_sampling_rate * (F_CPU / 1000000) / KEYSCAN_TIMER_PRESCALER);
+#endif
+        for (int r = 0; r < repeats; ++r) {
+            bzero(&db, sizeof(db));
+            for (size_t i = 0; i < _raw_data.size(); ++i) {
+#if defined(DEBOUNCE_TIMED)
+                changes ^= debounce(_raw_data[i], &db, elapsed_ticks);
+#else
+                changes ^= debounce(_raw_data[i], &db);
+#endif
+            }
+        }
+        g_bench_sink = g_bench_sink ^ changes;
+        return uint64_t(repeats) * _raw_data.size();
+    }
+
+  private:
+    // Checks the data, then runs the debouncer test
+    bool        _run() {
+        if (_raw_data.size() == 0) {
+            err("no data");
+            return false;
+        }
+        if (_timestamps_us.size() != 0 && _timestamps_us.size() != _raw_data.size()) {
+            err("%zu timestamps for %zu samples", _timestamps_us.size(), _raw_data.size());
+            return false;
+        }
+        if (_data_presses < 0) {
+            err("could not find presses number");
+            return false;
+        }
+        if (_data_sampling_rate <= 0) {
+            err("invalid sampling rate");
+            return false;
+        }
+
+        deb(SEPARATOR SEPARATOR);
+        deb("# test file sampling rate: %d, simulating sampling rate: %d", _data_sampling_rate, _target_sampling_rate);
+        deb("# here, 10 sample = %.2f ms, 10ms = %.2f samples", 1000.0 / double(_target_sampling_rate), double(_target_sampling_rate) / 100.0);
+
+        _success = _run_test();
+
+        deb(SEPARATOR);
+        deb("# Final test result: %s", _success ? "SUCCESS" : "FAILURE");
+
+        return true;
+    }
+
+    //
+    // Parsing
+    //
+
+    const char              *_test_name = nullptr;
+    int                     _data_sampling_rate = 625;
+    int                     _data_presses = -1;
+    std::vector<bool>       _raw_data;
+    // Scan times in us, for timestamped data files ("@<us> <sample>" lines)
+    std::vector<uint32_t>   _timestamps_us;
+
+    // Parses filepath input data file
+    bool        _parse_file(const char *filepath) {
+        FILE    *f = fopen(filepath, "r");
+        if (f == nullptr) {
+            perror("open data file");
+            return false;
+        }
+        char    *line = nullptr;
+        size_t  alloclen = 0;
+        ssize_t nread = 0;
+        int     linenum = 1;
+        for (; (nread = getline(&line, &alloclen, f)) > 0; ++linenum) {
+            _parse_line(line, nread, linenum);
+        }
+        free(line);
+        fclose(f);
+        return true;
+    }
+
+    // Parses a single line of input data file
+    void    _parse_line(const char *line, size_t len, int linenum) {
+        for (size_t i = 0; i < len; ++i) {
+            switch (line[i]) {
+            case '0':
+                _raw_data.push_back(0);
+                break;
+            case '1':
+                _raw_data.push_back(1);
+                break;
+            case '\r': // fallthrough
+            case '\n':
+            case '\t':
+            case ' ':
+                // ignore
+                break;
+            case '#':
+                _parse_comment(line, i, len, linenum);
+                return;
+            case '@': {
+                // A timestamped scan: "@<us> <sample>"
+                char    *end;
+                _timestamps_us.push_back(strtoul(line + i + 1, &end, 10));
+                i = end - line - 1;
+                break;
+            }
+            default:
+                deb("# Unkown char %c at line %d", line[i], linenum);
+                break;
+            }
+        }
+    }
+
+#if !defined(USE_STD_REGEX)
+    // Parses a comment starting at `line + start`
+    void    _parse_comment(const char *line, size_t start, size_t end [[maybe_unused]], int linenum [[maybe_unused]]) {
+        //deb("# Comment at line %d: %s", linenum, line + start);
+
+        // skip '#'
+        while (line[start] == '#')
+            ++start;
+        // skip spaces
+        while (isspace(line[start]))
+            ++start;
+
+        static const char   s_sampling_rate[] = "SAMPLES-PER-SECOND:";
+        static const char   s_presses[] = "PRESSES:";
+        if (strncmp(line + start, s_sampling_rate, sizeof(s_sampling_rate) - 1) == 0) {
+            // atoi ignores leading spaces and trailing non-numerical
+            _data_sampling_rate = atoi(line + start + sizeof(s_sampling_rate) - 1);
+            deb("# found sampling rate %d (target=%d)", _data_sampling_rate, _target_sampling_rate);
+        } else if (strncmp(line + start, s_presses, sizeof(s_presses) - 1) == 0) {
+            // atoi ignores leading spaces and trailing non-numerical
+            _data_presses = atoi(line + start + sizeof(s_presses) - 1);
+            deb("# found presses %d", _data_presses);
+        }
+    }
+#else
+    // Parses a comment starting at `line + start`
+    std::match_results<const char*>     _match; // cache
+    void    _parse_comment(const char *line, size_t start, size_t end, int linenum [[maybe_unused]]) {
+        //deb("comment at line %d: %s", linenum, line + start);
+        static std::regex   s_reg_sampling_rate{"#\\s*SAMPLES-PER-SECOND:\\s*(\\d*)"};
+        static std::regex   s_reg_presses{"#\\s*PRESSES:\\s*(\\d*)"};
+        if (std::regex_search(line + start, line + end, _match, s_reg_sampling_rate)) {
+            _data_sampling_rate = atoi(_match[1].first()); // atoi ignores leading spaces and trailing non-numerical
+            deb("# found sampling rate %d (target=%d)", _data_sampling_rate, _target_sampling_rate);
+        } else if (std::regex_search(line + start, line + end, _match, s_reg_presses)) {
+            _data_presses = atoi(_match[1].first()); // atoi ignores leading spaces and trailing non-numerical
+            deb("# found presses %d", _data_presses);
+        }
+    }
+#endif
+
+  private:
+    //
+    // Testing
+    //
+
+    debounce_t  _db;
+    int         _presses = 0;
+    int         _releases = 0;
+    bool        _test_failed = false;
+
+    // Tests the debouncer with parsed data
+    bool        _run_test() {
+        bzero(&_db, sizeof(_db));
+
+        const int   target_count = _target_sampling_rate * _raw_data.size() / _data_sampling_rate;
+
+        int         total_run_count = 0;
+
+        // Timestamped scans run as they are, each after however long it was
+        // since the last one
+        if (_timestamps_us.size() != 0) {
+            deb(SEPARATOR);
+            deb("# Running timestamped scans");
+
+            _run_debounce_sample_times(0, 100);
+            for (size_t i = 0; i < _raw_data.size(); ++i) {
+                uint32_t    elapsed_us = i ? _timestamps_us[i] - _timestamps_us[i - 1] : _sample_us();
+                _run_debouce(_read(i), _raw_data[i], elapsed_us);
+            }
+            _run_debounce_sample_times(0, 200);
+
+            ++total_run_count;
+            if (!_test_failed && _presses != _releases) {
+                _fail("press_rel_mismatched");
+            }
+            deb("# End test: %d presss, %d releases, (%d target)", _presses, _releases, _data_presses * total_run_count);
+        }
+
+        // Run 'nearest' sample test with 'jitter': give to the debouncer the
+        // nearest test sample. re-run with a sampling offset for all possible sampling offsets (jitter).
+        else {
+            int     jitter = 0;
+            if (_data_sampling_rate > _target_sampling_rate)
+                jitter = 1 + (_data_sampling_rate - 1) / _target_sampling_rate;
+
+            for (int offset = 0; offset <= jitter; ++offset) {
+                deb(SEPARATOR);
+                deb("# Running test jitter, offset = %d", offset);
+
+                _run_debounce_sample_times(0, 100);
+                for (int i = 0; i < target_count - 1; ++i) {
+                    int         di = int64_t(i) * _data_sampling_rate / _target_sampling_rate;
+                    di += offset;
+                    assert(di < int(_raw_data.size()));
+                    uint8_t     sample = _read(di);
+                    _run_debouce(sample, _raw_data[di], _sample_us());
+                }
+                _run_debounce_sample_times(0, 200);
+
+                ++total_run_count;
+                if (!_test_failed && _presses != _releases) {
+                    _fail("press_rel_mismatched");
+                }
+
+                deb("# End test: %d presss, %d releases, (%d target)", _presses, _releases, _data_presses * total_run_count);
+            }
+        }
+
+        // Run test averaging test's samples (if worth at least 2 times more data)
+        if (_timestamps_us.size() == 0 && _data_sampling_rate / _target_sampling_rate > 1) {
+            // percent
+            const int   sample_avg_thresholds[] = { 33, 50, 66 };
+
+            for (int thi = 0; thi < int(sizeof(sample_avg_thresholds) / sizeof(*sample_avg_thresholds)); ++thi) {
+                const int   sample_avg_threshold = sample_avg_thresholds[thi];
+
+                deb(SEPARATOR);
+                deb("# Running test average > %d%%", sample_avg_threshold);
+
+                int         last_di = 0;
+                _run_debounce_sample_times(0, 100);
+                for (int i = 0; i < target_count; ++i) {
+                    int         di = int64_t(i) * _data_sampling_rate / _target_sampling_rate;
+                    assert(di < int(_raw_data.size()));
+                    int         samples_sum = _raw_data[di];
+                    int         samples_count = 1;
+                    for (int j = last_di + 1; j < di; ++j) {
+                        samples_sum += _raw_data[j];
+                        ++samples_count;
+                    }
+                    last_di = di;
+                    bool        sample_past_threshold = samples_sum * 100 >= sample_avg_threshold * samples_count;
+
+                    uint8_t     sample = sample_past_threshold ? 1 : 0;
+                    _run_debouce(sample, sample, _sample_us());
+                }
+                _run_debounce_sample_times(0, 200);
+
+                ++total_run_count;
+                if (!_test_failed && _presses != _releases) {
+                    _fail("press_rel_mismatched");
+                }
+
+                deb("# End test: %d presss, %d releases, (%d target)", _presses, _releases, _data_presses * total_run_count);
+            }
+        }
+
+        int target_presses = _data_presses * total_run_count;
+
+        if (g_latency && _latency_count > 0 && _log_results)
+            log("%s;%s;latency;%.3f;%.3f", g_debouncer_name, _test_name,
+                double(_latency_total) / _latency_count / 1000.0, _latency_max / 1000.0);
+
+        if (_presses != target_presses) {
+            char    presses_off[32];
+            snprintf(presses_off, sizeof(presses_off), "%+.2f", double(_presses - target_presses) / double(total_run_count));
+            _fail("count", presses_off);
+        } else if (_log_results)
+            log("%s;%s;0", g_debouncer_name, _test_name);
+
+        return !_test_failed;
+    }
+
+    // Fails the test with `failure` (see _failures), logging `result`, or
+    // the failure itself
+    void        _fail(const char *failure, const char *result = nullptr) {
+        if (_log_results)
+            log("%s;%s;%s", g_debouncer_name, _test_name, result ? result : failure);
+        _failures.insert(failure);
+        _test_failed = true;
+    }
+
+    int         _last_state = 0;
+    int         _out_sample_i = 0;
+
+    // Simulated time, and the timer1 ticks given to timed debouncers so far
+    double      _now_us = 0;
+    uint64_t    _ticks = 0;
+
+    // Press latency, in us: from the first contact to the debounced press
+    double      _first_contact_us = -1;
+    double      _released_since_us = -1;
+    double      _latency_total = 0;
+    int         _latency_count = 0;
+    double      _latency_max = 0;
+
+    double      _sample_us() const {
+        return 1000000.0 / _target_sampling_rate;
+    }
+
+    // Reads the input at raw index `di`, `g_oversample` times.
+    //
+    // The firmware's reads are a few cycles apart, far finer than any of our
+    // captures, so the extra reads are the preceding raw samples (never the
+    // following ones, that would see presses early). With captures at the
+    // scan rate that spans several scans: treat the result as the most an
+    // oversampled read could filter, and the latency as the most it could add.
+    uint8_t     _read(int di) const {
+        uint8_t     reads[5];
+        for (int r = 0; r < g_oversample; ++r)
+            reads[r] = _raw_data[di >= r ? di - r : 0];
+        return majority(reads, g_oversample);
+    }
+
+    // Keeps track of when the contact was first made, from the raw
+    // (not oversampled) read, so latencies compare across -o settings
+    void        _track_contact(uint8_t contact) {
+        if (_db.state) {
+            _first_contact_us = -1;
+            return;
+        }
+        if (contact) {
+            _released_since_us = -1;
+            if (_first_contact_us < 0)
+                _first_contact_us = _now_us;
+        } else if (_released_since_us < 0) {
+            _released_since_us = _now_us;
+        } else if (_now_us - _released_since_us >= 5000) {
+            // Released for 5ms: whatever we saw was a glitch, not a press
+            _first_contact_us = -1;
+        }
+    }
+
+    // Runs a single call to debounce(), `elapsed_us` after the last one
+    void        _run_debouce(uint8_t sample, uint8_t contact, double elapsed_us) {
+        _now_us += elapsed_us;
+        _track_contact(contact);
+
+        uint8_t     debounced_changes;
+#if defined(DEBOUNCE_TIMED)
+        uint64_t    ticks = uint64_t(_now_us * (F_CPU / 1000000) / KEYSCAN_TIMER_PRESCALER);
+        uint16_t    elapsed_ticks = ticks - _ticks > 0xffff ? 0xffff : ticks - _ticks;
+        _ticks = ticks;
+        debounced_changes = debounce(sample, &_db, elapsed_ticks);
+#else
+        debounced_changes = debounce(sample, &_db);
+#endif
+        bool        overlflow = ((debounced_changes | _db.state) & ~1) != 0;
+        if (overlflow) {
+            _fail("overflow");
+        }
+        bool        said_changed = debounced_changes != 0;
+        bool        state_changed = _db.state != _last_state;
+        _last_state = _db.state;
+        if (said_changed != state_changed) {
+            _fail("changes_miss");
+        }
+        if (said_changed) {
+            if (_db.state) {
+                ++_presses;
+                if (_first_contact_us >= 0) {
+                    double  latency = _now_us - _first_contact_us;
+                    _latencies_us.push_back(latency);
+                    _latency_total += latency;
+                    ++_latency_count;
+                    if (latency > _latency_max)
+                        _latency_max = latency;
+                }
+            } else
+                ++_releases;
+        }
+
+        deb("%d %d", sample, _db.state);
+        ++_out_sample_i;
+        if (_out_sample_i % 10 == 0)
+            deb("");
+    }
+
+    // Runs `sample` sample `count` times
+    void    _run_debounce_sample_times(uint8_t sample, int count) {
+        deb("# begin '%d' x %d", sample, count);
+        for (int i = 0; i < count; ++i)
+            _run_debouce(sample, sample, _sample_us());
+        deb("# end '%d' x %d", sample, count);
+    };
+};
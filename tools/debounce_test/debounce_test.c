@@ -20,6 +20,10 @@ uint8_t extra_verbose = 0;
 uint8_t print_input = 0;
 uint16_t scan_counter =0;
 uint8_t pin_data[40960] = { };
+// When each sample was taken, in us. Samples come every 500us (2000 per
+// second, what run_tests.pl feeds us) unless the data is timestamped scans:
+// "@<us> <sample>" lines.
+uint32_t sample_us[40960] = { };
 uint8_t debounced_data[40960] = {};
 char comments[40960][80] = {};
 
@@ -45,6 +49,18 @@ void get_input () {
             comments[scan_counter+1][79]= '\0';
             continue;
         }
+        if (buffer[0] == '@') {
+            unsigned long us;
+            char sample;
+            if (sscanf(buffer, "@%lu %c", &us, &sample) == 2 && (sample == '0' || sample == '1')) {
+                sample_us[scan_counter] = us;
+                pin_data[scan_counter++] = sample - '0';
+            } else if (verbose) {
+                printf("Bad timestamped scan ignored: %s", buffer);
+            }
+            continue;
+        }
+        uint16_t first_sample = scan_counter;
         for(int i = 0; (i < (int)sizeof(buffer) && buffer[i+1] != 0)  ; i++) {
             if(buffer[i] == '#') {
                 break;
@@ -59,6 +75,9 @@ void get_input () {
                 }
             }
         }
+        for (uint16_t i = first_sample; i < scan_counter; i++) {
+            sample_us[i] = i ? sample_us[i - 1] + 500 : 0;
+        }
     }
 
 }
@@ -99,7 +118,15 @@ int main(int argc,char *argv[]) {
     for (uint16_t sample = 0; sample < scan_counter; sample++) {
 
         uint8_t data_printed = 0;
+#if defined(DEBOUNCE_TIMED)
+        // Timer1 ticks (F_CPU / 256) since the last sample
+        uint16_t elapsed_ticks = sample ?
+                                 sample_us[sample] * (F_CPU / 1000000) / 256 - sample_us[sample - 1] * (F_CPU / 1000000) / 256 :
+                                 0;
+        debounced_changes= debounce(pin_data[sample], db, elapsed_ticks);
+#else
         debounced_changes= debounce(pin_data[sample], db);
+#endif
 
         if (verbose) {
             if (comments[sample][0] != 0) {
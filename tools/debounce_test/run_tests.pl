@@ -47,6 +47,9 @@ for my $test (@testcases) {
         if ( $sample_rate =~ /SAMPLES-PER-SECOND:\s*(\d*)/ ) {
             $sample_rate = $1;
         }
+        elsif (`grep -c '^\@' $test` > 0) {
+            $sample_rate = 2000;    # timestamped scans, the debouncer reads them as they are
+        }
         else {
             $sample_rate = 625;    # 1.6ms per sample
         }
@@ -0,0 +1,69 @@
+/* Cycle cost model for the parts of the firmware that the host can't time
+ *
+ * The host runs the firmware code for its behaviour only. Where a tool needs
+ * to reason about AVR time, it uses these estimates instead. They are hand
+ * counted from the instruction sequences avr-gcc emits at -O3, including the
+ * 4 cycle interrupt response, the vector jump, prologue, epilogue and reti.
+ * Re-check them against `make disasm` in firmware/ when the code changes.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "wire-protocol-constants.h"
+
+/* One SPI_STC_vect with the packed RGB buffer: switch on led_phase, the
+ * subpixel counter and the brightness byte insertion */
+#define CYCLES_LED_ISR_RGB 85
+
+/* One SPI_STC_vect with LED_BUFFER_WIRE_FORMAT: load, store, increment and
+ * a single bounds check */
+#define CYCLES_LED_ISR_WIRE 60
+
+/* One pass through led_pump()'s loop with LED_TRANSPORT_POLLED: the same
+ * work as the interrupt minus its entry and exit, plus the SPIF poll and the
+ * ATOMIC_BLOCK around it */
+#define CYCLES_LED_PUMP_BYTE_RGB 50
+#define CYCLES_LED_PUMP_BYTE_WIRE 25
+
+#if defined(LED_BUFFER_WIRE_FORMAT)
+#define CYCLES_LED_ISR CYCLES_LED_ISR_WIRE
+#define CYCLES_LED_PUMP_BYTE CYCLES_LED_PUMP_BYTE_WIRE
+#else
+#define CYCLES_LED_ISR CYCLES_LED_ISR_RGB
+#define CYCLES_LED_PUMP_BYTE CYCLES_LED_PUMP_BYTE_RGB
+#endif
+
+/* One color byte through scale8() in led-spiout.c, when led_scan_slot()
+ * transforms it with brightness scaling on: eight rounds of shift, test and
+ * 16 bit add */
+#define CYCLES_SCALE8 60
+
+/* TIMER1_COMPA_vect, which only sets do_scan */
+#define CYCLES_TIMER_ISR 30
+
+/* One keyscanner_main() pass over all rows with the default debouncer */
+#define CYCLES_KEYSCAN 350
+
+/* One trip around main()'s loop when there's nothing to scan */
+#define CYCLES_MAIN_LOOP 15
+
+/* Timer1 runs with a prescaler of 256 */
+#define CYCLES_PER_TIMER_TICK 256
+
+/* Cycles to shift one byte out at each LED_SPI_FREQUENCY_* setting:
+ * 8 bits at F_CPU / divisor */
+static const struct {
+    uint8_t setting;
+    const char *name;
+    uint16_t byte_cycles;
+} spi_frequencies[] = {
+    { LED_SPI_FREQUENCY_4MHZ, "4MHz", 8 * 2 },
+    { LED_SPI_FREQUENCY_2MHZ, "2MHz", 8 * 4 },
+    { LED_SPI_FREQUENCY_1MHZ, "1MHz", 8 * 8 },
+    { LED_SPI_FREQUENCY_512KHZ, "512KHz", 8 * 16 },
+    { LED_SPI_FREQUENCY_256KHZ, "256KHz", 8 * 32 },
+    { LED_SPI_FREQUENCY_128KHZ, "128KHz", 8 * 64 },
+    { LED_SPI_FREQUENCY_64KHZ, "64KHz", 8 * 128 },
+};
+
+#define NUM_SPI_FREQUENCIES (sizeof(spi_frequencies) / sizeof(*spi_frequencies))
@@ -0,0 +1,240 @@
+/* Checks KEY_REPORT_COALESCE against the debounce test corpus
+ *
+ * Each data file plays on one key, while the next file plays on another, and
+ * the keyscanner scans them at the default interval. The master reads a
+ * report every POLL_EVERY_SCANS scans (~2ms), like the TWI_CMD_NONE read does.
+ * A master that reads less often than keys can really go up and down loses
+ * presses to coalescing, not just chatter.
+ *
+ * Every report the keyscanner queues gets seen on its way in (the test wraps
+ * ringbuf_append_report()), so each key gets two press counts: what the
+ * master would have seen without coalescing, and what it saw. Checks that:
+ * - the reports the master read are in the same order as they were queued,
+ *   with some left out: no report was made up or moved
+ * - the master ends up with the same state
+ * - coalescing only ever takes a press count closer to the file's PRESSES
+ *
+ * Files with timestamped scans are left out: they're other corpus files
+ * scanned at other intervals.
+ *
+ * The -chatter build uses debounce-none.h, so that the chatter in the corpus
+ * gets to the ring, and has KEY_REPORT_TIMESTAMPS: coalescing only compares
+ * key states, and a merged report has the newer timestamp.
+ *
+ * Usage: key-report-coalesce-test <data file>...
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+
+#define POLL_EVERY_SCANS 4
+
+/* Scans to keep going once both files are over, so the last release makes it */
+#define TAIL_SCANS 200
+
+#define MAX_QUEUED 100000
+
+typedef struct {
+    const char *path;
+    uint8_t *samples;
+    uint32_t count;
+    uint32_t rate;
+    int presses;
+} corpus_file_t;
+
+typedef struct {
+    uint8_t row, col;
+    const corpus_file_t *file;
+    uint32_t queued_presses;
+    uint32_t read_presses;
+} key_t;
+
+static uint8_t queued[MAX_QUEUED][KEY_REPORT_BYTES];
+static uint32_t queued_count;
+
+void __real_ringbuf_append_report(const uint8_t *report);
+
+void __wrap_ringbuf_append_report(const uint8_t *report) {
+    SIM_CHECK(queued_count < MAX_QUEUED, "too many reports");
+    memcpy(queued[queued_count++], report, KEY_REPORT_BYTES);
+    __real_ringbuf_append_report(report);
+}
+
+/* Reads a data file the way the debounce test harness does. Returns 0 for
+ * files to leave out. */
+static int load(const char *path, corpus_file_t *f) {
+    FILE *in = fopen(path, "r");
+    char line[1024];
+
+    SIM_CHECK(in, "can't open %s", path);
+    f->path = path;
+    f->samples = NULL;
+    f->count = 0;
+    f->rate = 625;  // 1.6ms per sample, as in run_tests.pl
+    f->presses = -1;
+    while (fgets(line, sizeof(line), in)) {
+        char *presses = strstr(line, "PRESSES:");
+        char *rate = strstr(line, "SAMPLES-PER-SECOND:");
+        if (line[0] == '@') {
+            fclose(in);
+            return 0;
+        }
+        if (line[0] == '#') {
+            if (presses) {
+                f->presses = atoi(presses + strlen("PRESSES:"));
+            }
+            if (rate) {
+                f->rate = atoi(rate + strlen("SAMPLES-PER-SECOND:"));
+            }
+            continue;
+        }
+        for (char *c = line; *c; c++) {
+            if (*c == '0' || *c == '1') {
+                if (f->count % 4096 == 0) {
+                    f->samples = realloc(f->samples, f->count + 4096);
+                }
+                f->samples[f->count++] = *c == '1';
+            }
+        }
+    }
+    fclose(in);
+    return f->presses >= 0 && f->count > 0;
+}
+
+static uint8_t sample_at(const corpus_file_t *f, uint64_t us) {
+    uint64_t i = us * f->rate / 1000000;
+    return i < f->count ? f->samples[i] : 0;
+}
+
+static uint64_t duration_us(const corpus_file_t *f) {
+    return (uint64_t)f->count * 1000000 / f->rate;
+}
+
+static uint8_t key_down(const uint8_t *report, const key_t *key) {
+    // Reports are one byte per row, one bit per col
+    return !!(report[key->row] & _BV(key->col));
+}
+
+static void count_presses(const uint8_t *from, const uint8_t *to, key_t *keys, uint32_t *counts[2]) {
+    for (uint8_t k = 0; k < 2; k++) {
+        if (!key_down(from, &keys[k]) && key_down(to, &keys[k])) {
+            (*counts[k])++;
+        }
+    }
+}
+
+static uint32_t distance(uint32_t presses, int spec) {
+    return presses > (uint32_t)spec ? presses - spec : spec - presses;
+}
+
+/* Plays two files at once and checks what the master read. Returns the
+ * number of reports it read, and how the first key went. */
+static uint32_t run(const corpus_file_t *a, const corpus_file_t *b, key_t *first_key, uint32_t *queued_reports) {
+    key_t keys[2] = { { 2, 5, a, 0, 0 }, { 3, 1, b, 0, 0 } };
+    uint64_t end_us = duration_us(a) > duration_us(b) ? duration_us(a) : duration_us(b);
+    uint8_t released[KEY_REPORT_BYTES];
+    uint8_t last_read[KEY_REPORT_BYTES];
+    uint32_t next_queued = 0, reads = 0, scans = 0, tail = 0;
+    uint64_t now_us = 0;
+
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    memset(sim_matrix, 0, sizeof(sim_matrix));
+    keyscanner_init();
+    keyscanner_main();
+    while (!ringbuf_empty()) {
+        ringbuf_pop();
+    }
+    queued_count = 0;
+    memset(released, 0, sizeof(released));
+    memcpy(last_read, released, sizeof(last_read));
+
+    while (tail < TAIL_SCANS) {
+        for (uint8_t k = 0; k < 2; k++) {
+            if (sample_at(keys[k].file, now_us)) {
+                sim_matrix[keys[k].row] |= _BV(keys[k].col);
+            } else {
+                sim_matrix[keys[k].row] &= ~_BV(keys[k].col);
+            }
+        }
+        TIMER1_COMPA_vect();
+        keyscanner_main();
+        now_us += (OCR1A + 1) * 32;
+        if (now_us > end_us) {
+            tail++;
+        }
+
+        if (++scans % POLL_EVERY_SCANS == 0 && !ringbuf_empty()) {
+            uint8_t report[KEY_REPORT_BYTES];
+            for (uint8_t i = 0; i < KEY_REPORT_BYTES; i++) {
+                ringbuf_pop_to(report + i);
+            }
+            reads++;
+
+            // It has to be a report that got queued, after the last one read
+            while (next_queued < queued_count &&
+                    memcmp(queued[next_queued], report, KEY_REPORT_BYTES) != 0) {
+                next_queued++;
+            }
+            SIM_CHECK(next_queued < queued_count,
+                      "%s, %s: report %u isn't one that was queued, or is out of order",
+                      a->path, b->path, reads);
+            next_queued++;
+            count_presses(last_read, report, keys,
+                          (uint32_t *[]) { &keys[0].read_presses, &keys[1].read_presses });
+            memcpy(last_read, report, sizeof(last_read));
+        }
+    }
+    SIM_CHECK(ringbuf_empty(), "%s, %s: reports left over", a->path, b->path);
+
+    for (uint32_t i = 0; i < queued_count; i++) {
+        count_presses(i ? queued[i - 1] : released, queued[i], keys,
+                      (uint32_t *[]) { &keys[0].queued_presses, &keys[1].queued_presses });
+    }
+    SIM_CHECK(queued_count == 0 || memcmp(queued[queued_count - 1], last_read, KEY_REPORT_SIZE_BYTES) == 0,
+              "%s, %s: the master ended up with another state", a->path, b->path);
+
+    for (uint8_t k = 0; k < 2; k++) {
+        const corpus_file_t *f = keys[k].file;
+        SIM_CHECK(distance(keys[k].read_presses, f->presses) <= distance(keys[k].queued_presses, f->presses),
+                  "%s: %u presses queued, %u read, for %d", f->path,
+                  keys[k].queued_presses, keys[k].read_presses, f->presses);
+    }
+    *first_key = keys[0];
+    *queued_reports = queued_count;
+    return reads;
+}
+
+int main(int argc, char **argv) {
+    corpus_file_t *files = calloc(argc, sizeof(corpus_file_t));
+    uint32_t count = 0, queued_reports = 0, reads = 0;
+    uint32_t queued_right = 0, read_right = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (load(argv[i], &files[count])) {
+            count++;
+        }
+    }
+    SIM_CHECK(count > 1, "no data files");
+
+    // Each file plays with the one after it, and the last one with the first
+    for (uint32_t i = 0; i < count; i++) {
+        key_t key;
+        uint32_t queued_now;
+
+        reads += run(&files[i], &files[(i + 1) % count], &key, &queued_now);
+        queued_reports += queued_now;
+        queued_right += key.queued_presses == (uint32_t)files[i].presses;
+        read_right += key.read_presses == (uint32_t)files[i].presses;
+    }
+
+    printf("ok - %u data files, every report read in order\n", count);
+    printf("ok - the master read %u reports, for %u queued (%.1f%%)\n",
+           reads, queued_reports, 100.0 * reads / queued_reports);
+    printf("ok - presses right in %u files, %u without coalescing\n", read_right, queued_right);
+    return 0;
+}
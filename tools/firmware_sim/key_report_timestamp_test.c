@@ -0,0 +1,186 @@
+/* Checks the queueing latency a master gets from KEY_REPORT_TIMESTAMPS
+ *
+ * Keys go down and up at random, and the master polls at a fixed rate the way
+ * it would over TWI: it reads a report (TWI_CMD_NONE), then the current tick
+ * (TWI_CMD_KEYSCAN_TICKS), and takes the difference as the time the report
+ * sat in the ring. Time runs in timer1 ticks, and the test knows when each
+ * report was made, so that difference has to be exact. Sometimes a poll
+ * comes in right after a compare match, before its interrupt has run, like
+ * when the TWI interrupt was already running.
+ *
+ * Reports the latency for a few poll rates, to pick one from. Then runs
+ * once more with the master changing the keyscan interval as it polls,
+ * sometimes with a compare match still waiting, which mustn't throw the
+ * ticks off either.
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+
+#define RUN_TICKS 200000u
+
+/* A key changes every this many ticks, on average (~6ms) */
+#define CHANGE_EVERY_TICKS 200
+
+#define MAX_QUEUED 64
+
+/* wire-protocol.c wants a TWI driver */
+void (*TWI_Tx_Data_Callback)(unsigned char *, unsigned char *);
+void (*TWI_Rx_Data_Callback)(unsigned char *, unsigned char);
+unsigned char (*TWI_Rx_Command_Callback)(unsigned char);
+void TWI_Slave_Initialise(unsigned char address) {
+    (void)address;
+}
+void TWI_Slave_Watchdog(uint16_t now, uint16_t timeout) {
+    (void)now;
+    (void)timeout;
+}
+uint8_t TWI_Slave_Bus_Errors(void) {
+    return 0;
+}
+uint8_t TWI_Slave_Watchdog_Resets(void) {
+    return 0;
+}
+
+typedef struct {
+    uint32_t reports;
+    uint32_t total_ticks;
+    uint32_t max_ticks;
+} latency_t;
+
+static void twi_command(uint8_t command) {
+    twi_data_received(&command, 1);
+}
+
+static uint8_t twi_read(uint8_t *buf) {
+    uint8_t bufsiz = 32;
+    twi_data_requested(buf, &bufsiz);
+    return bufsiz;
+}
+
+// When each report still in the ring was made
+static uint32_t made_at[MAX_QUEUED];
+static uint8_t queued;
+
+/* The compare match interrupt, and the scan right after it */
+static void scan(uint32_t now) {
+    uint8_t before = ringbuf_size();
+
+    if (sim_rand() % CHANGE_EVERY_TICKS < OCR1A + 1u) {
+        uint8_t row = sim_rand() % COUNT_ROWS;
+        sim_matrix[row] ^= _BV(sim_rand() % COUNT_COLS);
+    }
+    TIMER1_COMPA_vect();
+    keyscanner_main();
+    if (ringbuf_size() != before) {
+        SIM_CHECK(queued < MAX_QUEUED, "the ring holds more than %u reports", MAX_QUEUED);
+        made_at[queued++] = now;
+    }
+}
+
+static void run(uint32_t poll_every_ticks, uint8_t change_interval, latency_t *latency) {
+    uint32_t now = 0, last_compare = 0, next_poll = poll_every_ticks;
+
+    memset(latency, 0, sizeof(*latency));
+    queued = 0;
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    keyscanner_init();
+    keyscan_ticks = 0;
+    while (!ringbuf_empty()) {
+        ringbuf_pop();
+    }
+
+    while (now < RUN_TICKS) {
+        uint32_t next_compare = last_compare + OCR1A + 1;
+        uint8_t buf[32];
+
+        if (next_poll < next_compare || (next_poll == next_compare && sim_rand() % 2)) {
+            // Between compare matches
+            now = next_poll;
+            TCNT1 = now - last_compare;
+            TIFR1 = 0;
+        } else if (next_poll < next_compare + 4 && sim_rand() % 2) {
+            // Just after one, with its interrupt still waiting
+            now = next_poll;
+            TCNT1 = now - next_compare;
+            TIFR1 = _BV(OCF1A);
+        } else {
+            now = last_compare = next_compare;
+            TCNT1 = 0;
+            TIFR1 = 0;
+            scan(now);
+            continue;
+        }
+
+        next_poll += poll_every_ticks;
+        if (change_interval && sim_rand() % 4 == 0) {
+            uint8_t command[2] = { TWI_CMD_KEYSCAN_INTERVAL };
+            uint16_t ticks;
+
+            command[1] = KEYSCAN_INTERVAL_DEFAULT / 2 + sim_rand() % (KEYSCAN_INTERVAL_DEFAULT * 3 / 2);
+            twi_data_received(command, sizeof(command));
+            twi_command(TWI_CMD_KEYSCAN_TICKS);
+            SIM_CHECK(twi_read(buf) == 2, "TWI_CMD_KEYSCAN_TICKS is 2 bytes");
+            ticks = buf[0] | buf[1] << 8;
+            SIM_CHECK(ticks == (uint16_t)now, "read tick %u at tick %u, after setting the interval to %u",
+                      ticks, (uint16_t)now, command[1]);
+        }
+        twi_command(TWI_CMD_NONE);
+        if (twi_read(buf) == 1) {
+            SIM_CHECK(buf[0] == TWI_REPLY_NONE, "a one byte reply that isn't TWI_REPLY_NONE");
+            SIM_CHECK(queued == 0, "nothing to read with %u reports queued", queued);
+        } else {
+            uint16_t stamp = buf[1 + KEY_REPORT_SIZE_BYTES] | buf[2 + KEY_REPORT_SIZE_BYTES] << 8;
+            uint16_t ticks;
+
+            SIM_CHECK(buf[0] == TWI_REPLY_KEYDATA && queued > 0, "key data with nothing queued");
+            twi_command(TWI_CMD_KEYSCAN_TICKS);
+            SIM_CHECK(twi_read(buf) == 2, "TWI_CMD_KEYSCAN_TICKS is 2 bytes");
+            ticks = buf[0] | buf[1] << 8;
+            SIM_CHECK(ticks == (uint16_t)now, "read tick %u at tick %u", ticks, (uint16_t)now);
+
+            uint16_t waited = ticks - stamp;
+            SIM_CHECK(waited == now - made_at[0], "the report made at tick %u, read at %u, waited %u ticks",
+                      made_at[0], now, waited);
+            latency->reports++;
+            latency->total_ticks += waited;
+            if (waited > latency->max_ticks) {
+                latency->max_ticks = waited;
+            }
+            memmove(made_at, made_at + 1, --queued * sizeof(*made_at));
+        }
+
+        // The interrupt that was waiting. A new interval might have started
+        // the timer over, so go by where it's counting from now.
+        if (TIFR1) {
+            TIFR1 = 0;
+            scan(now - TCNT1);
+        }
+        last_compare = now - TCNT1;
+    }
+}
+
+int main(void) {
+    static const uint16_t poll_every_us[] = { 500, 1000, 2000, 5000, 10000 };
+    latency_t latency;
+
+    SIM_CHECK(KEY_REPORT_BYTES == KEY_REPORT_SIZE_BYTES + 2, "built without KEY_REPORT_TIMESTAMPS");
+
+    for (uint8_t i = 0; i < sizeof(poll_every_us) / sizeof(*poll_every_us); i++) {
+        run(KEYSCAN_US_TO_TICKS(poll_every_us[i]), 0, &latency);
+        SIM_CHECK(latency.reports > 0, "no reports");
+        printf("ok - polling every %5.1fms: %4u reports waited %.2fms on average, %.2fms at most\n",
+               poll_every_us[i] / 1000.0, latency.reports,
+               latency.total_ticks * 0.032 / latency.reports, latency.max_ticks * 0.032);
+    }
+
+    run(KEYSCAN_US_TO_TICKS(1000), 1, &latency);
+    SIM_CHECK(latency.reports > 0, "no reports");
+    printf("ok - %u reports timed exactly with the keyscan interval changing as they're polled\n", latency.reports);
+    return 0;
+}
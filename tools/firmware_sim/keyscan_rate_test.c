@@ -0,0 +1,171 @@
+/* Checks that dual rate scanning keeps the debounce delays
+ *
+ * Time runs in timer1 ticks: every scan happens OCR1A ticks after the last
+ * one, like the compare match interrupt would have it. The same bouncy key
+ * presses and releases run once with the idle interval off and once with it
+ * on. Counting from the first scan of the last run of good reads, reports
+ * must come exactly as long after it both ways. Counting from the key
+ * change, they can only be up to one idle interval late.
+ *
+ * Then it runs again at twice the keyscan interval. Debouncers that count
+ * scans take twice as long, timed ones (DEBOUNCE_TIMED) must not.
+ *
+ * Last, a scan that runs late into an idle interval and wakes the keyscanner
+ * up must not lose the ticks counted so far.
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+#include DEBOUNCER
+
+#define KEY_ROW 2
+#define KEY_COL 5
+
+/* Key changes happen at odd times, so they land all over the scan interval */
+#define CHANGES 40
+#define CHANGE_EVERY_TICKS 5003
+
+/* Bounces for the first this many ticks after a change (~1.9ms) */
+#define BOUNCE_TICKS 60
+
+typedef struct {
+    uint32_t delay[CHANGES];
+    uint32_t reported_at[CHANGES];
+    uint32_t reports;
+    uint32_t scans;
+    uint32_t idle_scans;
+} run_t;
+
+static uint8_t key_is_down(uint32_t now) {
+    uint32_t change = now / CHANGE_EVERY_TICKS;
+    uint32_t since = now % CHANGE_EVERY_TICKS;
+    uint8_t down = change % 2;
+
+    // Read the wrong way about half the time for a while, then settle
+    if (change > 0 && since < BOUNCE_TICKS && ((now * 2654435761u) >> 31)) {
+        down = !down;
+    }
+    return down;
+}
+
+static void run(uint8_t interval, uint8_t idle_interval, run_t *r) {
+    uint32_t now = 0;
+    uint32_t good_reads_since = 0;
+    uint32_t last_change = 0;
+
+    memset(r, 0, sizeof(*r));
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    keyscanner_init();
+    keyscanner_set_interval(interval);
+    keyscanner_set_idle_interval(idle_interval);
+    while (!ringbuf_empty()) {
+        ringbuf_pop();
+    }
+
+    while (now < (CHANGES + 1) * CHANGE_EVERY_TICKS) {
+        uint32_t change = now / CHANGE_EVERY_TICKS;
+        uint8_t down = key_is_down(now);
+
+        sim_matrix[KEY_ROW] = down ? _BV(KEY_COL) : 0;
+        if (change != last_change) {
+            good_reads_since = UINT32_MAX;
+        }
+        if (down != change % 2) {
+            good_reads_since = UINT32_MAX;
+        } else if (good_reads_since == UINT32_MAX) {
+            good_reads_since = now;
+        }
+        last_change = change;
+
+        TIMER1_COMPA_vect();
+        keyscanner_main();
+        r->scans++;
+        r->idle_scans += OCR1A != keyscanner_get_interval();
+
+        while (!ringbuf_empty()) {
+            uint8_t report[KEY_REPORT_SIZE_BYTES];
+            for (uint8_t row = 0; row < KEY_REPORT_SIZE_BYTES; row++) {
+                report[row] = ringbuf_pop();
+            }
+            SIM_CHECK(r->reports < CHANGES, "more reports than key changes");
+            SIM_CHECK(!!(report[KEY_ROW] & _BV(KEY_COL)) == (r->reports % 2 == 0),
+                      "report %u has the key the wrong way", r->reports);
+            r->delay[r->reports] = now - good_reads_since;
+            r->reported_at[r->reports++] = now;
+        }
+
+        now += OCR1A + 1;
+    }
+    SIM_CHECK(r->reports == CHANGES, "%u reports for %u key changes", r->reports, CHANGES);
+}
+
+static void check_wake_keeps_ticks(void) {
+    uint16_t ticks;
+
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    keyscanner_init();
+    keyscanner_set_interval(KEYSCAN_INTERVAL_DEFAULT);
+    keyscanner_set_idle_interval(KEYSCAN_IDLE_INTERVAL_DEFAULT);
+    while (OCR1A == keyscanner_get_interval()) {
+        TIMER1_COMPA_vect();
+        keyscanner_main();
+    }
+
+    // Past where the keyscan interval would have matched
+    TCNT1 = OCR1A - 1;
+    ticks = keyscanner_get_ticks();
+    sim_matrix[KEY_ROW] = _BV(KEY_COL);
+    do_scan = 1;
+    keyscanner_main();
+    SIM_CHECK(OCR1A == keyscanner_get_interval() && TCNT1 == 0, "the key going down didn't restart the keyscan interval");
+    SIM_CHECK(keyscanner_get_ticks() == ticks, "waking up went from tick %u to %u", ticks, keyscanner_get_ticks());
+}
+
+int main(void) {
+    static run_t fast, dual, slow;
+
+    run(KEYSCAN_INTERVAL_DEFAULT, 0, &fast);
+    run(KEYSCAN_INTERVAL_DEFAULT, KEYSCAN_IDLE_INTERVAL_DEFAULT, &dual);
+    run(KEYSCAN_INTERVAL_DEFAULT * 2, 0, &slow);
+
+    SIM_CHECK(fast.idle_scans == 0, "no scan should be at the idle interval when it's off");
+    SIM_CHECK(dual.idle_scans > 0, "the keys are still most of the time, some scans should be idle");
+
+    for (uint8_t i = 0; i < CHANGES; i++) {
+        uint32_t fast_delay = fast.delay[i];
+        uint32_t dual_delay = dual.delay[i];
+        uint32_t fast_latency = fast.reported_at[i] - (i + 1) * CHANGE_EVERY_TICKS;
+        uint32_t dual_latency = dual.reported_at[i] - (i + 1) * CHANGE_EVERY_TICKS;
+
+        SIM_CHECK(dual_delay == fast_delay,
+                  "change %u: debounced in %u ticks at one rate, %u at two", i, fast_delay, dual_delay);
+        SIM_CHECK(dual_latency <= fast_latency + KEYSCAN_IDLE_INTERVAL_DEFAULT + 1,
+                  "change %u: reported %u ticks late, %u at one rate", i, dual_latency, fast_latency);
+#if defined(DEBOUNCE_TIMED)
+        // Within a scan of the delay, either way
+        uint32_t press_or_release = i % 2 ? DEBOUNCE_RELEASE_DELAY_TICKS : DEBOUNCE_PRESS_DELAY_TICKS;
+        SIM_CHECK(fast_delay >= press_or_release && fast_delay <= press_or_release + KEYSCAN_INTERVAL_DEFAULT + 1,
+                  "change %u: debounced in %u ticks, for a delay of %u", i, fast_delay, press_or_release);
+        SIM_CHECK(slow.delay[i] >= press_or_release && slow.delay[i] <= press_or_release + 2 * KEYSCAN_INTERVAL_DEFAULT + 1,
+                  "change %u: debounced in %u ticks at twice the interval, for a delay of %u",
+                  i, slow.delay[i], press_or_release);
+#endif
+    }
+
+    printf("ok - %u key changes debounced the same at one and two rates\n", CHANGES);
+    printf("ok - %u scans at one rate, %u at two (%u at the idle interval)\n",
+           fast.scans, dual.scans, dual.idle_scans);
+    printf("ok - the first press took %.2fms to debounce, %.2fms at twice the keyscan interval\n",
+           fast.delay[0] * 0.032, slow.delay[0] * 0.032);
+
+    check_wake_keeps_ticks();
+    printf("ok - waking up late in an idle interval keeps the ticks\n");
+    return 0;
+}
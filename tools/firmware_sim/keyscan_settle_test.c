@@ -0,0 +1,109 @@
+/* Checks the keyscan settle delay and its calibration
+ *
+ * The simulated matrix takes sim_settle_cycles to settle after an output
+ * changes. Until then, inputs still read the previous output's keys, so a
+ * scan without enough settle delay reports keys on the wrong rows.
+ * Calibration, at boot or when the master asks for it, has to find the
+ * shortest delay that reads clean. When the master asks, it has to get there
+ * a pass per scan, without any scan taking much longer than that.
+ */
+#include <string.h>
+#include "sim.h"
+#include "keyscanner.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+
+/* Scans enough times for every debouncer to settle */
+#define SCANS 64
+
+/* Long cables: 4us before a row reads right */
+#define SETTLE_CYCLES (4 * (F_CPU / 1000000))
+
+/* A calibration pass at the longest delay: two waits of up to
+ * KEYSCANNER_SETTLE_DELAY_MAX loops per output */
+#define PASS_CYCLES (COUNT_OUTPUT * 2 * KEYSCANNER_SETTLE_DELAY_MAX * 3)
+
+static uint8_t report[KEY_REPORT_SIZE_BYTES];
+
+static void scan(void) {
+    for (uint8_t i = 0; i < SCANS; i++) {
+        do_scan = 1;
+        keyscanner_main();
+    }
+    while (!ringbuf_empty()) {
+        for (uint8_t row = 0; row < KEY_REPORT_SIZE_BYTES; row++) {
+            report[row] = ringbuf_pop();
+        }
+    }
+}
+
+static uint8_t report_is_clean(void) {
+    return memcmp(report, sim_matrix, KEY_REPORT_SIZE_BYTES) == 0;
+}
+
+static void hold_some_keys(void) {
+    sim_matrix[0] = _BV(1);
+    sim_matrix[2] = _BV(5) | _BV(6);
+}
+
+int main(void) {
+    // The shortest delay that covers SETTLE_CYCLES, counting the read itself
+    const uint8_t needed = (SETTLE_CYCLES - 1 + 2) / 3;
+
+    // Nothing held at boot: calibration can't see anything, keeps the default
+    sim_reset();
+    sim_settle_cycles = SETTLE_CYCLES;
+    keyscanner_init();
+    SIM_CHECK(keyscanner_get_settle_delay() == KEYSCANNER_SETTLE_DELAY_DEFAULT,
+              "with no keys held, calibration should keep the default, not %u",
+              keyscanner_get_settle_delay());
+
+    hold_some_keys();
+    scan();
+    SIM_CHECK(!report_is_clean(), "without a settle delay, keys should show up on the wrong rows");
+    printf("ok - %u cycles to settle: reads %02x %02x %02x %02x for %02x %02x %02x %02x without a delay\n",
+           SETTLE_CYCLES, report[0], report[1], report[2], report[3],
+           sim_matrix[0], sim_matrix[1], sim_matrix[2], sim_matrix[3]);
+
+    // The master asks for calibration while keys are held
+    keyscanner_set_settle_delay(TWI_KEYSCAN_SETTLE_CALIBRATE);
+    uint8_t scans = 0;
+    uint64_t longest_scan = 0;
+    while (keyscanner_get_settle_delay() != needed && scans < SCANS) {
+        uint64_t start = sim_cycles;
+        do_scan = 1;
+        keyscanner_main();
+        if (sim_cycles - start > longest_scan) {
+            longest_scan = sim_cycles - start;
+        }
+        scans++;
+    }
+    SIM_CHECK(keyscanner_get_settle_delay() == needed, "calibrated to %u, expected %u",
+              keyscanner_get_settle_delay(), needed);
+    SIM_CHECK(scans > KEYSCANNER_SETTLE_CALIBRATION_PASSES && longest_scan < 2 * PASS_CYCLES,
+              "calibrated in %u scans, the longest took %u cycles", scans, (uint32_t)longest_scan);
+    scan();
+    SIM_CHECK(report_is_clean(), "after calibration, reports should be clean");
+    printf("ok - calibrated to %u delay loops (%u cycles per row) over %u scans, %u cycles at most each\n",
+           needed, needed * 3, scans, (uint32_t)longest_scan);
+
+    // Boot with keys held
+    sim_reset();
+    sim_settle_cycles = SETTLE_CYCLES;
+    hold_some_keys();
+    keyscanner_set_settle_delay(0);
+    keyscanner_init();
+    SIM_CHECK(keyscanner_get_settle_delay() == needed, "calibrated at boot to %u, expected %u",
+              keyscanner_get_settle_delay(), needed);
+    scan();
+    SIM_CHECK(report_is_clean(), "after boot calibration, reports should be clean");
+    printf("ok - calibrated at boot with keys held\n");
+
+    // The master can still set it by hand
+    keyscanner_set_settle_delay(needed - 1);
+    scan();
+    SIM_CHECK(keyscanner_get_settle_delay() == needed - 1 && !report_is_clean(),
+              "one loop short of the calibrated delay should read wrong");
+    printf("ok - one delay loop less reads wrong again\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+/* Checks that frames stop at the end of the LED chain set with
+ * TWI_CMD_LED_COUNT, and that the count survives a reset
+ *
+ * For every chain length, full and partial updates go out with that many
+ * LEDs and an end frame sized for them, nothing past the end of the chain,
+ * so a frame's length, its SPI interrupts and the time it takes on the wire
+ * go down with the chain. When the chain gets longer, the next frame has to
+ * send the new LEDs what the master last wrote to them, even from before.
+ * Then checks the count is kept in EEPROM, written
+ * from the main loop rather than the TWI interrupt and only when it
+ * changes, and that an erased or bad EEPROM means all NUM_LEDS.
+ */
+#include <string.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+#include "twi-slave.h"
+#include "wire-protocol.h"
+
+#define FRAME_START_BYTES 4
+#define LED_FRAME_MARKER 0b11100000
+
+#define END_FRAME_BYTES(leds) (4 + ((leds) + 15) / 16)
+#define FRAME_BYTES(leds) (FRAME_START_BYTES + (leds) * 4 + END_FRAME_BYTES(leds))
+
+/* SPI_FREQUENCY_DEFAULT, 512KHz */
+#define BYTE_CYCLES (8 * 16)
+
+/* What check_frame() last sent */
+static uint8_t frame[FRAME_BYTES(NUM_LEDS) + 1];
+
+static void set_count(uint8_t count) {
+    uint8_t buf[2] = { TWI_CMD_LED_COUNT, count };
+    twi_data_received(buf, sizeof(buf));
+}
+
+static uint8_t get_count(void) {
+    uint8_t buf[TWI_BUFFER_SIZE];
+    uint8_t size = sizeof(buf);
+    uint8_t command = TWI_CMD_LED_COUNT;
+
+    twi_data_received(&command, 1);
+    twi_data_requested(buf, &size);
+    return buf[0];
+}
+
+/* Sends the next frame, and checks it has `leds` LEDs of data followed by
+ * the end frame for a chain of `count`. Returns its length. */
+static uint16_t check_frame(uint8_t leds, uint8_t count) {
+    uint16_t bytes = 0;
+    int byte;
+
+    led_scan_slot();
+    while ((byte = sim_spi_step()) >= 0) {
+        SIM_CHECK(bytes < sizeof(frame), "a frame longer than %u bytes", FRAME_BYTES(NUM_LEDS));
+        frame[bytes++] = byte;
+    }
+    SIM_CHECK(bytes == FRAME_START_BYTES + leds * 4 + END_FRAME_BYTES(count),
+              "a %u byte frame for %u LEDs on a chain of %u", bytes, leds, count);
+    for (uint16_t i = 0; i < bytes; i++) {
+        uint8_t led_byte = i >= FRAME_START_BYTES && i < FRAME_START_BYTES + leds * 4;
+        if (led_byte && (i - FRAME_START_BYTES) % 4 == 0) {
+            SIM_CHECK((frame[i] & LED_FRAME_MARKER) == LED_FRAME_MARKER, "no LED frame marker at byte %u", i);
+        } else if (!led_byte) {
+            SIM_CHECK(frame[i] == 0, "byte %u of the start or end frame is 0x%02x", i, frame[i]);
+        }
+    }
+    return bytes;
+}
+
+static void check_lengths(void) {
+    uint8_t buf[LED_BUFSZ];
+    uint16_t last_bytes = 0;
+
+    printf("%-6s %12s %12s %12s\n", "LEDs", "frame bytes", "frame us", "frames/s");
+    for (uint8_t count = 1; count <= NUM_LEDS; count++) {
+        set_count(count);
+        SIM_CHECK(get_count() == count, "the count reads %u, for %u", get_count(), count);
+
+        for (uint16_t i = 0; i < sizeof(buf); i++) {
+            buf[i] = sim_rand();
+        }
+        led_update_all(buf);
+        uint16_t bytes = check_frame(count, count);
+        SIM_CHECK(bytes > last_bytes, "%u bytes for %u LEDs, %u for one less", bytes, count, last_bytes);
+        last_bytes = bytes;
+
+        // Frames go out up to the last LED that changed, or the end of the
+        // chain if that comes first
+        led_set_one_to(NUM_LEDS - 1, buf);
+        check_frame(count, count);
+        led_set_one_to(0, buf);
+        check_frame(1, count);
+        led_set_one_to(count - 1, buf);
+        check_frame(count, count);
+        led_set_all_to(buf);
+        check_frame(count, count);
+
+        if (count % 8 == 0 || count == 1) {
+            uint32_t byte_cycles = BYTE_CYCLES > CYCLES_LED_ISR ? BYTE_CYCLES : CYCLES_LED_ISR;
+            uint32_t cycles = bytes * byte_cycles;
+            printf("%-6u %12u %12u %12u\n", count, bytes, cycles / (F_CPU / 1000000), F_CPU / cycles);
+        }
+    }
+    printf("ok - frames stop at the end of the chain, for every length from 1 to %u\n", NUM_LEDS);
+}
+
+static void check_growing(void) {
+    uint8_t buf[LED_BUFSZ];
+
+    set_count(NUM_LEDS / 4);
+    for (uint16_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = sim_rand();
+    }
+    led_update_all(buf);
+    check_frame(NUM_LEDS / 4, NUM_LEDS / 4);
+
+    set_count(NUM_LEDS);
+    check_frame(NUM_LEDS, NUM_LEDS);
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        SIM_CHECK(memcmp(&frame[FRAME_START_BYTES + led * 4 + 1], &buf[led * LED_DATA_SIZE], LED_DATA_SIZE) == 0,
+                  "LED %u didn't get what was written to it past the end of the chain", led);
+    }
+    printf("ok - a longer chain gets all its LEDs in the next frame\n");
+}
+
+static void check_eeprom(void) {
+    uint8_t off[LED_BUFSZ] = { 0 };
+    uint32_t writes;
+
+    writes = sim_eeprom_writes;
+    set_count(20);
+    SIM_CHECK(sim_eeprom_writes == writes, "wrote the EEPROM from the TWI interrupt");
+    led_save_count();
+    SIM_CHECK(sim_eeprom_writes == writes + 1, "%u EEPROM writes to save the count", sim_eeprom_writes - writes);
+    writes = sim_eeprom_writes;
+    led_save_count();
+    set_count(20);
+    led_save_count();
+    SIM_CHECK(sim_eeprom_writes == writes, "wrote the EEPROM for the same count");
+    set_count(0);
+    set_count(NUM_LEDS + 1);
+    led_save_count();
+    SIM_CHECK(get_count() == 20 && sim_eeprom_writes == writes, "took a count of 0 or %u", NUM_LEDS + 1);
+
+    sim_reset();
+    led_init();
+    SIM_CHECK(led_get_count() == 20, "%u LEDs after a reset, for 20", led_get_count());
+    sim_spi_drain();
+    led_update_all(off);
+    check_frame(20, 20);
+
+    sim_eeprom[0] = 0;
+    sim_reset();
+    led_init();
+    SIM_CHECK(led_get_count() == NUM_LEDS, "%u LEDs from a bad EEPROM", led_get_count());
+    printf("ok - the count is kept over a reset, in %u EEPROM writes\n", sim_eeprom_writes);
+}
+
+int main(void) {
+    sim_reset();
+    led_init();
+    twi_init();
+    SIM_CHECK(led_get_count() == NUM_LEDS, "%u LEDs from an erased EEPROM", led_get_count());
+    sim_spi_drain();
+    // The clock stands still here: every update goes out in the next slot
+    led_set_frame_interval(0);
+
+    check_lengths();
+    check_growing();
+    check_eeprom();
+    return 0;
+}
@@ -0,0 +1,212 @@
+/* Checks the LED effect engine, set up over TWI and left to run
+ *
+ * Every scan runs the way the main loop has it: keyscanner_main(), then
+ * led_effect_step() and led_scan_slot(), and whatever frame goes out is
+ * shifted through an APA102 chain. Checks that:
+ * - breathe and fade show the blend their phase calls for on every LED, at
+ *   every scan, from nothing but timer1 ticks and the palette
+ * - with the reactive effect, a key lights up in the same scan slot its
+ *   press gets reported in, fades back over a cycle once it's let go, and
+ *   no frames go out while nothing changes
+ * - the master sends nothing once the effect is on
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+
+#define FRAME_START_BYTES 4
+#define LED_FRAME_MARKER 0b11100000
+
+#define KEY_ROW 2
+#define KEY_COL 5
+#define KEY_LED (KEY_ROW * COUNT_COLS + KEY_COL)
+
+/* What the LED chain shows */
+static uint8_t chain[NUM_LEDS][LED_DATA_SIZE];
+static uint32_t frames;
+static uint32_t master_bytes;
+
+static void twi_write(const uint8_t *buf, uint8_t len) {
+    uint8_t copy[32];
+    memcpy(copy, buf, len);
+    twi_data_received(copy, len);
+    master_bytes += len;
+}
+
+/* One scan slot, and the frame that goes out in it, if any. Returns 1 if
+ * the scan queued a key report. */
+static uint8_t scan(void) {
+    uint8_t frame[FRAME_START_BYTES + NUM_LEDS * 4 + 8];
+    uint16_t bytes = 0;
+    uint8_t reported;
+    int byte;
+
+    TIMER1_COMPA_vect();
+    keyscanner_main();
+    reported = !ringbuf_empty();
+    while (!ringbuf_empty()) {
+        ringbuf_pop();
+    }
+    led_effect_step();
+    led_scan_slot();
+    while ((byte = sim_spi_step()) >= 0) {
+        SIM_CHECK(bytes < sizeof(frame), "a frame longer than %u bytes", (unsigned)sizeof(frame));
+        frame[bytes++] = byte;
+    }
+    if (bytes > 0) {
+        frames++;
+        for (uint8_t led = 0; FRAME_START_BYTES + led * 4 + 4 <= bytes &&
+                (frame[FRAME_START_BYTES + led * 4] & LED_FRAME_MARKER) == LED_FRAME_MARKER; led++) {
+            memcpy(chain[led], frame + FRAME_START_BYTES + led * 4 + 1, LED_DATA_SIZE);
+        }
+    }
+    return reported;
+}
+
+static void setup(void) {
+    // led_init() leaves the effect alone, so one check doesn't start where
+    // the last left off
+    static const uint8_t effect_off[] = { TWI_CMD_LED_EFFECT, LED_EFFECT_NONE, LED_EFFECT_SPEED_DEFAULT };
+
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    led_init();
+    keyscanner_init();
+    twi_init();
+    twi_write(effect_off, sizeof(effect_off));
+    memset(sim_matrix, 0, sizeof(sim_matrix));
+    for (uint8_t i = 0; i < 4; i++) {
+        scan();
+    }
+}
+
+static uint8_t blend(uint8_t from, uint8_t to, uint8_t amount) {
+    return (from * (256 - amount) >> 8) + (to * (amount + 1) >> 8);
+}
+
+static void check_uniform(uint8_t effect, const uint8_t palette[2][LED_DATA_SIZE], uint8_t speed) {
+    const uint8_t off[LED_DATA_SIZE] = { 0 };
+    const uint8_t *from = effect == LED_EFFECT_BREATHE ? off : palette[0];
+    const uint8_t *to = effect == LED_EFFECT_BREATHE ? palette[0] : palette[1];
+    uint8_t set_palette[2 + 2 * LED_DATA_SIZE] = { TWI_CMD_LED_SET_PALETTE, 0 };
+    uint8_t set_effect[3] = { TWI_CMD_LED_EFFECT, effect, speed };
+    uint32_t cycle_ticks = (1ul << 18) / speed;
+    uint32_t elapsed = 0;
+    uint16_t last;
+    uint8_t min = 255, max = 0;
+
+    setup();
+    memcpy(set_palette + 2, palette, 2 * LED_DATA_SIZE);
+    twi_write(set_palette, sizeof(set_palette));
+    twi_write(set_effect, sizeof(set_effect));
+    master_bytes = 0;
+    last = keyscanner_get_ticks();
+
+    // Longer than the 16 bit tick count goes round at the slower speeds
+    while (elapsed < 2 * cycle_ticks) {
+        scan();
+        elapsed += (uint16_t)(keyscanner_get_ticks() - last);
+        last = keyscanner_get_ticks();
+        uint8_t step = elapsed * speed >> 10;
+        uint8_t amount = step < 128 ? step * 2 : (255 - step) * 2 + 1;
+
+        for (uint8_t led = 0; led < NUM_LEDS; led++) {
+            for (uint8_t i = 0; i < LED_DATA_SIZE; i++) {
+                SIM_CHECK(chain[led][i] == blend(from[i], to[i], amount),
+                          "effect %u, LED %u shows %u at phase %u (%u ticks), for %u", effect, led,
+                          chain[led][i], step, elapsed, blend(from[i], to[i], amount));
+            }
+        }
+        min = chain[0][0] < min ? chain[0][0] : min;
+        max = chain[0][0] > max ? chain[0][0] : max;
+    }
+    SIM_CHECK(master_bytes == 0, "the master sent %u bytes", master_bytes);
+    printf("ok - effect %u at speed %u: every LED right at every scan, from %u to %u over %.0fms cycles\n",
+           effect, speed, min, max, cycle_ticks * 0.032);
+}
+
+static void check_reactive(void) {
+    static const uint8_t palette[2][LED_DATA_SIZE] = { { 0, 0, 10 }, { 255, 255, 255 } };
+    uint8_t set_palette[2 + 2 * LED_DATA_SIZE] = { TWI_CMD_LED_SET_PALETTE, 0 };
+    uint8_t set_effect[3] = { TWI_CMD_LED_EFFECT, LED_EFFECT_REACTIVE, 32 };
+    uint32_t cycle_ticks = (1ul << 18) / 32;
+    uint32_t elapsed, idle_frames;
+    uint16_t released;
+    uint8_t scans, last;
+
+    setup();
+    memcpy(set_palette + 2, palette, sizeof(palette));
+    twi_write(set_palette, sizeof(set_palette));
+    twi_write(set_effect, sizeof(set_effect));
+    master_bytes = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        scan();
+    }
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        SIM_CHECK(memcmp(chain[led], palette[0], LED_DATA_SIZE) == 0, "LED %u isn't color 0", led);
+    }
+
+    // Press: lit in the scan that reports it, not before
+    sim_matrix[KEY_ROW] = _BV(KEY_COL);
+    for (scans = 0; !scan(); scans++) {
+        SIM_CHECK(scans < 100, "the press never got reported");
+        SIM_CHECK(memcmp(chain[KEY_LED], palette[0], LED_DATA_SIZE) == 0, "lit up before the press was reported");
+    }
+    SIM_CHECK(memcmp(chain[KEY_LED], palette[1], LED_DATA_SIZE) == 0, "not lit in the scan the press was reported in");
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        SIM_CHECK(led == KEY_LED || memcmp(chain[led], palette[0], LED_DATA_SIZE) == 0,
+                  "LED %u lit up with another key", led);
+    }
+
+    // Held: nothing changes, nothing goes out
+    idle_frames = frames;
+    for (elapsed = 0; elapsed < cycle_ticks; elapsed += OCR1A + 1) {
+        scan();
+    }
+    SIM_CHECK(frames == idle_frames, "%u frames with a key held", frames - idle_frames);
+
+    // Release: fades back to color 0 over a cycle, and only goes down
+    sim_matrix[KEY_ROW] = 0;
+    while (!scan()) {
+    }
+    // The scan interval goes up once the keys are idle, so this is in ticks.
+    // Fading steps go with the phase, not the release, so the first is short:
+    // fifteen of them take 14/16 to 15/16 of a cycle.
+    released = keyscanner_get_ticks();
+    last = chain[KEY_LED][0];
+    while (memcmp(chain[KEY_LED], palette[0], LED_DATA_SIZE) != 0) {
+        scan();
+        SIM_CHECK(chain[KEY_LED][0] <= last, "got brighter while fading");
+        last = chain[KEY_LED][0];
+    }
+    elapsed = (uint16_t)(keyscanner_get_ticks() - released);
+    SIM_CHECK(elapsed >= cycle_ticks * 14 / 16 && elapsed <= cycle_ticks * 15 / 16 + 2 * (OCR1A + 1u),
+              "faded in %u ticks, for a cycle of %u", elapsed, cycle_ticks);
+
+    idle_frames = frames;
+    for (elapsed = 0; elapsed < cycle_ticks; elapsed += OCR1A + 1) {
+        scan();
+    }
+    SIM_CHECK(frames == idle_frames, "%u frames with nothing to show", frames - idle_frames);
+    SIM_CHECK(master_bytes == 0, "the master sent %u bytes", master_bytes);
+
+    printf("ok - reactive: lit in the scan slot the press was reported in, %u scans after it went down\n", scans);
+    printf("ok - reactive: faded back in %.0fms, for a %.0fms cycle, with no frames while idle\n",
+           elapsed * 0.032, cycle_ticks * 0.032);
+}
+
+int main(void) {
+    static const uint8_t palette[2][LED_DATA_SIZE] = { { 200, 100, 50 }, { 10, 255, 0 } };
+
+    check_uniform(LED_EFFECT_BREATHE, palette, 16);
+    check_uniform(LED_EFFECT_FADE, palette, 16);
+    check_uniform(LED_EFFECT_FADE, palette, 3);
+    check_reactive();
+    printf("ok - no bytes from the master once an effect was on\n");
+    return 0;
+}
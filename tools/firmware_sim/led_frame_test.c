@@ -0,0 +1,234 @@
+/* Checks that the LED double buffering never tears a frame
+ *
+ * LED updates, scan slots and SPI bytes are interleaved at random. Every update commits
+ * a new state of the LEDs, and after every frame that goes out on the wire,
+ * the LED chain must show exactly one of those committed states, in the
+ * order they were committed.
+ *
+ * Frames may stop early (after the last changed LED), so the bytes on the
+ * wire are fed through a model of an APA102 chain rather than compared
+ * directly.
+ *
+ * The model keeps its own palette, its own gamma table, worked out from the
+ * formula rather than copied from led-spiout.c, and scales brightness with a
+ * plain multiply where the firmware shifts and adds.
+ */
+#include <math.h>
+#include <string.h>
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+
+#define FRAME_START_BYTES 4
+#define FRAME_END_BYTES (4 + (NUM_LEDS / 2 / 8))
+#define FRAME_BYTES (FRAME_START_BYTES + NUM_LEDS * 4 + FRAME_END_BYTES)
+#define LED_FRAME_MARKER 0b11100000
+
+#define ITERATIONS 200000
+
+/* What the LEDs should look like after the last update */
+static uint8_t model[NUM_LEDS][LED_DATA_SIZE];
+static uint8_t model_brightness = 31;
+static uint8_t model_palette[LED_PALETTE_SIZE][LED_DATA_SIZE];
+static uint8_t model_gamma;
+static uint8_t model_scale = LED_BRIGHTNESS_SCALE_MAX;
+
+static uint8_t (*commits)[FRAME_BYTES];
+static uint32_t commit_count;
+static uint32_t commit_alloc;
+
+static void render(uint8_t *frame) {
+    memset(frame, 0, FRAME_BYTES);
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        uint8_t *out = frame + FRAME_START_BYTES + led * 4;
+        out[0] = LED_FRAME_MARKER | model_brightness;
+        memcpy(out + 1, model[led], LED_DATA_SIZE);
+    }
+}
+
+static void commit(void) {
+    if (commit_count == commit_alloc) {
+        commit_alloc = commit_alloc ? commit_alloc * 2 : 1024;
+        commits = realloc(commits, commit_alloc * FRAME_BYTES);
+    }
+    render(commits[commit_count++]);
+}
+
+static void random_bytes(uint8_t *buf, uint8_t len) {
+    for (uint8_t i = 0; i < len; i++) {
+        buf[i] = sim_rand();
+    }
+}
+
+/* Sets one LED in the model, the way the firmware stages it */
+static void model_set(uint8_t led, const uint8_t *data) {
+    for (uint8_t i = 0; i < LED_DATA_SIZE; i++) {
+        uint8_t value = data[i] * (model_scale + 1) / 256;
+        model[led][i] = model_gamma ? (uint8_t)(255 * pow(value / 255.0, 2.8) + 0.5) : value;
+    }
+}
+
+static void random_update(void) {
+    uint8_t buf[LED_BUFSZ];
+
+    switch (sim_rand() % 10) {
+    case 0: {
+        uint8_t bank = sim_rand() % NUM_LED_BANKS;
+        random_bytes(buf, LED_BANK_SIZE);
+        for (uint8_t led = 0; led < NUM_LEDS_PER_BANK; led++) {
+            model_set(bank * NUM_LEDS_PER_BANK + led, buf + led * LED_DATA_SIZE);
+        }
+        led_update_bank(buf, bank);
+        break;
+    }
+    case 1:
+        random_bytes(buf, LED_BUFSZ);
+        for (uint8_t led = 0; led < NUM_LEDS; led++) {
+            model_set(led, buf + led * LED_DATA_SIZE);
+        }
+        led_update_all(buf);
+        break;
+    case 2: {
+        uint8_t led = sim_rand() % NUM_LEDS;
+        random_bytes(buf, LED_DATA_SIZE);
+        model_set(led, buf);
+        led_set_one_to(led, buf);
+        break;
+    }
+    case 3:
+        random_bytes(buf, LED_DATA_SIZE);
+        for (uint8_t led = 0; led < NUM_LEDS; led++) {
+            model_set(led, buf);
+        }
+        led_set_all_to(buf);
+        break;
+    case 4:
+        model_brightness = sim_rand() % 32;
+        led_set_global_brightness(model_brightness);
+        break;
+    case 5: {
+        // Changes no LEDs, so commits nothing
+        uint8_t first = sim_rand() % LED_PALETTE_SIZE;
+        uint8_t count = 1 + sim_rand() % (LED_PALETTE_SIZE - first);
+        random_bytes(buf, count * LED_DATA_SIZE);
+        memcpy(model_palette[first], buf, count * LED_DATA_SIZE);
+        led_set_palette(first, buf, count);
+        return;
+    }
+    case 6: {
+        uint8_t first = sim_rand() % NUM_LEDS;
+        uint8_t count = 1 + sim_rand() % (NUM_LEDS - first);
+        random_bytes(buf, (count + 1) / 2);
+        for (uint8_t i = 0; i < count; i++) {
+            model_set(first + i, model_palette[(buf[i / 2] >> (i % 2 * 4)) & 0x0f]);
+        }
+        led_update_indexed(first, buf, count);
+        break;
+    }
+    case 7: {
+        // Some runs go past the end, or start there
+        uint8_t runs = 1 + sim_rand() % 4;
+        random_bytes(buf, runs * 3);
+        for (uint8_t r = 0; r < runs; r++) {
+            uint8_t *run = buf + r * 3;
+            run[0] %= NUM_LEDS + 4;
+            run[1] %= 12;
+            for (uint16_t led = run[0]; led < run[0] + run[1] && led < NUM_LEDS; led++) {
+                model_set(led, model_palette[run[2] & 0x0f]);
+            }
+        }
+        led_set_runs(buf, runs);
+        break;
+    }
+    case 8:
+        // Changes no LEDs until the next update
+        model_gamma = sim_rand() % 2;
+        led_set_gamma(model_gamma);
+        return;
+    case 9:
+        // The same, and half the time back to no scaling
+        model_scale = sim_rand() % 2 ? sim_rand() : LED_BRIGHTNESS_SCALE_MAX;
+        led_set_brightness_scale(model_scale);
+        return;
+    }
+    commit();
+}
+
+/* What an APA102 chain shows, laid out like a full frame */
+static uint8_t chain[FRAME_BYTES];
+static uint16_t chain_pos;
+static uint8_t chain_zeros;
+
+/* Shifts one byte into the chain. Returns 1 at the end of a frame. */
+static uint8_t chain_shift(uint8_t byte) {
+    if (chain_pos < FRAME_START_BYTES) {
+        SIM_CHECK(byte == 0, "start frame byte %u is 0x%02x", chain_pos, byte);
+        chain_pos++;
+        return 0;
+    }
+
+    uint16_t led_byte = chain_pos - FRAME_START_BYTES;
+    if (chain_zeros == 0 && (led_byte % 4 != 0 || (byte & LED_FRAME_MARKER) == LED_FRAME_MARKER)) {
+        SIM_CHECK(led_byte < NUM_LEDS * 4, "more than %u LEDs in a frame", NUM_LEDS);
+        chain[chain_pos++] = byte;
+        return 0;
+    }
+
+    SIM_CHECK(byte == 0, "end frame byte %u is 0x%02x", chain_zeros, byte);
+    if (++chain_zeros < FRAME_END_BYTES) {
+        return 0;
+    }
+    chain_pos = 0;
+    chain_zeros = 0;
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    uint32_t matched = 0;
+    uint32_t frames = 0;
+    uint32_t bytes = 0;
+
+    sim_srand(seed);
+    sim_reset();
+    led_init();
+    commit(); // the power-on state: all off, full brightness
+    led_set_frame_interval(sim_rand() % 4);
+
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        if (sim_rand() % 8 == 0) {
+            random_update();
+            continue;
+        }
+        if (sim_rand() % 4 == 0) {
+            // Scan slots come up to a frame interval step apart
+            sim_cycles += sim_rand() % (LED_FRAME_INTERVAL_TICKS(1) * CYCLES_PER_TIMER_TICK);
+            led_scan_slot();
+            continue;
+        }
+
+        for (uint8_t n = sim_rand() % 64; n > 0; n--) {
+            int byte = sim_spi_step();
+            if (byte < 0) {
+                SIM_CHECK(chain_pos == 0, "LED writes stopped %u bytes into a frame", chain_pos);
+                break;
+            }
+            bytes++;
+            if (!chain_shift(byte)) {
+                continue;
+            }
+
+            frames++;
+            while (matched < commit_count && memcmp(chain, commits[matched], FRAME_BYTES) != 0) {
+                matched++;
+            }
+            SIM_CHECK(matched < commit_count, "frame %u matches no committed frame (seed %u)", frames, seed);
+        }
+    }
+
+    SIM_CHECK(frames > 1000, "only %u frames sent", frames);
+    printf("ok - %u frames sent for %u commits, none torn (%u bytes per frame)\n",
+           frames, commit_count, bytes / frames);
+    free(commits);
+    return 0;
+}
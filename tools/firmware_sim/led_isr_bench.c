@@ -0,0 +1,82 @@
+/* Estimates the CPU the LED SPI interrupt takes at each SPI frequency
+ *
+ * The frame length comes from running the firmware, the interrupt cost from
+ * cycles.h. Build with and without LED_BUFFER_WIRE_FORMAT to compare the two
+ * buffer layouts. Only the default one fits an ATtiny88, and it doesn't
+ * sustain the default 512KHz from the interrupt: the wire format shows what
+ * a part with the SRAM for it gets, and led-transport-sim what polling gets
+ * on the ATtiny88.
+ *
+ * While a frame is going out, the interrupt fires once per byte. When it
+ * takes longer than a byte takes to shift out, the SPI clock no longer
+ * matters: the CPU is saturated and frames go out at the interrupt's pace.
+ *
+ * We call an SPI frequency sustainable when the LED interrupt leaves at
+ * least half the CPU for keyscanning and TWI.
+ *
+ * Then checks that dimming with led_set_brightness_scale() costs the
+ * interrupt nothing, since the scaling happens in the main loop before a
+ * frame starts, and prices that instead: the TWI interrupt that stages the
+ * data only copies it.
+ */
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+
+#define MAX_LED_LOAD_PERCENT 50
+
+/* Half brightness */
+#define SCALE 127
+
+int main(void) {
+    uint8_t buf[LED_BUFSZ] = {0};
+    const char *fastest = "none";
+
+    sim_reset();
+    led_init();
+    // The clock stands still here: every update goes out in the next slot
+    led_set_frame_interval(0);
+    sim_spi_drain();
+    led_update_all(buf);
+    uint32_t frame_bytes = sim_spi_drain();
+
+#if defined(LED_BUFFER_WIRE_FORMAT)
+    printf("LED_BUFFER_WIRE_FORMAT: ");
+#else
+    printf("RGB buffer: ");
+#endif
+    printf("%u cycles per interrupt, %u bytes per full frame\n", CYCLES_LED_ISR, frame_bytes);
+    printf("%-8s %12s %10s %10s %12s\n", "SPI", "byte cycles", "LED load", "frames/s", "sustainable");
+
+    for (uint8_t f = 0; f < NUM_SPI_FREQUENCIES; f++) {
+        uint32_t byte_cycles = spi_frequencies[f].byte_cycles;
+        // The interrupt can't queue bytes faster than it runs
+        if (byte_cycles < CYCLES_LED_ISR) {
+            byte_cycles = CYCLES_LED_ISR;
+        }
+        uint32_t load = 100 * CYCLES_LED_ISR / byte_cycles;
+        uint32_t fps = F_CPU / (byte_cycles * frame_bytes);
+        uint8_t ok = load <= MAX_LED_LOAD_PERCENT;
+        if (ok && *fastest == 'n') {
+            fastest = spi_frequencies[f].name;
+        }
+        printf("%-8s %12u %9u%% %10u %12s\n", spi_frequencies[f].name, spi_frequencies[f].byte_cycles,
+               load, fps, ok ? "yes" : "no");
+    }
+    printf("fastest sustainable SPI frequency: %s\n", fastest);
+
+    for (uint16_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = 255;
+    }
+    led_set_brightness_scale(SCALE);
+    led_update_all(buf);
+    uint32_t scaled_bytes = sim_spi_drain();
+    SIM_CHECK(scaled_bytes == frame_bytes, "%u bytes in a scaled frame, for %u", scaled_bytes, frame_bytes);
+    printf("brightness scaling: %u interrupts and %u cycles per full frame, the same as without it\n",
+           scaled_bytes, scaled_bytes * CYCLES_LED_ISR);
+    printf("brightness scaling: a full update costs %u cycles more (%uus) from the main loop,"
+           " at most %u cycles (%uus) of it with interrupts off\n",
+           LED_BUFSZ * CYCLES_SCALE8, LED_BUFSZ * CYCLES_SCALE8 / (F_CPU / 1000000),
+           LED_DATA_SIZE * CYCLES_SCALE8, LED_DATA_SIZE * CYCLES_SCALE8 / (F_CPU / 1000000));
+    return 0;
+}
@@ -0,0 +1,73 @@
+/* Measures how many SPI interrupts each kind of LED update costs
+ *
+ * Every byte of a frame is one SPI_STC_vect interrupt. Frames stop after the
+ * last LED that changed, so small updates near the start of the chain are
+ * much cheaper than a full refresh.
+ *
+ * usage: led-refresh-bench [updates-per-second]
+ */
+#include <string.h>
+#include "sim.h"
+#include "led-spiout.h"
+
+#define FRAME_BYTES (4 + NUM_LEDS * 4 + 4 + (NUM_LEDS / 2 / 8))
+#define UPDATES 10000
+
+static void update_one_random(uint8_t *buf) {
+    led_set_one_to(sim_rand() % NUM_LEDS, buf);
+}
+
+static void update_one_first(uint8_t *buf) {
+    led_set_one_to(0, buf);
+}
+
+static void update_one_last(uint8_t *buf) {
+    led_set_one_to(NUM_LEDS - 1, buf);
+}
+
+static void update_bank_random(uint8_t *buf) {
+    led_update_bank(buf, sim_rand() % NUM_LED_BANKS);
+}
+
+static void update_all(uint8_t *buf) {
+    led_update_all(buf);
+}
+
+static const struct {
+    const char *name;
+    void (*update)(uint8_t *buf);
+} workloads[] = {
+    { "led_set_one_to(random)", update_one_random },
+    { "led_set_one_to(0)", update_one_first },
+    { "led_set_one_to(last)", update_one_last },
+    { "led_update_bank(random)", update_bank_random },
+    { "led_update_all", update_all },
+};
+
+int main(int argc, char *argv[]) {
+    uint32_t rate = argc > 1 ? strtoul(argv[1], NULL, 0) : 100;
+    uint8_t buf[LED_BUFSZ];
+
+    sim_reset();
+    led_init();
+    // The clock stands still here: every update goes out in the next slot
+    led_set_frame_interval(0);
+    sim_spi_drain();
+
+    printf("%-26s %10s %10s %14s\n", "workload", "irq/update", "full frame", "irq/s saved");
+    for (uint8_t w = 0; w < sizeof(workloads) / sizeof(*workloads); w++) {
+        uint32_t bytes = 0;
+        for (uint32_t i = 0; i < UPDATES; i++) {
+            for (uint16_t b = 0; b < sizeof(buf); b++) {
+                buf[b] = sim_rand();
+            }
+            workloads[w].update(buf);
+            bytes += sim_spi_drain();
+        }
+        double per_update = (double)bytes / UPDATES;
+        printf("%-26s %10.1f %10d %14.0f\n", workloads[w].name, per_update, FRAME_BYTES,
+               (FRAME_BYTES - per_update) * rate);
+    }
+    printf("(irq/s saved at %u updates per second)\n", rate);
+    return 0;
+}
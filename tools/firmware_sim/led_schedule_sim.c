@@ -0,0 +1,177 @@
+/* Measures the LED frame scheduler against a master animating the LEDs
+ *
+ * The master sends every update as four bank writes, one TWI transaction
+ * after the other. Frames either start as soon as there's committed data
+ * (what the firmware did before frames waited for a scan slot), or in the
+ * first scan slot after a keyscan once the frame interval has passed since
+ * the first bank went in, at several frame intervals.
+ *
+ * For each, it counts the SPI bytes (one interrupt each) and frames sent per
+ * update, and how many frames left the LEDs showing a mix of two updates.
+ * Everything runs through the firmware code, only the clock is simulated.
+ *
+ * usage: led-schedule-sim [updates-per-second]
+ */
+#include <string.h>
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+#include "wire-protocol.h"
+
+#define SIM_CYCLES F_CPU
+
+/* A bank write on the wire: address, command and LED_BANK_SIZE bytes of
+ * 9 bits each at 400KHz */
+#define TWI_BANK_WRITE_CYCLES ((uint32_t)F_CPU / 400000 * 9 * (2 + LED_BANK_SIZE))
+
+#define FRAME_START_BYTES 4
+#define FRAME_END_BYTES (4 + (NUM_LEDS / 2 / 8))
+#define LED_FRAME_MARKER 0b11100000
+
+/* Start frames as soon as there's data, instead of in scan slots */
+#define SCHEDULE_IMMEDIATE 0xff
+
+static const uint8_t schedules[] = { SCHEDULE_IMMEDIATE, 0, 1, 2, 4, LED_FRAME_INTERVAL_DEFAULT, 8, 16 };
+
+typedef struct {
+    uint32_t updates;
+    uint32_t frames;
+    uint32_t mixed_frames;
+    uint32_t bytes;
+} results_t;
+
+/* Which update each LED of the chain shows */
+static uint8_t chain[NUM_LEDS];
+static uint16_t chain_pos;
+static uint8_t chain_zeros;
+
+/* Shifts one byte into the chain. Returns 1 at the end of a frame. */
+static uint8_t chain_shift(uint8_t byte) {
+    if (chain_pos < FRAME_START_BYTES) {
+        chain_pos++;
+        return 0;
+    }
+
+    uint16_t led_byte = chain_pos - FRAME_START_BYTES;
+    if (chain_zeros == 0 && (led_byte % 4 != 0 || (byte & LED_FRAME_MARKER) == LED_FRAME_MARKER)) {
+        if (led_byte % 4 == 1) {
+            chain[led_byte / 4] = byte;
+        }
+        chain_pos++;
+        return 0;
+    }
+
+    if (++chain_zeros < FRAME_END_BYTES) {
+        return 0;
+    }
+    chain_pos = 0;
+    chain_zeros = 0;
+    return 1;
+}
+
+static uint8_t chain_is_mixed(void) {
+    for (uint8_t led = 1; led < NUM_LEDS; led++) {
+        if (chain[led] != chain[0]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void run(uint8_t schedule, uint32_t update_rate, uint16_t byte_cycles, results_t *r) {
+    const uint32_t scan_interval = KEYSCAN_INTERVAL_DEFAULT * CYCLES_PER_TIMER_TICK;
+    const uint32_t update_period = update_rate ? F_CPU / update_rate : 0;
+    uint8_t buf[LED_BANK_SIZE];
+    uint8_t bank = 0;
+    uint32_t next_bank_at = 0;
+    uint32_t update_started_at = 0;
+    uint32_t spi_done_at = 0;
+
+    memset(r, 0, sizeof(*r));
+    memset(chain, 0, sizeof(chain));
+    chain_pos = chain_zeros = 0;
+
+    sim_reset();
+    led_init();
+    led_set_frame_interval(schedule == SCHEDULE_IMMEDIATE ? 0 : schedule);
+    sim_spi_drain();
+
+    for (uint32_t now = 0; now < SIM_CYCLES; now++) {
+        // The frame interval runs on this clock
+        sim_cycles = now;
+        if (now == next_bank_at) {
+            if (bank == 0) {
+                update_started_at = now;
+                r->updates++;
+            }
+            memset(buf, r->updates, sizeof(buf));
+            led_update_bank(buf, bank);
+            next_bank_at = now + TWI_BANK_WRITE_CYCLES;
+            if (++bank == NUM_LED_BANKS) {
+                bank = 0;
+                if (update_period && update_started_at + update_period > next_bank_at) {
+                    next_bank_at = update_started_at + update_period;
+                }
+            }
+        }
+
+        if (schedule == SCHEDULE_IMMEDIATE || now % scan_interval == 0) {
+            led_scan_slot();
+        }
+
+        if (now >= spi_done_at) {
+            int byte = sim_spi_step();
+            if (byte >= 0) {
+                spi_done_at = now + byte_cycles;
+                r->bytes++;
+                if (chain_shift(byte)) {
+                    r->frames++;
+                    r->mixed_frames += chain_is_mixed();
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t update_rates[] = { 0, 100 };
+    uint16_t byte_cycles = 0;
+    results_t r;
+
+    if (argc > 1) {
+        update_rates[1] = strtoul(argv[1], NULL, 0);
+    }
+
+    for (uint8_t f = 0; f < NUM_SPI_FREQUENCIES; f++) {
+        if (spi_frequencies[f].setting == LED_SPI_FREQUENCY_DEFAULT) {
+            byte_cycles = spi_frequencies[f].byte_cycles;
+        }
+    }
+
+    printf("bank writes take %u cycles, keyscans every %u cycles, SPI bytes take %u cycles\n",
+           TWI_BANK_WRITE_CYCLES, KEYSCAN_INTERVAL_DEFAULT * CYCLES_PER_TIMER_TICK, byte_cycles);
+    printf("%-12s %-22s %9s %9s %9s %13s %8s\n", "updates/s", "frames start", "updates", "frames",
+           "irq/s", "frames/update", "mixed");
+
+    for (uint8_t u = 0; u < sizeof(update_rates) / sizeof(*update_rates); u++) {
+        for (uint8_t s = 0; s < sizeof(schedules); s++) {
+            char rate[16], schedule[32];
+            run(schedules[s], update_rates[u], byte_cycles, &r);
+
+            if (update_rates[u]) {
+                snprintf(rate, sizeof(rate), "%u", update_rates[u]);
+            } else {
+                snprintf(rate, sizeof(rate), "back to back");
+            }
+            if (schedules[s] == SCHEDULE_IMMEDIATE) {
+                snprintf(schedule, sizeof(schedule), "immediate");
+            } else {
+                snprintf(schedule, sizeof(schedule), "after %.2fms%s", schedules[s] * 0.512,
+                         schedules[s] == LED_FRAME_INTERVAL_DEFAULT ? " (default)" : "");
+            }
+            printf("%-12s %-22s %9u %9u %9u %13.2f %7u%%\n", rate, schedule, r.updates, r.frames,
+                   r.bytes, (double)r.frames / r.updates, 100 * r.mixed_frames / (r.frames ? r.frames : 1));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+/* Compares the two LED transports: SPI interrupt and main loop polling
+ *
+ * A cycle by cycle model of the CPU over one second, with the master asking
+ * for LED frames back to back. As in the firmware, each frame waits for the
+ * first scan slot after a keyscan once the default frame interval has
+ * passed since the master's update for it, which comes as the frame before
+ * starts. It
+ * reports the LED frame rate each transport
+ * reaches, how late keyscans start after the timer compare match, and how
+ * long the LED transport can stretch a keyscan.
+ *
+ * The frame length comes from running the firmware, all costs from cycles.h.
+ * The model follows the AVR rules that matter here: interrupts don't nest,
+ * the timer vector wins over SPI when both are pending, and at least one
+ * main loop instruction runs between two interrupts.
+ */
+#include <string.h>
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+#include "wire-protocol.h"
+
+#define SIM_CYCLES F_CPU
+
+#ifndef LED_PUMP_BURST_BYTES
+#define LED_PUMP_BURST_BYTES 16
+#endif
+
+enum { TRANSPORT_INTERRUPT, TRANSPORT_POLLED };
+enum { NO_ISR, TIMER_ISR, SPI_ISR };
+
+typedef struct {
+    uint32_t frames;
+    uint32_t scans;
+    uint32_t missed_scans;
+    uint32_t latency_min;
+    uint32_t latency_max;
+    uint64_t latency_total;
+    uint32_t scan_max;
+    uint32_t idle_cycles;
+} results_t;
+
+static uint32_t frame_bytes;
+
+static void run(uint8_t transport, uint16_t byte_cycles, results_t *r) {
+    const uint32_t scan_interval = KEYSCAN_INTERVAL_DEFAULT * CYCLES_PER_TIMER_TICK;
+    const uint32_t frame_interval = LED_FRAME_INTERVAL_TICKS(LED_FRAME_INTERVAL_DEFAULT) * CYCLES_PER_TIMER_TICK;
+
+    uint8_t isr = NO_ISR;
+    uint16_t isr_left = 0;
+    uint8_t owe_main_instruction = 0;
+
+    uint8_t timer_pending = 0;
+    uint8_t spi_pending = 0;
+    uint8_t spif = 1;
+    uint32_t spi_done_at = 0;
+    uint8_t spi_busy = 0;
+
+    uint8_t do_scan_flag = 0;
+    uint32_t compare_at = 0;
+    uint16_t scan_left = 0;
+    uint32_t scan_started_at = 0;
+
+    uint16_t pump_left = 0;
+    uint8_t burst = 0;
+    uint16_t loop_left = 0;
+    uint32_t frame_pos = 0;
+    uint8_t writes_enabled = 1;
+    uint32_t frame_started_at = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->latency_min = UINT32_MAX;
+
+    // Kick off the first frame
+    if (transport == TRANSPORT_INTERRUPT) {
+        spi_pending = 1;
+    }
+
+    for (uint32_t now = 0; now < SIM_CYCLES; now++) {
+        if (now % scan_interval == 0) {
+            if (timer_pending || do_scan_flag || scan_left) {
+                r->missed_scans++;
+            }
+            timer_pending = 1;
+            compare_at = now;
+        }
+        if (spi_busy && now == spi_done_at) {
+            spi_busy = 0;
+            spif = 1;
+            spi_pending = transport == TRANSPORT_INTERRUPT && writes_enabled;
+        }
+
+        if (isr != NO_ISR) {
+            if (--isr_left == 0) {
+                if (isr == TIMER_ISR) {
+                    do_scan_flag = 1;
+                } else {
+                    // The interrupt queues the next byte
+                    spif = 0;
+                    spi_busy = 1;
+                    spi_done_at = now + byte_cycles;
+                    if (++frame_pos == frame_bytes) {
+                        frame_pos = 0;
+                        r->frames++;
+                        writes_enabled = 0;
+                    }
+                }
+                isr = NO_ISR;
+                owe_main_instruction = 1;
+            }
+            continue;
+        }
+
+        if (!owe_main_instruction && (timer_pending || spi_pending)) {
+            if (timer_pending) {
+                timer_pending = 0;
+                isr = TIMER_ISR;
+                isr_left = CYCLES_TIMER_ISR;
+            } else {
+                spi_pending = 0;
+                isr = SPI_ISR;
+                isr_left = CYCLES_LED_ISR;
+            }
+            continue;
+        }
+        owe_main_instruction = 0;
+
+        // Main loop
+        if (scan_left) {
+            if (--scan_left == 0) {
+                if (now + 1 - scan_started_at > r->scan_max) {
+                    r->scan_max = now + 1 - scan_started_at;
+                }
+                // led_scan_slot(): the master always has the next frame ready
+                if (!writes_enabled && now + 1 - frame_started_at >= frame_interval) {
+                    writes_enabled = 1;
+                    frame_started_at = now + 1;
+                    spi_pending = transport == TRANSPORT_INTERRUPT && spif;
+                }
+            }
+        } else if (pump_left) {
+            if (--pump_left == 0) {
+                spif = 0;
+                spi_busy = 1;
+                spi_done_at = now + byte_cycles;
+                if (++frame_pos == frame_bytes) {
+                    frame_pos = 0;
+                    r->frames++;
+                    writes_enabled = 0;
+                }
+            }
+        } else if (loop_left) {
+            loop_left--;
+        } else if (do_scan_flag) {
+            uint32_t latency = now - compare_at;
+            do_scan_flag = 0;
+            scan_left = CYCLES_KEYSCAN;
+            scan_started_at = now;
+            burst = 0;
+            r->scans++;
+            r->latency_total += latency;
+            if (latency < r->latency_min) r->latency_min = latency;
+            if (latency > r->latency_max) r->latency_max = latency;
+        } else if (transport == TRANSPORT_POLLED && writes_enabled) {
+            if (burst == LED_PUMP_BURST_BYTES) {
+                // Back out to main() to check for a scan
+                burst = 0;
+                loop_left = CYCLES_MAIN_LOOP;
+            } else if (spif) {
+                burst++;
+                pump_left = CYCLES_LED_PUMP_BYTE;
+            } else {
+                r->idle_cycles++;
+            }
+        } else {
+            r->idle_cycles++;
+        }
+    }
+}
+
+static void print_results(const char *mode, const char *frequency, const results_t *r) {
+    const double us_per_cycle = 1000000.0 / F_CPU;
+    printf("%-10s %-8s %9u %12.1f %12.1f %12.1f %12.1f %8u %6u%%\n", mode, frequency, r->frames,
+           r->latency_min * us_per_cycle,
+           (double)r->latency_total / (r->scans ? r->scans : 1) * us_per_cycle,
+           (r->latency_max - r->latency_min) * us_per_cycle,
+           r->scan_max * us_per_cycle,
+           r->missed_scans, (uint32_t)(100ull * r->idle_cycles / SIM_CYCLES));
+}
+
+int main(void) {
+    uint8_t buf[LED_BUFSZ] = {0};
+    results_t r;
+
+    sim_reset();
+    led_init();
+    // The clock stands still here, and the model does the frame interval
+    led_set_frame_interval(0);
+    sim_spi_drain();
+    led_update_all(buf);
+    frame_bytes = sim_spi_drain();
+
+    printf("%u bytes per LED frame, %u cycles per LED interrupt, %u cycles per pumped byte, "
+           "pump bursts of %u bytes\n", frame_bytes, CYCLES_LED_ISR, CYCLES_LED_PUMP_BYTE,
+           LED_PUMP_BURST_BYTES);
+    printf("%-10s %-8s %9s %12s %12s %12s %12s %8s %7s\n", "transport", "SPI", "frames/s",
+           "min lat us", "mean lat us", "jitter us", "max scan us", "missed", "idle");
+
+    for (uint8_t f = 0; f < NUM_SPI_FREQUENCIES; f++) {
+        run(TRANSPORT_INTERRUPT, spi_frequencies[f].byte_cycles, &r);
+        print_results("interrupt", spi_frequencies[f].name, &r);
+        run(TRANSPORT_POLLED, spi_frequencies[f].byte_cycles, &r);
+        print_results("polled", spi_frequencies[f].name, &r);
+    }
+    return 0;
+}
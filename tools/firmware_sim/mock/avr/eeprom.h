@@ -0,0 +1,29 @@
+/* Host stand-in for <avr/eeprom.h>: EEPROM addresses index sim_eeprom */
+#pragma once
+
+#include <stdint.h>
+
+// ATtiny88: 64 bytes
+#define E2END 0x3f
+
+/* What the EEPROM holds. It starts out erased (0xff), and sim_reset()
+ * leaves it alone, as a reset does. sim_eeprom_writes counts the bytes
+ * written. */
+extern uint8_t sim_eeprom[E2END + 1];
+extern uint32_t sim_eeprom_writes;
+
+/* Writes are done as soon as they start */
+static inline int eeprom_is_ready(void) {
+    return 1;
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t *address) {
+    return sim_eeprom[(uintptr_t)address];
+}
+
+static inline void eeprom_update_byte(uint8_t *address, uint8_t value) {
+    if (sim_eeprom[(uintptr_t)address] != value) {
+        sim_eeprom[(uintptr_t)address] = value;
+        sim_eeprom_writes++;
+    }
+}
@@ -0,0 +1,19 @@
+/* Host stand-in for <avr/interrupt.h> */
+#pragma once
+
+#include <avr/io.h>
+
+#define SREG_I 7
+
+// An interrupt can come in right before cli(), but never right after sei():
+// the AVR always runs the instruction after sei() first
+void sim_interrupt_point(void);
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (sim_interrupt_point(), SREG &= ~_BV(SREG_I))
+
+// Interrupt handlers become plain functions, which the simulator calls
+#define ISR(vector, ...) void vector(void)
+
+void SPI_STC_vect(void);
+void TIMER1_COMPA_vect(void);
+void TWI_vect(void);
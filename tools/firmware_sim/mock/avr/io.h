@@ -0,0 +1,68 @@
+/* Host stand-in for <avr/io.h>
+ *
+ * Just enough of the ATtiny88 register file for the firmware sources to
+ * compile and run on Linux. Registers are plain memory, owned by sim.c.
+ *
+ * There's no RAMSTART or RAMEND: the simulator doesn't hold the firmware to
+ * the ATtiny88's SRAM, so it can test layouts meant for bigger parts.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+extern volatile uint8_t SREG;
+
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTC, DDRC;
+extern volatile uint8_t PORTD, DDRD;
+
+// Pin reads go through the simulated key matrix, see sim.h
+uint8_t sim_read_pins(volatile uint8_t *port);
+#define PINB sim_read_pins(&PORTB)
+#define PINC sim_read_pins(&PORTC)
+#define PIND sim_read_pins(&PORTD)
+
+// Sleep mode control
+extern volatile uint8_t SMCR;
+#define SM1 2
+#define SM0 1
+#define SE 0
+
+// SPI
+extern volatile uint8_t SPCR, SPSR, SPDR;
+#define SPIE 7
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define CPOL 3
+#define CPHA 2
+#define SPR1 1
+#define SPR0 0
+#define SPIF 7
+#define WCOL 6
+#define SPI2X 0
+
+// Timer1
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1, OCR1A;
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1A 1
+#define OCF1A 1
+
+// TWI
+extern volatile uint8_t TWCR, TWSR, TWDR, TWAR;
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
@@ -0,0 +1,7 @@
+/* Host stand-in for <avr/pgmspace.h>: flash is just more memory */
+#pragma once
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
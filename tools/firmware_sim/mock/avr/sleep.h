@@ -0,0 +1,20 @@
+/* Host stand-in for <avr/sleep.h>
+ *
+ * sleep_cpu() hands over to the simulator, which decides what wakes us up,
+ * see sim_sleep().
+ */
+#pragma once
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC _BV(SM0)
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) (SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1))) | (mode))
+#define sleep_enable() (sim_interrupt_point(), SMCR |= _BV(SE))
+#define sleep_disable() (sim_interrupt_point(), SMCR &= ~_BV(SE))
+#define sleep_cpu() sim_sleep()
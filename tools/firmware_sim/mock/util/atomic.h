@@ -0,0 +1,18 @@
+/* Host stand-in for <util/atomic.h>, same shape as the avr-libc one */
+#pragma once
+
+#include <avr/interrupt.h>
+
+static inline uint8_t __iCliRetVal(void) {
+    cli();
+    return 1;
+}
+
+static inline void __iRestore(const uint8_t *sreg_save) {
+    SREG = *sreg_save;
+    sim_interrupt_point();
+}
+
+#define ATOMIC_RESTORESTATE uint8_t sreg_save __attribute__((__cleanup__(__iRestore))) = SREG
+
+#define ATOMIC_BLOCK(type) for ( type, __ToDo = __iCliRetVal(); __ToDo ; __ToDo = 0 )
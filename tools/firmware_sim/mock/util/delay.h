@@ -0,0 +1,7 @@
+/* Host stand-in for <util/delay.h>: delays advance the simulated clock */
+#pragma once
+
+#include <util/delay_basic.h>
+
+#define _delay_us(us) sim_delay_cycles((uint32_t)((us) * (F_CPU / 1000000)))
+#define _delay_ms(ms) sim_delay_cycles((uint32_t)((ms) * (F_CPU / 1000)))
@@ -0,0 +1,10 @@
+/* Host stand-in for <util/delay_basic.h>: delays advance the simulated clock */
+#pragma once
+
+#include <stdint.h>
+
+void sim_delay_cycles(uint32_t cycles);
+
+// A count of 0 means 256 (or 65536) loops, as on the AVR
+#define _delay_loop_1(count) sim_delay_cycles(3 * ((count) ? (uint32_t)(count) : 256))
+#define _delay_loop_2(count) sim_delay_cycles(4 * ((count) ? (uint32_t)(count) : 65536))
@@ -0,0 +1,47 @@
+/* Checks the bitwise majority votes used for oversampled reads
+ *
+ * majority3 is checked on every combination of three bytes. majority5 is
+ * checked on every combination of five bits, in every bit lane.
+ */
+#include "sim.h"
+#include "oversample.h"
+
+/* Bit `lane` of the majority of `count` inputs, counted the slow way */
+static uint8_t reference(const uint8_t *in, uint8_t count, uint8_t lane) {
+    uint8_t ones = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        ones += (in[i] >> lane) & 1;
+    }
+    return ones > count / 2;
+}
+
+int main(void) {
+    for (uint32_t v = 0; v < (1 << 24); v++) {
+        uint8_t in[3] = { v, v >> 8, v >> 16 };
+        uint8_t out = majority3(in[0], in[1], in[2]);
+        for (uint8_t lane = 0; lane < 8; lane++) {
+            SIM_CHECK(((out >> lane) & 1) == reference(in, 3, lane),
+                      "majority3(%02x, %02x, %02x) = %02x", in[0], in[1], in[2], out);
+        }
+    }
+    printf("ok - majority3 on all %u combinations of 3 bytes\n", 1 << 24);
+
+    // Lane l holds combination k + l, so every lane sees all 32 combinations
+    for (uint8_t k = 0; k < 32; k++) {
+        uint8_t in[5] = {0};
+        for (uint8_t lane = 0; lane < 8; lane++) {
+            uint8_t combination = (k + lane) % 32;
+            for (uint8_t i = 0; i < 5; i++) {
+                in[i] |= ((combination >> i) & 1) << lane;
+            }
+        }
+        uint8_t out = majority5(in[0], in[1], in[2], in[3], in[4]);
+        for (uint8_t lane = 0; lane < 8; lane++) {
+            SIM_CHECK(((out >> lane) & 1) == reference(in, 5, lane),
+                      "majority5(%02x, %02x, %02x, %02x, %02x) = %02x",
+                      in[0], in[1], in[2], in[3], in[4], out);
+        }
+    }
+    printf("ok - majority5 on all 32 combinations of 5 bits, in every lane\n");
+    return 0;
+}
@@ -0,0 +1,356 @@
+#include <string.h>
+#include "sim.h"
+#include "cycles.h"
+#include "led-spiout.h"
+#include <avr/eeprom.h>
+#include <util/twi.h>
+
+volatile uint8_t SREG;
+volatile uint8_t SMCR;
+
+volatile uint8_t PORTB, DDRB;
+volatile uint8_t PORTC, DDRC;
+volatile uint8_t PORTD, DDRD;
+
+uint8_t sim_matrix[COUNT_ROWS];
+uint64_t sim_cycles;
+uint32_t sim_settle_cycles;
+
+uint8_t sim_eeprom[E2END + 1] = { [0 ... E2END] = 0xff };
+uint32_t sim_eeprom_writes;
+
+void (*sim_interrupt_hook)(void);
+void (*sim_sleep_hook)(void);
+
+volatile uint8_t SPCR, SPSR, SPDR;
+
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t TCNT1, OCR1A;
+
+volatile uint8_t TWCR, TWSR, TWDR, TWAR;
+
+// Where the firmware's TWI slave is in a transaction
+static enum { TWI_MODE_IDLE, TWI_MODE_SR, TWI_MODE_ST } twi_mode;
+
+// Tests that don't link keyscanner.c still need this for led_pump()
+__attribute__((weak)) volatile uint8_t do_scan;
+
+// and these for the LED effect engine
+__attribute__((weak)) uint8_t keyscanner_get_state(uint8_t output) {
+    (void)output;
+    return 0;
+}
+
+// and the LED frame interval, on the simulated clock
+__attribute__((weak)) uint16_t keyscanner_get_ticks(void) {
+    return sim_cycles / CYCLES_PER_TIMER_TICK;
+}
+
+// And tests that don't link twi-slave.c this, for the TWI master
+__attribute__((weak)) void TWI_vect(void) {
+}
+
+void sim_reset(void) {
+    SREG = 0;
+    SMCR = 0;
+    PORTB = DDRB = 0;
+    PORTC = DDRC = 0;
+    PORTD = DDRD = 0;
+    memset(sim_matrix, 0, sizeof(sim_matrix));
+    sim_settle_cycles = 0;
+
+    // Transfers complete instantly on the host, so SPIF always reads as set
+    SPCR = SPDR = 0;
+    SPSR = _BV(SPIF);
+
+    TCCR1A = TCCR1B = TIMSK1 = TIFR1 = 0;
+    TCNT1 = OCR1A = 0;
+
+    TWCR = TWSR = TWDR = TWAR = 0;
+    twi_mode = TWI_MODE_IDLE;
+}
+
+/* What the rows and cols read with the given port and direction settings */
+static void matrix_levels(const uint8_t *regs, uint8_t *rows, uint8_t *cols) {
+    const uint8_t port_rows = regs[0], ddr_rows = regs[1], port_cols = regs[2], ddr_cols = regs[3];
+
+    // On its own, a pin reads its output level, or its pull-up (or pull-down)
+    *rows = port_rows;
+    *cols = port_cols;
+
+    for (uint8_t row = 0; row < COUNT_ROWS; row++) {
+        for (uint8_t col = 0; col < COUNT_COLS; col++) {
+            if (!(sim_matrix[row] & _BV(col))) {
+                continue;
+            }
+            // A diode the right way round for the scan mode: an output can
+            // only pull an input away from its idle level, never back to it
+            if ((ddr_rows & _BV(row)) && !(ddr_cols & _BV(col))) {
+                uint8_t idle = port_cols & _BV(col);
+                uint8_t driven = (port_rows & _BV(row)) ? _BV(col) : 0;
+                if (driven != idle) {
+                    *cols ^= _BV(col) & (*cols ^ driven);
+                }
+            } else if ((ddr_cols & _BV(col)) && !(ddr_rows & _BV(row))) {
+                uint8_t idle = port_rows & _BV(row);
+                uint8_t driven = (port_cols & _BV(col)) ? _BV(row) : 0;
+                if (driven != idle) {
+                    *rows ^= _BV(row) & (*rows ^ driven);
+                }
+            }
+        }
+    }
+}
+
+uint8_t sim_read_pins(volatile uint8_t *port) {
+    // Port registers are plain memory, so we only notice a change at the
+    // next read. Firmware changes outputs right after a read, so count the
+    // settle time from the previous read.
+    static uint8_t last_regs[4];
+    static uint8_t settling_from[4];
+    static uint64_t last_read_at, changed_at;
+    uint8_t regs[4] = { PORT_ROWS, DDR_ROWS, PORT_COLS, DDR_COLS };
+    uint8_t rows, cols;
+
+    sim_cycles++;
+    if (memcmp(regs, last_regs, sizeof(regs)) != 0) {
+        memcpy(settling_from, last_regs, sizeof(regs));
+        memcpy(last_regs, regs, sizeof(regs));
+        changed_at = last_read_at;
+    }
+    last_read_at = sim_cycles;
+
+    if (sim_cycles - changed_at < sim_settle_cycles) {
+        matrix_levels(settling_from, &rows, &cols);
+    } else {
+        matrix_levels(regs, &rows, &cols);
+    }
+    sim_interrupt_point();
+
+    if (port == &PORT_ROWS) {
+        return rows;
+    }
+    if (port == &PORT_COLS) {
+        return cols;
+    }
+    return *port;
+}
+
+void sim_delay_cycles(uint32_t cycles) {
+    sim_cycles += cycles;
+    sim_interrupt_point();
+}
+
+void sim_interrupt_point(void) {
+    if (sim_interrupt_hook) {
+        sim_interrupt_hook();
+    }
+}
+
+void sim_sleep(void) {
+    SIM_CHECK(SMCR & _BV(SE), "sleep instruction with sleep disabled");
+    SIM_CHECK(SREG & _BV(SREG_I), "went to sleep with interrupts off, nothing can wake us up");
+    SIM_CHECK(sim_sleep_hook, "went to sleep with nothing to wake us up");
+    sim_sleep_hook();
+}
+
+int sim_spi_step(void) {
+#if defined(LED_TRANSPORT_POLLED)
+    // Only steps a single byte when built with LED_PUMP_BURST_BYTES=1
+    if (led_pump() == 0) {
+        return -1;
+    }
+#else
+    if (!(SPCR & _BV(SPIE))) {
+        return -1;
+    }
+    SPI_STC_vect();
+#endif
+    return SPDR;
+}
+
+uint32_t sim_spi_drain(void) {
+    uint32_t bytes = 0;
+    led_scan_slot();
+    while (sim_spi_step() >= 0) {
+        bytes++;
+    }
+    return bytes;
+}
+
+uint32_t sim_twi_clocks, sim_twi_transactions;
+uint32_t sim_twi_bus_errors, sim_twi_releases, sim_twi_interrupts;
+
+/* The TWI hardware lets go of the bus as soon as the firmware sets TWSTO,
+ * and clears it again. Returns 1 if the slave was addressed until then. */
+static uint8_t twi_sync(void) {
+    uint8_t was_addressed = twi_mode != TWI_MODE_IDLE;
+
+    if ((TWCR & _BV(TWSTO)) || !(TWCR & _BV(TWEN))) {
+        TWCR &= ~_BV(TWSTO);
+        twi_mode = TWI_MODE_IDLE;
+        return was_addressed;
+    }
+    return 0;
+}
+
+static void twi_interrupt(uint8_t status) {
+    TWSR = status;
+    sim_twi_interrupts++;
+    TWI_vect();
+    twi_sync();
+}
+
+uint8_t sim_twi_bus_stuck(void) {
+    if (twi_sync()) {
+        // Not from an interrupt: the firmware gave up on the master
+        sim_twi_releases++;
+    }
+    // A slave transmitter holds SDA low for every 0 bit it has to send
+    return twi_mode == TWI_MODE_ST && TWDR != 0xff;
+}
+
+uint8_t sim_twi_start(void) {
+    if (sim_twi_bus_stuck()) {
+        return 0;
+    }
+    sim_twi_clocks++;
+    if (twi_mode == TWI_MODE_SR) {
+        twi_interrupt(TW_SR_STOP);
+    } else if (twi_mode == TWI_MODE_ST) {
+        // With SDA released between bytes, but not where the slave expects
+        sim_twi_bus_errors++;
+        twi_interrupt(TW_BUS_ERROR);
+    }
+    twi_mode = TWI_MODE_IDLE;
+    return 1;
+}
+
+void sim_twi_stop(void) {
+    if (sim_twi_bus_stuck()) {
+        return;
+    }
+    sim_twi_clocks++;
+    sim_twi_transactions++;
+    if (twi_mode == TWI_MODE_SR) {
+        twi_interrupt(TW_SR_STOP);
+    } else if (twi_mode == TWI_MODE_ST) {
+        sim_twi_bus_errors++;
+        twi_interrupt(TW_BUS_ERROR);
+    }
+    twi_mode = TWI_MODE_IDLE;
+}
+
+void sim_twi_glitch(void) {
+    sim_twi_bus_stuck();
+    if (twi_mode != TWI_MODE_IDLE) {
+        sim_twi_bus_errors++;
+        twi_interrupt(TW_BUS_ERROR);
+    }
+    twi_mode = TWI_MODE_IDLE;
+}
+
+uint8_t sim_twi_address(uint8_t address, uint8_t read) {
+    sim_twi_bus_stuck();
+    sim_twi_clocks += 9;
+    if ((TWCR & (_BV(TWEN) | _BV(TWEA))) != (_BV(TWEN) | _BV(TWEA)) ||
+            (TWAR >> 1) != address || twi_mode != TWI_MODE_IDLE) {
+        return 0;
+    }
+    twi_mode = read ? TWI_MODE_ST : TWI_MODE_SR;
+    twi_interrupt(read ? TW_ST_SLA_ACK : TW_SR_SLA_ACK);
+    return 1;
+}
+
+uint8_t sim_twi_write_byte(uint8_t byte) {
+    uint8_t ack;
+
+    sim_twi_bus_stuck();
+    sim_twi_clocks += 9;
+    if (twi_mode != TWI_MODE_SR) {
+        return 0;
+    }
+    ack = (TWCR & _BV(TWEA)) != 0;
+    TWDR = byte;
+    if (!ack) {
+        // The slave isn't addressed any more
+        twi_mode = TWI_MODE_IDLE;
+    }
+    twi_interrupt(ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK);
+    return ack;
+}
+
+uint8_t sim_twi_read_byte(uint8_t ack) {
+    uint8_t byte, slave_has_more;
+
+    sim_twi_bus_stuck();
+    sim_twi_clocks += 9;
+    if (twi_mode != TWI_MODE_ST) {
+        // Once the slave has sent its last byte, SDA stays released
+        return 0xff;
+    }
+    byte = TWDR;
+    slave_has_more = (TWCR & _BV(TWEA)) != 0;
+    if (!ack || !slave_has_more) {
+        twi_mode = TWI_MODE_IDLE;
+    }
+    if (!ack) {
+        twi_interrupt(TW_ST_DATA_NACK);
+    } else if (slave_has_more) {
+        twi_interrupt(TW_ST_DATA_ACK);
+    } else {
+        twi_interrupt(TW_ST_LAST_DATA);
+    }
+    return byte;
+}
+
+int sim_twi_write(uint8_t address, const uint8_t *buf, uint8_t len, uint8_t repeated_start) {
+    int acked = 0;
+
+    if (!sim_twi_start()) {
+        return -1;
+    }
+    if (!sim_twi_address(address, 0)) {
+        sim_twi_stop();
+        return -1;
+    }
+    while (acked < len && sim_twi_write_byte(buf[acked])) {
+        acked++;
+    }
+    // Otherwise, the START of the next read ends this part
+    if (!repeated_start || acked < len) {
+        sim_twi_stop();
+    }
+    return acked;
+}
+
+int sim_twi_read(uint8_t address, uint8_t *buf, uint8_t len) {
+    if (!sim_twi_start()) {
+        return -1;
+    }
+    if (!sim_twi_address(address, 1)) {
+        sim_twi_stop();
+        return -1;
+    }
+    for (uint8_t i = 0; i < len; i++) {
+        // We ACK every byte but the last
+        buf[i] = sim_twi_read_byte(i + 1 < len);
+    }
+    sim_twi_stop();
+    return len;
+}
+
+static uint32_t sim_rand_state = 1;
+
+void sim_srand(uint32_t seed) {
+    sim_rand_state = seed ? seed : 1;
+}
+
+uint32_t sim_rand(void) {
+    // xorshift32
+    uint32_t x = sim_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return sim_rand_state = x;
+}
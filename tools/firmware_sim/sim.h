@@ -0,0 +1,107 @@
+/* Host-side simulator for the keyscanner firmware
+ *
+ * The firmware sources are compiled unmodified against the headers in mock/,
+ * and the simulator plays the part of the hardware: it owns the registers and
+ * decides when each interrupt handler runs.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/* Reset every register to its power-on value */
+void sim_reset(void);
+
+/* If the SPI transfer complete interrupt is enabled, run it once and
+ * return the byte it queued. Returns -1 when LED writes are disabled.
+ * With LED_TRANSPORT_POLLED, pumps once instead. */
+int sim_spi_step(void);
+
+/* Gives the LEDs a scan slot, then sends out the frame that starts there.
+ * Returns the number of bytes sent. */
+uint32_t sim_spi_drain(void);
+
+/* Keys held down on the simulated matrix, one byte per row, one bit per col.
+ *
+ * Pins read what they're driven to as outputs, or what their pull-up (or,
+ * with the pull-up off, an external pull-down) makes them as inputs. A
+ * pressed key connects its row and col pins through a diode that points the
+ * right way for the scan mode: an input reads the active level when any
+ * output connected to it drives that level. */
+extern uint8_t sim_matrix[COUNT_ROWS];
+
+/* The simulated clock. Only delays, pin reads (1 cycle each) and the hooks
+ * below advance it. */
+extern uint64_t sim_cycles;
+
+/* How long the matrix takes to settle: until this many cycles after an
+ * output changes, inputs still read what they did before the change. */
+extern uint32_t sim_settle_cycles;
+
+/* The master side of a TWI bus, with the firmware's TWI slave on it.
+ *
+ * Each call is one part of a transaction, played byte by byte through
+ * TWI_vect the way the TWI hardware does it: the slave only ACKs (its
+ * address, or a byte it receives) while its TWCR has TWEN and TWEA set, and
+ * it lets go of the bus whenever the firmware sets TWSTO. sim_twi_write()
+ * ends with a STOP, or with the repeated START of a sim_twi_read() that
+ * follows in the same transaction: the slave sees both as TW_SR_STOP.
+ *
+ * sim_twi_write() returns the number of bytes the slave ACKed, and
+ * sim_twi_read() the number of bytes read, or -1 when the slave didn't ACK
+ * its address (or the bus was stuck). sim_twi_clocks counts SCL clocks: 9
+ * per byte with its ACK, one each for START and STOP, and
+ * sim_twi_transactions counts STOPs. */
+int sim_twi_write(uint8_t address, const uint8_t *buf, uint8_t len, uint8_t repeated_start);
+int sim_twi_read(uint8_t address, uint8_t *buf, uint8_t len);
+extern uint32_t sim_twi_clocks, sim_twi_transactions;
+
+/* The same, one bus condition or byte at a time, in any order a broken
+ * master could put them in.
+ *
+ * sim_twi_start() returns 0 if it couldn't, and sim_twi_stop() does nothing,
+ * while the slave is holding SDA low in the middle of sending a byte
+ * (sim_twi_bus_stuck()). A START or STOP
+ * that comes while the slave is sending, and sim_twi_glitch() (a START or
+ * STOP in the middle of a byte) while it's addressed at all, are bus errors
+ * to the slave, counted in sim_twi_bus_errors. sim_twi_releases counts the
+ * times the firmware let go of the bus in the middle of a transaction
+ * other than from TWI_vect, as seen by sim_twi_bus_stuck(), and
+ * sim_twi_interrupts the calls to TWI_vect. */
+uint8_t sim_twi_start(void);
+uint8_t sim_twi_address(uint8_t address, uint8_t read);
+uint8_t sim_twi_write_byte(uint8_t byte);
+uint8_t sim_twi_read_byte(uint8_t ack);
+void sim_twi_stop(void);
+void sim_twi_glitch(void);
+uint8_t sim_twi_bus_stuck(void);
+extern uint32_t sim_twi_bus_errors, sim_twi_releases, sim_twi_interrupts;
+
+/* Where interrupts come in.
+ *
+ * sim_interrupt_hook gets called at every point where the firmware could be
+ * interrupted: pin reads, delays, cli(), the end of an ATOMIC_BLOCK and
+ * sleep_enable()/sleep_disable(). It gets called whether interrupts are on
+ * or not, so it can keep its timers up to date, but it must only run
+ * handlers while SREG_I is set, and clear it while they run.
+ *
+ * sleep_cpu() calls sim_sleep_hook, which should move sim_cycles on to the
+ * next interrupt and run it. */
+extern void (*sim_interrupt_hook)(void);
+extern void (*sim_sleep_hook)(void);
+
+/* Small deterministic PRNG, so failures are reproducible from the seed */
+void sim_srand(uint32_t seed);
+uint32_t sim_rand(void);
+
+#define SIM_CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        exit(1); \
+    } \
+} while (0)
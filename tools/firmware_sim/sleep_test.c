@@ -0,0 +1,225 @@
+/* Runs the real main loop, with sleep, against simulated interrupts
+ *
+ * main.c is built with its main() renamed to firmware_main(), and runs as is:
+ * the simulator plays timer1, the SPI transfers and a TWI master writing LED
+ * banks at random times, and runs their handlers at the interrupt points the
+ * mocks provide (see sim_interrupt_hook). Whenever the firmware sleeps, time
+ * jumps to the next interrupt.
+ *
+ * Timer1 and SPI work as on the AVR: a compare match or a finished byte sets
+ * a flag, and the handler runs at the next point with interrupts on. Every
+ * compare match has to find the last scan done, and must not come in while
+ * the last one is still waiting for its handler. The firmware must never
+ * sleep with a scan to do (or, with LED_TRANSPORT_POLLED, a frame to send).
+ *
+ * Usage: sleep-test [seed]
+ */
+#include <setjmp.h>
+#include "sim.h"
+#include "cycles.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "wire-protocol.h"
+
+#define SIM_CYCLES (F_CPU / 2)
+
+/* The master writes a bank every this many cycles at most (~1ms) */
+#define TWI_EVERY_CYCLES 8000
+
+/* One bank write as the interrupt that takes its last byte, which copies the
+ * bank into the LED buffer */
+#define CYCLES_TWI_BANK 200
+
+int firmware_main(void);
+uint8_t __real_keyscanner_main(void);
+#if defined(LED_TRANSPORT_POLLED)
+uint8_t __real_led_pump(void);
+#endif
+
+static jmp_buf done;
+
+static uint64_t timer_start;
+static uint16_t tcnt1_seen;
+static uint8_t compare_pending;
+static uint64_t compare_at;
+static uint64_t spi_ready_at;
+static uint64_t next_twi;
+
+static uint32_t compares, scans, sleeps, twi_writes, spi_bytes;
+static uint64_t cycles_asleep;
+static uint32_t min_scan_latency = UINT32_MAX, max_scan_latency;
+
+void twi_init(void) {
+}
+
+void twi_watchdog(void) {
+}
+
+static uint16_t spi_byte_cycles(void) {
+    for (uint8_t i = 0; i < NUM_SPI_FREQUENCIES; i++) {
+        if (spi_frequencies[i].setting == led_get_spi_frequency()) {
+            return spi_frequencies[i].byte_cycles;
+        }
+    }
+    return spi_frequencies[0].byte_cycles;
+}
+
+static uint64_t next_compare(void) {
+    return timer_start + (uint64_t)(OCR1A + 1) * CYCLES_PER_TIMER_TICK;
+}
+
+/* Brings TCNT1 up to date, and sets the compare flag when it's time */
+static void sync_timer(void) {
+    if (!(TCCR1B & _BV(CS12))) {
+        timer_start = sim_cycles;
+        TCNT1 = tcnt1_seen = 0;
+        return;
+    }
+    if (TCNT1 != tcnt1_seen) {
+        // The firmware moved the counter
+        timer_start = sim_cycles - (uint64_t)TCNT1 * CYCLES_PER_TIMER_TICK;
+    }
+    while (sim_cycles >= next_compare()) {
+        SIM_CHECK(!compare_pending, "compare match at cycle %llu with the last one still pending",
+                  (unsigned long long)next_compare());
+        SIM_CHECK(!do_scan, "compare match at cycle %llu with the last scan not done",
+                  (unsigned long long)next_compare());
+        timer_start = next_compare();
+        compare_at = timer_start;
+        compare_pending = 1;
+        compares++;
+    }
+    TCNT1 = tcnt1_seen = (sim_cycles - timer_start) / CYCLES_PER_TIMER_TICK;
+}
+
+static void run_handler(void (*handler)(void), uint32_t cycles) {
+    SREG &= ~_BV(SREG_I);
+    sim_cycles += cycles;
+    handler();
+    SREG |= _BV(SREG_I);
+}
+
+static void twi_bank_write(void) {
+    uint8_t buf[LED_BANK_SIZE];
+    for (uint8_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = sim_rand();
+    }
+    led_update_bank(buf, sim_rand() % (NUM_LED_BANKS));
+    twi_writes++;
+}
+
+static void spi_byte_done(void) {
+#if !defined(LED_TRANSPORT_POLLED)
+    SPI_STC_vect();
+#endif
+    spi_bytes++;
+}
+
+/* Runs every interrupt that's due, in the AVR's priority order */
+static void deliver_interrupts(void) {
+    sync_timer();
+    while (SREG & _BV(SREG_I)) {
+        if (compare_pending) {
+            compare_pending = 0;
+            run_handler(TIMER1_COMPA_vect, CYCLES_TIMER_ISR);
+        } else if ((SPCR & _BV(SPIE)) && sim_cycles >= spi_ready_at) {
+            run_handler(spi_byte_done, CYCLES_LED_ISR);
+            spi_ready_at = sim_cycles + spi_byte_cycles();
+        } else if (sim_cycles >= next_twi) {
+            run_handler(twi_bank_write, CYCLES_TWI_BANK);
+            next_twi = sim_cycles + 1 + sim_rand() % TWI_EVERY_CYCLES;
+        } else {
+            break;
+        }
+        sync_timer();
+    }
+}
+
+static void sleep_until_interrupt(void) {
+    uint64_t wake;
+
+    SIM_CHECK(!do_scan, "went to sleep at cycle %llu with a scan to do",
+              (unsigned long long)sim_cycles);
+#if defined(LED_TRANSPORT_POLLED)
+    // Don't let any interrupts in while we look
+    sim_interrupt_hook = NULL;
+    SIM_CHECK(__real_led_pump() == 0, "went to sleep at cycle %llu in the middle of an LED frame",
+              (unsigned long long)sim_cycles);
+    sim_interrupt_hook = deliver_interrupts;
+#endif
+    sleeps++;
+
+    wake = next_compare();
+    if ((SPCR & _BV(SPIE)) && spi_ready_at < wake) {
+        wake = spi_ready_at;
+    }
+    if (next_twi < wake) {
+        wake = next_twi;
+    }
+    if (wake > sim_cycles) {
+        cycles_asleep += wake - sim_cycles;
+        sim_cycles = wake;
+    }
+    if (sim_cycles >= SIM_CYCLES) {
+        longjmp(done, 1);
+    }
+    deliver_interrupts();
+}
+
+uint8_t __wrap_keyscanner_main(void) {
+    // Once around the main loop
+    sim_cycles += CYCLES_MAIN_LOOP;
+    // The scan at power on doesn't have a compare match
+    if (do_scan && compares) {
+        uint32_t latency = sim_cycles - compare_at;
+        if (latency < min_scan_latency) {
+            min_scan_latency = latency;
+        }
+        if (latency > max_scan_latency) {
+            max_scan_latency = latency;
+        }
+        scans++;
+        sim_cycles += CYCLES_KEYSCAN;
+    }
+    return __real_keyscanner_main();
+}
+
+#if defined(LED_TRANSPORT_POLLED)
+uint8_t __wrap_led_pump(void) {
+    uint8_t sent = __real_led_pump();
+    sim_cycles += sent * CYCLES_LED_PUMP_BYTE;
+    spi_bytes += sent;
+    return sent;
+}
+#endif
+
+int main(int argc, char **argv) {
+    sim_srand(argc > 1 ? strtoul(argv[1], NULL, 0) : 1);
+    sim_reset();
+    HIGH(PORTC, 7);
+    SET_OUTPUT(DDRC, 7);
+    next_twi = sim_rand() % TWI_EVERY_CYCLES;
+
+    sim_interrupt_hook = deliver_interrupts;
+    sim_sleep_hook = sleep_until_interrupt;
+    if (setjmp(done) == 0) {
+        firmware_main();
+    }
+    sim_interrupt_hook = NULL;
+    sim_sleep_hook = NULL;
+
+    // The last compare match can still be waiting for its scan
+    SIM_CHECK(scans + 1 >= compares && scans <= compares,
+              "%u scans for %u compare matches", scans, compares);
+    SIM_CHECK(sleeps > 0, "never went to sleep");
+    SIM_CHECK(twi_writes > 0 && spi_bytes > 0, "no LED traffic");
+
+    printf("ok - %u scans for %u compare matches, none missed\n", scans, compares);
+    printf("ok - slept %u times, %.1f%% of %.0fms\n", sleeps,
+           100.0 * cycles_asleep / sim_cycles, sim_cycles * 1000.0 / F_CPU);
+    printf("ok - %u LED bank writes, %u LED bytes out\n", twi_writes, spi_bytes);
+    printf("ok - scans started %u to %u cycles after their compare match\n",
+           min_scan_latency, max_scan_latency);
+    return 0;
+}
@@ -0,0 +1,182 @@
+/* Plays a broken TWI master against twi-slave.c
+ *
+ * Each round is a run of random bus conditions and bytes (see
+ * sim_twi_start() and the rest): STARTs and STOPs anywhere, reads that stop
+ * in the middle of a byte the slave is sending, NACKs, START or STOP
+ * conditions in the middle of a byte, other addresses, writes that run past
+ * the slave's buffer, and pauses of up to twice TWI_WATCHDOG_TIMEOUT_US.
+ * Time runs in timer1 ticks, with the main loop calling twi_watchdog() after
+ * every scan. Checks that:
+ * - the slave never holds the bus for longer than the watchdog timeout and
+ *   two scans after the last TWI interrupt
+ * - it only gives up on a master that's been quiet for the whole timeout
+ * - a clean register read works at the end of every round
+ * - the bus error and watchdog reset counts in TWI_CMD_STATUS are the ones
+ *   the bus saw
+ *
+ * Writes only send commands that read something, so the master doesn't
+ * change the keyscan interval the watchdog runs on.
+ *
+ * Usage: twi-fuzz-test [seed]
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "wire-protocol.h"
+#include "twi-slave.h"
+
+#define ADDRESS TWI_BASE_ADDRESS
+
+#define ROUNDS 20000
+#define MAX_STEPS 24
+
+/* One byte with its ACK at 100kHz, in ticks (~90us) */
+#define BYTE_TICKS 3
+
+#define TIMEOUT_TICKS KEYSCAN_US_TO_TICKS(TWI_WATCHDOG_TIMEOUT_US)
+
+static uint32_t now;
+static uint32_t interrupts, last_interrupt;
+static uint32_t longest_stuck;
+
+/* Passes time, with the main loop's watchdog after every scan */
+static void pass(uint32_t ticks) {
+    while (ticks--) {
+        uint32_t releases = sim_twi_releases;
+
+        // Interrupts from the steps since the last tick
+        if (sim_twi_interrupts != interrupts) {
+            interrupts = sim_twi_interrupts;
+            last_interrupt = now;
+        }
+        now++;
+        keyscan_ticks = now;
+        if (now % (OCR1A + 1) != 0) {
+            continue;
+        }
+        twi_watchdog();
+        if (sim_twi_bus_stuck()) {
+            uint32_t stuck = now - last_interrupt;
+            SIM_CHECK(stuck < TIMEOUT_TICKS + 2 * (OCR1A + 1u),
+                      "the bus has been stuck for %u ticks", stuck);
+            if (stuck > longest_stuck) {
+                longest_stuck = stuck;
+            }
+        }
+        SIM_CHECK(sim_twi_releases == releases || now - last_interrupt >= TIMEOUT_TICKS,
+                  "gave up on the master %u ticks after the last interrupt", now - last_interrupt);
+    }
+}
+
+static uint8_t random_command(void) {
+    static const uint8_t commands[] = {
+        TWI_CMD_NONE, TWI_CMD_VERSION, TWI_CMD_KEYSCAN_INTERVAL, TWI_CMD_KEYDATA_SIZE,
+        TWI_CMD_KEYSCAN_TICKS, TWI_CMD_STATUS
+    };
+    return commands[sim_rand() % sizeof(commands)];
+}
+
+static void step(void) {
+    switch (sim_rand() % 11) {
+    case 0:
+        sim_twi_start();
+        break;
+    case 1:
+        // Mostly to us, and mostly reads, where the slave drives SDA
+        sim_twi_address(sim_rand() % 4 ? ADDRESS : ADDRESS + 1, sim_rand() % 3 != 0);
+        pass(BYTE_TICKS);
+        break;
+    case 2:
+        sim_twi_write_byte(random_command());
+        pass(BYTE_TICKS);
+        break;
+    case 3:
+    case 4:
+        sim_twi_read_byte(sim_rand() % 2);
+        pass(BYTE_TICKS);
+        break;
+    case 5:
+        sim_twi_stop();
+        break;
+    case 6:
+        sim_twi_glitch();
+        break;
+    case 7:
+    case 8:
+        pass(sim_rand() % (OCR1A + 1));
+        break;
+    case 9:
+        // The master went away, and may come back
+        pass(sim_rand() % (2 * TIMEOUT_TICKS));
+        break;
+    case 10:
+        // More than the slave has room for
+        for (uint8_t i = sim_rand() % 16; i < TWI_BUFFER_SIZE + 4; i++) {
+            sim_twi_write_byte(random_command());
+        }
+        pass((TWI_BUFFER_SIZE + 4) * BYTE_TICKS);
+        break;
+    }
+}
+
+/* Writes a command and reads its reply with a repeated START */
+static int read_register(uint8_t command, uint8_t *buf, uint8_t len) {
+    if (sim_twi_write(ADDRESS, &command, 1, 1) != 1) {
+        return 0;
+    }
+    pass(2 * BYTE_TICKS);
+    if (sim_twi_read(ADDRESS, buf, len) != len) {
+        return 0;
+    }
+    pass(len * BYTE_TICKS);
+    return 1;
+}
+
+static uint8_t saturated(uint32_t count) {
+    return count < 0xff ? count : 0xff;
+}
+
+int main(int argc, char **argv) {
+    uint8_t status[TWI_STATUS_SIZE];
+    uint8_t version;
+
+    sim_srand(argc > 1 ? strtoul(argv[1], NULL, 0) : 1);
+    sim_reset();
+    led_init();
+    keyscanner_init();
+    twi_init();
+
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        uint32_t steps = 1 + sim_rand() % MAX_STEPS;
+
+        while (steps--) {
+            step();
+        }
+
+        // The master gets its act together, and waits out a stuck bus
+        if (!sim_twi_bus_stuck()) {
+            sim_twi_stop();
+        }
+        while (sim_twi_bus_stuck()) {
+            pass(1);
+        }
+        SIM_CHECK(read_register(TWI_CMD_VERSION, &version, 1) && version == DEVICE_VERSION,
+                  "round %u: no clean read after the bus came back", round);
+        SIM_CHECK(read_register(TWI_CMD_STATUS, status, sizeof(status)), "round %u: status read NACKed", round);
+        SIM_CHECK(status[TWI_STATUS_TWI_BUS_ERRORS] == saturated(sim_twi_bus_errors),
+                  "round %u: %u bus errors, the status says %u",
+                  round, sim_twi_bus_errors, status[TWI_STATUS_TWI_BUS_ERRORS]);
+        SIM_CHECK(status[TWI_STATUS_TWI_WATCHDOG_RESETS] == saturated(sim_twi_releases),
+                  "round %u: %u watchdog resets, the status says %u",
+                  round, sim_twi_releases, status[TWI_STATUS_TWI_WATCHDOG_RESETS]);
+    }
+    SIM_CHECK(sim_twi_bus_errors > 0 && sim_twi_releases > 0, "the fuzzing never got anywhere");
+
+    printf("ok - %u rounds, a clean read after every one\n", ROUNDS);
+    printf("ok - %u bus errors, %u watchdog resets, counted right\n", sim_twi_bus_errors, sim_twi_releases);
+    printf("ok - the bus was stuck for %.1fms at most, for a %.1fms timeout\n",
+           longest_stuck * 0.032, TWI_WATCHDOG_TIMEOUT_US / 1000.0);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/* Runs TWI transactions through twi-slave.c and wire-protocol.c
+ *
+ * The simulated master (see sim_twi_write()) plays the bus. Checks that a
+ * register read works as one transaction, a write of the command and a
+ * repeated START to read the reply, as well as the old way with a STOP in
+ * between. Then compares what a master's boot time queries cost on the bus,
+ * one register at a time and with TWI_CMD_STATUS, and checks that writes of
+ * the commands this build leaves out get NACKed, as its capabilities say.
+ */
+#include <string.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "ringbuf.h"
+#include "wire-protocol.h"
+
+#define ADDRESS TWI_BASE_ADDRESS
+
+/* Writes a command, then reads len bytes of its reply, in one transaction
+ * or in two */
+static void read_register(uint8_t command, uint8_t *buf, uint8_t len, uint8_t repeated_start) {
+    SIM_CHECK(sim_twi_write(ADDRESS, &command, 1, repeated_start) == 1, "command 0x%02x NACKed", command);
+    SIM_CHECK(sim_twi_read(ADDRESS, buf, len) == len, "reply to 0x%02x NACKed", command);
+}
+
+static uint8_t read_byte(uint8_t command, uint8_t repeated_start) {
+    uint8_t value;
+    read_register(command, &value, 1, repeated_start);
+    return value;
+}
+
+static void write_register(uint8_t command, uint8_t value) {
+    uint8_t buf[2] = { command, value };
+    SIM_CHECK(sim_twi_write(ADDRESS, buf, 2, 0) == 2, "write to 0x%02x NACKed", command);
+}
+
+/* Commands that need a capability, and one that doesn't */
+static void check_capabilities(void) {
+    static const struct {
+        uint8_t command;
+        uint8_t capability;
+    } commands[] = {
+        { TWI_CMD_LED_SET_PALETTE, TWI_CAPABILITY_LED_PALETTE },
+        { TWI_CMD_LED_UPDATE_INDEXED, TWI_CAPABILITY_LED_PALETTE },
+        { TWI_CMD_LED_SET_RUNS, TWI_CAPABILITY_LED_PALETTE },
+        { TWI_CMD_LED_EFFECT, TWI_CAPABILITY_LED_EFFECTS },
+        { TWI_CMD_LED_GAMMA, 0 },
+    };
+    uint8_t status[TWI_STATUS_SIZE];
+    uint8_t refused = 0;
+
+    read_register(TWI_CMD_STATUS, status, sizeof(status), 1);
+    for (uint8_t i = 0; i < sizeof(commands) / sizeof(*commands); i++) {
+        uint8_t buf[1 + 2 * LED_DATA_SIZE] = { commands[i].command };
+        uint8_t supported = !commands[i].capability || (status[TWI_STATUS_CAPABILITIES] & commands[i].capability);
+        int acked = sim_twi_write(ADDRESS, buf, sizeof(buf), 0);
+
+        SIM_CHECK(acked == (supported ? (int)sizeof(buf) : 1), "command 0x%02x: %d bytes ACKed, with capabilities 0x%02x",
+                  commands[i].command, acked, status[TWI_STATUS_CAPABILITIES]);
+        refused += !supported;
+        // Still there for the next transaction
+        SIM_CHECK(read_byte(TWI_CMD_VERSION, 0) == DEVICE_VERSION, "version after command 0x%02x", commands[i].command);
+    }
+#if !defined(LED_PALETTE) && !defined(LED_EFFECTS)
+    SIM_CHECK(refused == 4, "the palette or effect commands taken without LED_PALETTE and LED_EFFECTS");
+#endif
+    printf("ok - capabilities 0x%02x, %u commands NACKed after the command byte\n",
+           status[TWI_STATUS_CAPABILITIES], refused);
+}
+
+int main(void) {
+    static const uint8_t boot_queries[] = {
+        TWI_CMD_VERSION, TWI_CMD_KEYSCAN_INTERVAL, TWI_CMD_KEYSCAN_IDLE_INTERVAL,
+        TWI_CMD_KEYSCAN_SETTLE_DELAY, TWI_CMD_LED_SPI_FREQUENCY, TWI_CMD_LED_FRAME_INTERVAL,
+        TWI_CMD_KEYDATA_SIZE
+    };
+    uint8_t status[TWI_STATUS_SIZE];
+    uint8_t report[1 + KEY_REPORT_BYTES];
+    uint32_t one_at_a_time, combined, in_status;
+    uint32_t one_at_a_time_transactions, combined_transactions;
+
+    sim_reset();
+    led_init();
+    keyscanner_init();
+    twi_init();
+    keyscanner_main();
+
+    SIM_CHECK(sim_twi_read(ADDRESS + 1, report, 1) == -1, "answered another address");
+
+    for (uint8_t repeated_start = 0; repeated_start < 2; repeated_start++) {
+        const char *how = repeated_start ? "with a repeated START" : "in two transactions";
+
+        SIM_CHECK(read_byte(TWI_CMD_VERSION, repeated_start) == DEVICE_VERSION, "version %s", how);
+        write_register(TWI_CMD_KEYSCAN_INTERVAL, 20 + repeated_start);
+        SIM_CHECK(read_byte(TWI_CMD_KEYSCAN_INTERVAL, repeated_start) == 20 + repeated_start,
+                  "keyscan interval %s", how);
+        SIM_CHECK(read_byte(TWI_CMD_KEYDATA_SIZE, repeated_start) == KEY_REPORT_BYTES, "keydata size %s", how);
+
+        // Key data, after a command that asks for it
+        sim_matrix[1] = _BV(3);
+        while (ringbuf_empty()) {
+            TIMER1_COMPA_vect();
+            keyscanner_main();
+        }
+        read_register(TWI_CMD_NONE, report, sizeof(report), repeated_start);
+        SIM_CHECK(report[0] == TWI_REPLY_KEYDATA && report[2] == _BV(3), "key data %s", how);
+        read_register(TWI_CMD_NONE, report, sizeof(report), repeated_start);
+        SIM_CHECK(report[0] == TWI_REPLY_NONE, "no key data %s", how);
+        sim_matrix[1] = 0;
+        while (ringbuf_empty()) {
+            TIMER1_COMPA_vect();
+            keyscanner_main();
+        }
+        ringbuf_pop_to(report);
+        while (!ringbuf_empty()) {
+            ringbuf_pop();
+        }
+    }
+    printf("ok - register reads with a repeated START or a STOP in between\n");
+
+    // A command with more than a byte (a write) doesn't leave a read behind
+    write_register(TWI_CMD_LED_FRAME_INTERVAL, 3);
+    read_register(TWI_CMD_STATUS, status, sizeof(status), 1);
+    SIM_CHECK(status[TWI_STATUS_VERSION] == DEVICE_VERSION, "status: version");
+    SIM_CHECK(status[TWI_STATUS_KEYSCAN_INTERVAL] == keyscanner_get_interval(), "status: keyscan interval");
+    SIM_CHECK(status[TWI_STATUS_KEYSCAN_IDLE_INTERVAL] == keyscanner_get_idle_interval(), "status: idle interval");
+    SIM_CHECK(status[TWI_STATUS_KEYSCAN_SETTLE_DELAY] == keyscanner_get_settle_delay(), "status: settle delay");
+    SIM_CHECK(status[TWI_STATUS_LED_SPI_FREQUENCY] == led_get_spi_frequency(), "status: SPI frequency");
+    SIM_CHECK(status[TWI_STATUS_LED_FRAME_INTERVAL] == 3, "status: frame interval");
+    SIM_CHECK(status[TWI_STATUS_KEYDATA_SIZE] == KEY_REPORT_BYTES, "status: keydata size");
+    SIM_CHECK(status[TWI_STATUS_KEY_REPORTS_QUEUED] == 0, "status: reports queued");
+    SIM_CHECK(status[TWI_STATUS_KEY_REPORTS_DROPPED] == 0, "status: reports dropped");
+    printf("ok - TWI_CMD_STATUS reads %u bytes of registers\n", TWI_STATUS_SIZE);
+
+    // What a master asks at boot, each way
+    sim_twi_clocks = sim_twi_transactions = 0;
+    for (uint8_t i = 0; i < sizeof(boot_queries); i++) {
+        read_byte(boot_queries[i], 0);
+    }
+    one_at_a_time = sim_twi_clocks;
+    one_at_a_time_transactions = sim_twi_transactions;
+    sim_twi_clocks = sim_twi_transactions = 0;
+    for (uint8_t i = 0; i < sizeof(boot_queries); i++) {
+        read_byte(boot_queries[i], 1);
+    }
+    combined = sim_twi_clocks;
+    combined_transactions = sim_twi_transactions;
+    sim_twi_clocks = sim_twi_transactions = 0;
+    read_register(TWI_CMD_STATUS, status, sizeof(status), 1);
+    in_status = sim_twi_clocks;
+    SIM_CHECK(combined_transactions * 2 == one_at_a_time_transactions && sim_twi_transactions == 1,
+              "%u transactions, %u with repeated STARTs", one_at_a_time_transactions, combined_transactions);
+    SIM_CHECK(combined < one_at_a_time && in_status < combined, "no savings on the bus");
+    printf("ok - %u boot time registers: %u transactions and %u SCL clocks one at a time, "
+           "%u and %u with repeated STARTs, 1 and %u with TWI_CMD_STATUS\n",
+           (unsigned)sizeof(boot_queries), one_at_a_time_transactions, one_at_a_time,
+           combined_transactions, combined, in_status);
+
+    check_capabilities();
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* Times the TWI command decoder on the host
+ *
+ * Runs each kind of write through twi_data_received() the way twi-slave.c
+ * hands it over, and reports commands per second. An LED bank update, the
+ * command a master sends most, is the one to watch: checks added to the
+ * decoder must not slow it down. Its scaled row is the same update with
+ * led_set_brightness_scale() on, which only marks the LEDs for the main
+ * loop to scale, and has to stay close to the unscaled one. Host numbers only compare builds of the
+ * decoder with each other; see `make disasm` in firmware/ for AVR cycles.
+ *
+ * Then counts the bytes a master puts on the bus per frame of two
+ * animations, with each way of updating the LEDs: every LED changing color
+ * (a rainbow going round), and a couple of LEDs changing (keys lighting up
+ * as they're typed). Each transaction costs its address byte too.
+ */
+// For clock_gettime() under -std=c11
+#define _POSIX_C_SOURCE 199309L
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "twi-slave.h"
+#include "wire-protocol.h"
+
+#define COMMANDS 2000000
+
+/* Run a frame out now and then, so the LED buffers don't stay clean */
+#define FRAME_EVERY_COMMANDS 64
+
+#define ANIMATION_FRAMES 64
+
+typedef struct {
+    const char *name;
+    uint8_t buf[TWI_BUFFER_SIZE];
+    uint8_t size;
+    uint8_t reads;
+    uint8_t scaled;
+} command_t;
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double run(command_t *command) {
+    uint8_t reply[TWI_BUFFER_SIZE];
+    double start, rate;
+
+    led_set_brightness_scale(command->scaled ? 127 : LED_BRIGHTNESS_SCALE_MAX);
+    start = seconds();
+    for (uint32_t i = 0; i < COMMANDS; i++) {
+        // The bytes change every time, as LED data would
+        if (command->size > 1) {
+            command->buf[command->size - 1] = i;
+        }
+        if (command->buf[0] >= TWI_CMD_LED_BASE) {
+            command->buf[0] = TWI_CMD_LED_BASE | (i % NUM_LED_BANKS);
+        }
+        twi_data_received(command->buf, command->size);
+        if (command->reads) {
+            uint8_t reply_size = sizeof(reply);
+            twi_data_requested(reply, &reply_size);
+        }
+        if (i % FRAME_EVERY_COMMANDS == 0) {
+            sim_spi_drain();
+        }
+    }
+    rate = COMMANDS / (seconds() - start);
+    led_set_brightness_scale(LED_BRIGHTNESS_SCALE_MAX);
+    return rate;
+}
+
+/* Palette indices for each LED in each frame */
+static void rainbow(uint8_t frame, uint8_t *leds) {
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        leds[led] = (led + frame) % LED_PALETTE_SIZE;
+    }
+}
+
+static void typing(uint8_t frame, uint8_t *leds) {
+    memset(leds, 0, NUM_LEDS);
+    leds[frame * 7 % NUM_LEDS] = 1;
+    leds[frame * 13 % NUM_LEDS] = 2;
+}
+
+/* Bus bytes for a frame that changes `from` into `to`, each way */
+static void count_bytes(const uint8_t *from, const uint8_t *to, uint32_t *bytes) {
+    uint8_t first = NUM_LEDS, last = 0, runs = 0;
+
+    for (uint8_t led = 0; led < NUM_LEDS; led++) {
+        if (from[led] != to[led]) {
+            if (first == NUM_LEDS) {
+                first = led;
+            }
+            last = led;
+            // A run goes on while the LEDs change to the same color
+            runs += led == 0 || from[led - 1] == to[led - 1] || to[led - 1] != to[led];
+        }
+    }
+    if (first == NUM_LEDS) {
+        return;
+    }
+    for (uint8_t bank = 0; bank < NUM_LED_BANKS; bank++) {
+        if (first / NUM_LEDS_PER_BANK <= bank && bank <= last / NUM_LEDS_PER_BANK) {
+            bytes[0] += 1 + 1 + LED_BANK_SIZE;
+        }
+    }
+    bytes[1] += 1 + 1 + LED_BUFSZ;
+    bytes[2] += 1 + 2 + (last - first + 2) / 2;
+    bytes[3] += 1 + 1 + runs * 3;
+}
+
+static void animation_bytes(const char *name, void (*animation)(uint8_t, uint8_t *)) {
+    uint8_t from[NUM_LEDS], to[NUM_LEDS];
+    uint32_t bytes[4] = { 0 };
+
+    animation(0, from);
+    for (uint8_t frame = 1; frame <= ANIMATION_FRAMES; frame++) {
+        animation(frame, to);
+        count_bytes(from, to, bytes);
+        memcpy(from, to, sizeof(from));
+    }
+    printf("%-20s", name);
+    for (uint8_t i = 0; i < 4; i++) {
+        printf(" %10.1f", (double)bytes[i] / ANIMATION_FRAMES);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    static command_t commands[] = {
+        { "LED bank update", { TWI_CMD_LED_BASE }, 1 + LED_BANK_SIZE, 0, 0 },
+        { "LED bank, scaled", { TWI_CMD_LED_BASE }, 1 + LED_BANK_SIZE, 0, 1 },
+        { "LED update all", { TWI_CMD_LED_UPDATE_ALL }, 1 + LED_BUFSZ, 0, 0 },
+        { "LED set one", { TWI_CMD_LED_SET_ONE_TO, 5 }, 5, 0, 0 },
+        { "LED set all", { TWI_CMD_LED_SET_ALL_TO }, 4, 0, 0 },
+        { "global brightness", { TWI_CMD_LED_GLOBAL_BRIGHTNESS }, 2, 0, 0 },
+        { "LED indexed update", { TWI_CMD_LED_UPDATE_INDEXED, 0 }, 2 + NUM_LEDS / 2, 0, 0 },
+        { "LED runs, 2 LEDs", { TWI_CMD_LED_SET_RUNS, 3, 1, 5, 20, 1, 7 }, 7, 0, 0 },
+        { "key data read", { TWI_CMD_NONE }, 1, 1, 0 },
+        { "status read", { TWI_CMD_STATUS }, 1, 1, 0 },
+    };
+
+    sim_reset();
+    led_init();
+    keyscanner_init();
+    twi_init();
+
+    printf("%-20s %14s %10s\n", "command", "commands/s", "ns each");
+    for (uint8_t i = 0; i < sizeof(commands) / sizeof(*commands); i++) {
+        double rate = run(&commands[i]);
+        printf("%-20s %14.0f %10.1f\n", commands[i].name, rate, 1e9 / rate);
+    }
+
+    // The palette goes over once, up front
+    printf("\nbus bytes per frame, after a %u byte palette:\n", 1 + 2 + LED_PALETTE_SIZE * LED_DATA_SIZE);
+    printf("%-20s %10s %10s %10s %10s\n", "animation", "banks", "all", "indexed", "runs");
+    animation_bytes("rainbow", rainbow);
+    animation_bytes("typing", typing);
+    return 0;
+}
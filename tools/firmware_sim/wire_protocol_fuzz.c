@@ -0,0 +1,154 @@
+/* Fuzz target for the TWI command decoder in wire-protocol.c
+ *
+ * An input is a run of TWI transactions: a length byte, that many bytes the
+ * master writes (fewer at the end of the input), then a read of the reply.
+ * led-spiout.c, keyscanner.c and ringbuf.c sit behind the decoder, and a
+ * scan, a step of the LED effect and an LED frame run between transactions,
+ * with the length byte also flipping a key. Each write goes to
+ * twi_data_received() in a buffer just the size of what was sent, so a
+ * sanitizer build catches the decoder reading past the end of a transfer,
+ * as well as writing past its own buffers.
+ *
+ * LLVMFuzzerTestOneInput() is the libFuzzer entry point
+ * (make wire-protocol-libfuzzer CLANG=clang). Built with gcc, the main() at
+ * the bottom drives it instead, with ASan and UBSan on: it runs the files
+ * it's given, one input each, so it also works as an AFL target
+ * (afl-fuzz -i in -o out -- ./wire-protocol-fuzz @@), or random inputs.
+ *
+ * Usage: wire-protocol-fuzz [-seed N] [file...]
+ */
+#include <string.h>
+#include <avr/eeprom.h>
+#include "sim.h"
+#include "main.h"
+#include "keyscanner.h"
+#include "led-spiout.h"
+#include "ringbuf.h"
+#include "twi-slave.h"
+#include "wire-protocol.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void write_and_read(const uint8_t *data, uint8_t len) {
+    // malloc(0) may return NULL, and the decoder must not touch it then
+    uint8_t *sent = malloc(len ? len : 1);
+    uint8_t *reply = malloc(TWI_BUFFER_SIZE);
+    uint8_t reply_size = TWI_BUFFER_SIZE;
+
+    memcpy(sent, data, len);
+    twi_data_received(len ? sent : NULL, len);
+    free(sent);
+
+    twi_data_requested(reply, &reply_size);
+    SIM_CHECK(reply_size >= 1 && reply_size <= TWI_BUFFER_SIZE, "a %u byte reply", reply_size);
+    free(reply);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // The LED count from the last input would outlive the reset
+    memset(sim_eeprom, 0xff, sizeof(sim_eeprom));
+    sim_reset();
+    led_init();
+    keyscanner_init();
+    twi_init();
+    // led_init() leaves the effect alone, and an input shouldn't start
+    // with the last one's
+    led_set_effect(LED_EFFECT_NONE, LED_EFFECT_SPEED_DEFAULT);
+    while (!ringbuf_empty()) {
+        ringbuf_pop();
+    }
+
+    while (size > 0) {
+        uint8_t len = data[0] % (TWI_BUFFER_SIZE + 1);
+
+        sim_matrix[data[0] % COUNT_ROWS] ^= _BV(data[0] / COUNT_ROWS % COUNT_COLS);
+        data++;
+        size--;
+        if (len > size) {
+            len = size;
+        }
+        write_and_read(data, len);
+        data += len;
+        size -= len;
+
+        TIMER1_COMPA_vect();
+        keyscanner_main();
+        led_effect_step();
+        sim_spi_drain();
+    }
+    return 0;
+}
+
+#if !defined(LIBFUZZER)
+
+#define RANDOM_INPUTS 20000
+#define MAX_INPUT 1024
+
+static int run_file(const char *path) {
+    static uint8_t data[64 * 1024];
+    FILE *in = fopen(path, "rb");
+    size_t size;
+
+    SIM_CHECK(in, "can't open %s", path);
+    size = fread(data, 1, sizeof(data), in);
+    fclose(in);
+    return LLVMFuzzerTestOneInput(data, size);
+}
+
+/* Random bytes, with most transactions starting with a real command, or an
+ * LED bank one */
+static size_t random_input(uint8_t *data) {
+    static const uint8_t commands[] = {
+        TWI_CMD_NONE, TWI_CMD_VERSION, TWI_CMD_KEYSCAN_INTERVAL, TWI_CMD_LED_SET_ALL_TO,
+        TWI_CMD_LED_SET_ONE_TO, TWI_CMD_KEYSCAN_IDLE_INTERVAL, TWI_CMD_LED_SPI_FREQUENCY,
+        TWI_CMD_LED_GLOBAL_BRIGHTNESS, TWI_CMD_LED_UPDATE_ALL, TWI_CMD_LED_FRAME_INTERVAL,
+        TWI_CMD_KEYSCAN_SETTLE_DELAY, TWI_CMD_KEYDATA_SIZE, TWI_CMD_KEYSCAN_TICKS, TWI_CMD_STATUS,
+        TWI_CMD_LED_SET_PALETTE, TWI_CMD_LED_UPDATE_INDEXED, TWI_CMD_LED_SET_RUNS, TWI_CMD_LED_GAMMA,
+        TWI_CMD_LED_EFFECT, TWI_CMD_LED_BRIGHTNESS_SCALE, TWI_CMD_LED_COUNT
+    };
+    size_t size = sim_rand() % MAX_INPUT;
+
+    for (size_t i = 0; i < size; i++) {
+        data[i] = sim_rand();
+    }
+    for (size_t i = 0; i + 1 < size; i += 2 + data[i] % (TWI_BUFFER_SIZE + 1)) {
+        switch (sim_rand() % 4) {
+        case 0:
+            break;
+        case 1:
+            data[i + 1] = TWI_CMD_LED_BASE | (data[i + 1] & 0x0f);
+            break;
+        default:
+            data[i + 1] = commands[sim_rand() % sizeof(commands)];
+            break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t data[MAX_INPUT];
+    int files = 0;
+
+    sim_srand(1);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            sim_srand(strtoul(argv[++i], NULL, 0));
+        } else {
+            run_file(argv[i]);
+            files++;
+        }
+    }
+    if (files > 0) {
+        printf("ok - %d inputs\n", files);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < RANDOM_INPUTS; i++) {
+        LLVMFuzzerTestOneInput(data, random_input(data));
+    }
+    printf("ok - %u random inputs through the TWI command decoder\n", RANDOM_INPUTS);
+    return 0;
+}
+
+#endif